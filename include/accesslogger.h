@@ -12,14 +12,32 @@
 #ifndef ACCESSLOGGER_H__
 #define ACCESSLOGGER_H__
 
+#include <pthread.h>
+#include <time.h>
+
+#include <atomic>
 #include <sstream>
 
 #include "logger.h"
+#include "cond_var.h"
 
 class AccessLogger
 {
 public:
-  AccessLogger(const std::string& directory);
+  /// Constructor.
+  ///
+  /// @param directory - The directory to write the access logs to.
+  /// @param async     - Whether to log asynchronously.  If so, log() just
+  ///                    copies the details of the request into a lock-free
+  ///                    ring, and a background thread formats the logs and
+  ///                    writes them to the file in batches.  If the ring is
+  ///                    full the log is dropped (and counted - see
+  ///                    get_dropped()).
+  /// @param ring_size - The number of logs the ring can hold when logging
+  ///                    asynchronously.  Rounded up to a power of 2.
+  AccessLogger(const std::string& directory,
+               bool async = false,
+               unsigned int ring_size = DEFAULT_RING_SIZE);
   ~AccessLogger();
 
   void log(const std::string& url,
@@ -27,10 +45,86 @@ public:
            int rc,
            unsigned long latency_us);
 
+  /// @return - The number of logs dropped because the ring was full.
+  uint64_t get_dropped() const { return _dropped.load(std::memory_order_relaxed); }
+
+  static const unsigned int DEFAULT_RING_SIZE = 4096;
+
 private:
   static const int BUFFER_SIZE = 1000;
 
+  // The longest method and URL that are logged asynchronously.  Longer ones
+  // are truncated.
+  static const int MAX_METHOD_LENGTH = 16;
+  static const int MAX_URL_LENGTH = 512;
+
+  // The most logs written in one batch.
+  static const int MAX_BATCH_SIZE = 64;
+
+  // How long the background thread waits for more logs when the ring is
+  // empty.  Producers wake it when they add a log to an empty ring, so this
+  // is just a backstop.
+  static const int FLUSH_INTERVAL_MS = 1000;
+
+  // A log waiting to be written, as it is held in the ring.
+  struct Record
+  {
+    // The position in the ring that this slot can next be written (if equal
+    // to the write position) or read (if one more than the read position)
+    // at.
+    std::atomic<uint64_t> sequence;
+
+    struct timespec time;
+    unsigned long latency_us;
+    int rc;
+    uint16_t method_length;
+    uint16_t url_length;
+    char method[MAX_METHOD_LENGTH];
+    char url[MAX_URL_LENGTH];
+  };
+
+  // Format a log line into buf, returning its length.
+  static int format(char* buf,
+                    const char* timestamp,
+                    int rc,
+                    const char* method,
+                    int method_length,
+                    const char* url,
+                    int url_length,
+                    unsigned long latency_us);
+
+  static void* writer_thread_fn(void* access_logger);
+  void writer_thread_fn();
+
+  // Whether the next record in the ring has been published.
+  bool record_ready();
+
+  // Write all the logs in the ring.  Returns the number written.
+  int write_batch();
+
   Logger* _logger;
+
+  // Asynchronous logging state.  The ring is a bounded multi-producer,
+  // single-consumer queue - producers claim a slot by advancing _write_pos
+  // and publish it by updating the slot's sequence number.
+  bool _async;
+  Record* _ring;
+  uint64_t _ring_mask;
+  std::atomic<uint64_t> _write_pos;
+  uint64_t _read_pos;
+  std::atomic<uint64_t> _dropped;
+  uint64_t _dropped_reported;
+
+  pthread_mutex_t _lock;
+  CondVar _cond;
+  bool _terminate;
+
+  // Set while the writer thread is (about to start) waiting on _cond for an
+  // empty ring.  The first producer to publish a log after it is set clears
+  // it and signals the condition, so producers only take the lock when the
+  // ring goes from empty to non-empty.
+  std::atomic<bool> _writer_waiting;
+  pthread_t _writer_thread;
 };
 
 #endif
@@ -16,6 +16,8 @@
 #include <map>
 #include <vector>
 #include <sstream>
+#include <memory>
+#include <atomic>
 #include <boost/regex.hpp>
 #include <pthread.h>
 
@@ -54,6 +56,13 @@ public:
 
   void clear_blacklist();
 
+  /// Whether the given AddrInfo is whitelisted, i.e. not blacklisted or
+  /// graylisted following a recent failure.
+  bool is_whitelisted(const AddrInfo& ai)
+  {
+    return (host_state(ai) == Host::State::WHITE);
+  }
+
   // LazyAResolveIter and LazySRVResolveIter must access the private host_state
   // method of BaseResolver, which it is desirable not to expose
   friend class LazyAResolveIter;
@@ -178,8 +187,7 @@ protected:
   typedef TTLCache<std::string, NAPTRReplacement> NAPTRCache;
   NAPTRCache* _naptr_cache;
 
-  /// The SRVPriorityList holds the result of an SRV lookup sorted into
-  /// priority groups.
+  /// Holds a single SRV record from an SRV lookup.
   struct SRV
   {
     std::string target;
@@ -191,7 +199,64 @@ protected:
       return weight;
     }
   };
-  typedef std::map<int, std::vector<SRV> > SRVPriorityList;
+
+  /// A precomputed plan for selecting targets from the SRVs at one priority
+  /// level for one address family.  This is built the first time an iterator
+  /// needs the priority level and shared by all later iterators, which copy
+  /// the selector rather than rebuilding it and use the addresses rather than
+  /// repeating the A/AAAA record lookups.  Host states are not part of the
+  /// plan - they are always checked when targets are selected.
+  struct SRVSelectionPlan
+  {
+    SRVSelectionPlan(const std::vector<SRV>& srvs) :
+      selector(srvs),
+      addresses(srvs.size()),
+      records_expiry(0),
+      expires(0)
+    {
+    }
+
+    /// Selector initialised with the weights of the SRVs.
+    WeightedSelector<SRV> selector;
+
+    /// The addresses each SRV resolved to, in the same order as the SRVs.
+    std::vector<std::vector<IP46Address> > addresses;
+
+    /// The time at which the first of the A/AAAA records in the plan expires,
+    /// or zero if there were no records.
+    time_t records_expiry;
+
+    /// The time at which the plan must be rebuilt.
+    time_t expires;
+  };
+
+  /// The SRVPriorityList holds the result of an SRV lookup sorted into
+  /// priority groups, along with a selection plan for each priority group that
+  /// has been used.  The plans are discarded along with the list when the SRV
+  /// cache entry expires.
+  class SRVPriorityList : public std::map<int, std::vector<SRV> >
+  {
+  public:
+    SRVPriorityList();
+    ~SRVPriorityList();
+
+    SRVPriorityList(const SRVPriorityList&) = delete;
+    SRVPriorityList& operator=(const SRVPriorityList&) = delete;
+
+    /// Returns the selection plan for the given priority level and address
+    /// family, or NULL if there isn't one or it has expired.
+    std::shared_ptr<const SRVSelectionPlan> get_plan(int priority, int af);
+
+    /// Stores a selection plan for the given priority level and address
+    /// family.
+    void set_plan(int priority,
+                  int af,
+                  std::shared_ptr<const SRVSelectionPlan> plan);
+
+  private:
+    pthread_mutex_t _plans_lock;
+    std::map<std::pair<int, int>, std::shared_ptr<const SRVSelectionPlan> > _plans;
+  };
 
   /// Factory class to handle populating entries from the SRV cache.
   class SRVCacheFactory : public CacheFactory<std::string, SRVPriorityList>
@@ -235,15 +300,14 @@ protected:
   /// Private class to hold data and methods associated to an IP/transport/port
   /// combination in the blacklist system. Each Host is associated with exactly
   /// one such combination.
+  ///
+  /// The state of a Host is held in atomics, so it can be read without
+  /// holding _hosts_lock.  It is only updated with _hosts_lock held.
   class Host
   {
   public:
-    /// Constructor
-    /// @param blacklist_ttl The time in seconds for the host to remain on the
-    ///                      blacklist before moving to the graylist
-    /// @param graylist_ttl  The time in seconds for the host to remain on the
-    ///                      graylist before moving to the whitelist
-    Host(int blacklist_ttl, int graylist_ttl);
+    /// Constructor.  The Host starts off whitelisted.
+    Host();
 
     /// Destructor
     ~Host();
@@ -258,44 +322,144 @@ protected:
 
     /// Returns the state of this Host at the given time in seconds since the
     /// epoch
-    State get_state() {return get_state(time(NULL));}
-    State get_state(time_t current_time);
+    State get_state() const {return get_state(time(NULL));}
+    State get_state(time_t current_time) const;
+
+    /// Blacklists this Host.
+    /// @param blacklist_ttl The time in seconds for the host to remain on the
+    ///                      blacklist before moving to the graylist
+    /// @param graylist_ttl  The time in seconds for the host to remain on the
+    ///                      graylist before moving to the whitelist
+    void blacklist(int blacklist_ttl, int graylist_ttl);
+
+    /// Whitelists this Host, whatever its current state.
+    void clear();
 
     /// Indicates that this Host has been successfully contacted.
     void success();
 
     /// Indicates that this Host is selected for probing by the given user.
-    void selected_for_probing(pthread_t user_id);
+    /// Returns false if the Host is not graylisted or another user has
+    /// already been selected to probe it.
+    bool selected_for_probing(pthread_t user_id);
 
   private:
     /// The time in seconds since the epoch at which this Host is to be removed
     /// from the blacklist and placed onto the graylist.
-    time_t _blacklist_expiry_time;
+    std::atomic<time_t> _blacklist_expiry_time;
 
     /// The time in seconds since the epoch at which this Host is to be removed
     /// from the graylist.
-    time_t _graylist_expiry_time;
+    std::atomic<time_t> _graylist_expiry_time;
 
     /// Indicates that this Host is currently being probed.
-    bool _being_probed;
+    std::atomic<bool> _being_probed;
 
-    /// The ID of the thread currently probing this Host.
+    /// The ID of the thread currently probing this Host.  Only written by the
+    /// thread that successfully sets _being_probed.
     pthread_t _probing_user_id;
   };
 
+  /// The hosts table is a fixed size open addressing hash table, so that the
+  /// state of a Host can be read without taking any locks.  A whitelisted
+  /// Host is equivalent to no Host, so a slot is claimed for an AddrInfo
+  /// (under _hosts_lock) when it is blacklisted, and becomes a tombstone,
+  /// which can be claimed for another AddrInfo, once it is whitelisted again.
+  /// An AddrInfo is always stored within MAX_HOST_PROBES slots of the slot it
+  /// hashes to, so lookups never have to search the whole table.
+  ///
+  /// Each slot has a sequence number, which is odd while the slot is being
+  /// claimed or tombstoned.  Readers check that it is even and unchanged
+  /// after reading a slot, and retry if not, so they never act on a slot that
+  /// was reused while they were reading it.  Hosts in the table are only
+  /// updated under _hosts_lock.
+  ///
+  /// Hosts that don't fit in the table are added to an overflow map, which is
+  /// only read (under _hosts_lock) while it is non-empty.  Whitelisted Hosts
+  /// are removed from the map whenever it is read or added to, so it only
+  /// holds Hosts that aren't whitelisted.
+  static const size_t HOST_TABLE_SIZE = 1024;
+  static const size_t MAX_HOST_TABLE_ENTRIES = (HOST_TABLE_SIZE * 3) / 4;
+  static const size_t MAX_HOST_PROBES = 32;
+
+  /// The fields of an AddrInfo that identify a Host, packed into words so
+  /// that they can be stored in atomics.
+  static const int HOST_KEY_WORDS = 4;
+  typedef uint64_t HostKey[HOST_KEY_WORDS];
+
+  struct HostSlot
+  {
+    enum State {EMPTY, USED, TOMBSTONE};
+
+    HostSlot() : sequence(0), state(EMPTY), key(), host() {}
+
+    std::atomic<uint32_t> sequence;
+    std::atomic<int> state;
+    std::atomic<uint64_t> key[HOST_KEY_WORDS];
+    Host host;
+  };
+
   pthread_mutex_t _hosts_lock;
-  typedef std::map<AddrInfo, Host> Hosts;
-  Hosts _hosts;
+  HostSlot* _host_table;
+  size_t _host_table_entries;
+  std::map<AddrInfo, Host*> _host_overflow;
+
+  /// Set while _host_overflow is non-empty.
+  std::atomic<bool> _host_overflow_used;
+
+  /// Returns the state of the Host associated with the given AddrInfo,
+  /// without any logging.  Only takes _hosts_lock if there are Hosts in the
+  /// overflow map.
+  Host::State lookup_host_state(const AddrInfo& ai, time_t current_time);
+
+  /// Reads the state of the Host associated with the given AddrInfo from the
+  /// hosts table, without taking any locks.  Returns false if the AddrInfo
+  /// isn't in the table.
+  bool read_host_state(const HostKey& key,
+                       time_t current_time,
+                       Host::State& state);
+
+  /// Returns the slot in the hosts table holding the given key, or NULL if
+  /// there isn't one.  Must be called with _hosts_lock held.
+  HostSlot* find_host_slot(const HostKey& key);
+
+  /// Returns the Host associated with the given AddrInfo (in the table or the
+  /// overflow map), or NULL if it is not in the blacklist system.  Must be
+  /// called with _hosts_lock held, and the Host must not be used once it is
+  /// released.
+  Host* find_host(const AddrInfo& ai);
+
+  /// Returns the Host associated with the given AddrInfo, adding a
+  /// (whitelisted) one if there isn't one already.  Must be called with
+  /// _hosts_lock held.
+  Host* find_or_add_host(const AddrInfo& ai, time_t current_time);
+
+  /// Claims a slot for the given key, or tombstones a slot.  Must be called
+  /// with _hosts_lock held.
+  void claim_host_slot(HostSlot& slot, const HostKey& key);
+  void tombstone_host_slot(HostSlot& slot);
+
+  /// Removes whitelisted Hosts from the overflow map.  Must be called with
+  /// _hosts_lock held.
+  void sweep_host_overflow(time_t current_time);
+
+  /// Fills in the key for the given AddrInfo.
+  static void host_key(const AddrInfo& ai, HostKey& key);
+
+  /// Returns the slot in the hosts table at which to start searching for the
+  /// given key.
+  static size_t host_hash(const HostKey& key);
 
   /// Returns the state of the Host associated with the given AddrInfo, if it is
-  /// in the blacklist system, and Host::State::WHITE otherwise. _hosts_lock
-  /// must be held when calling this method.
+  /// in the blacklist system, and Host::State::WHITE otherwise.  This only
+  /// takes _hosts_lock if there are Hosts in the overflow map.
   Host::State host_state(const AddrInfo& ai) {return host_state(ai, time(NULL));}
   Host::State host_state(const AddrInfo& ai, time_t current_time);
 
   /// Indicates that the calling thread is selected to probe the given AddrInfo.
-  /// _hosts_lock must be held when calling this method.
-  void select_for_probing(const AddrInfo& ai);
+  /// Returns false if the AddrInfo is not available for probing (for example
+  /// because another thread has already been selected to probe it).
+  bool select_for_probing(const AddrInfo& ai);
 
   /// Helper function to create SAS logs if no targets were resolved. Says if
   /// this was because only whitelisted or blacklisted targets were requested,
@@ -329,6 +493,14 @@ protected:
                                                 int &ttl,
                                                 SAS::TrailId trail);
 
+  /// Returns the selection plan for the given priority level of an SRV
+  /// Priority List, building it (which involves A/AAAA record lookups for
+  /// each SRV) if there isn't a current one.
+  std::shared_ptr<const SRVSelectionPlan> get_selection_plan(SRVPriorityList& srv_list,
+                                                             SRVPriorityList::const_iterator level,
+                                                             int af,
+                                                             SAS::TrailId trail);
+
   int _default_blacklist_duration;
   int _default_graylist_duration;
 
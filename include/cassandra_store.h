@@ -43,12 +43,19 @@
 #include "thrift/protocol/TBinaryProtocol.h"
 #include "Cassandra.h"
 
+#include <atomic>
+#include <exception>
+#include <memory>
+
 #include "threadpool.h"
 #include "utils.h"
+#include "cond_var.h"
 #include "sas.h"
 #include "communicationmonitor.h"
 #include "a_record_resolver.h"
 #include "cassandra_connection_pool.h"
+#include "store_statistics.h"
+#include "snmp_counter_table.h"
 
 // Shortcut for the apache cassandra namespace.
 namespace cass = org::apache::cassandra;
@@ -151,6 +158,13 @@ public:
                                 const cass::KeyRange& range,
                                 const cass::ConsistencyLevel::type consistency_level) = 0;
 
+  // These are only used for token-aware routing, so have default
+  // implementations (which return nothing, so disable the routing) rather
+  // than every client needing to implement them.
+  virtual void describe_ring(std::vector<cass::TokenRange>& _return,
+                             const std::string& keyspace) {}
+  virtual void describe_partitioner(std::string& _return) {}
+
 
   /// Get an entire row (non-HA).
   /// @param consistency_level cassandra consistency level.
@@ -310,6 +324,9 @@ public:
                         const cass::SlicePredicate& predicate,
                         const cass::KeyRange& range,
                         const cass::ConsistencyLevel::type consistency_level);
+  void describe_ring(std::vector<cass::TokenRange>& _return,
+                     const std::string& keyspace);
+  void describe_partitioner(std::string& _return);
 
 private:
   cass::CassandraClient _cass_client;
@@ -317,6 +334,292 @@ private:
   bool _connected;
 };
 
+/// Merges the batch_mutate requests made by operations running concurrently
+/// on different threads into a single request, so that many small writes
+/// cost one round trip rather than one each.
+///
+/// The first request to arrive opens a batch and waits for a short window for
+/// others to join it.  Requests only join batches for the same target node
+/// and consistency level, so each node gets its own batch (which keeps writes
+/// on the replica that token-aware routing picked for them).  The first
+/// request then sends the whole batch on its own connection to that node.
+/// Every request in the batch blocks until the batch has been sent and then
+/// sees its result - if the batch fails, each request throws the same
+/// exception, which the store handles (and retries) as normal for each
+/// operation.  As every request in the batch was for the same node, a
+/// connection error is correctly attributed to that node.
+class MutationAggregator
+{
+public:
+  typedef std::map<std::string, std::map<std::string, std::vector<cass::Mutation> > > MutationMap;
+
+  /// Constructor.
+  ///
+  /// @param window_us      - How long (in microseconds) to wait for other
+  ///                         requests to join a batch.
+  /// @param max_operations - The maximum number of requests in a batch.  A
+  ///                         full batch is sent without waiting for the rest
+  ///                         of the window.  0 => no limit.
+  MutationAggregator(unsigned int window_us, unsigned int max_operations);
+  virtual ~MutationAggregator();
+
+  /// Add mutations to a batch and wait until the batch has been sent.
+  ///
+  /// @param client            - The client to send the batch on, if this
+  ///                            request opens the batch.
+  /// @param target            - The node the client is connected to.
+  /// @param mutation_map      - The mutations to make.
+  /// @param consistency_level - Cassandra consistency level.
+  void batch_mutate(Client* client,
+                    const AddrInfo& target,
+                    const MutationMap& mutation_map,
+                    cass::ConsistencyLevel::type consistency_level);
+
+private:
+  struct Batch
+  {
+    Batch() : mutations(), operations(0), sent(false), exception() {}
+
+    MutationMap mutations;
+    unsigned int operations;
+    bool sent;
+
+    // The exception thrown when sending the batch (if any).
+    std::exception_ptr exception;
+  };
+
+  // Add one set of mutations to another.
+  static void merge(MutationMap& into, const MutationMap& from);
+
+  const unsigned int _window_us;
+  const unsigned int _max_operations;
+
+  // Protects the batches.
+  pthread_mutex_t _lock;
+
+  // Signalled when a batch fills up and when a batch has been sent.
+  CondVar _cond;
+
+  // Batches are per target node and consistency level.
+  typedef std::pair<AddrInfo, cass::ConsistencyLevel::type> BatchKey;
+
+  // The batches that are still accepting requests.
+  std::map<BatchKey, std::shared_ptr<Batch> > _open_batches;
+};
+
+/// A client that passes batch_mutate requests to a MutationAggregator and
+/// all other requests straight to another client.
+class BatchingClient : public Client
+{
+public:
+  BatchingClient(Client* client,
+                 const AddrInfo& target,
+                 MutationAggregator* aggregator) :
+    _client(client), _target(target), _aggregator(aggregator)
+  {}
+
+  virtual ~BatchingClient() {}
+
+  bool is_connected() { return _client->is_connected(); }
+  void connect() { _client->connect(); }
+  void set_keyspace(const std::string& keyspace)
+  {
+    _client->set_keyspace(keyspace);
+  }
+
+  void batch_mutate(const std::map<std::string,
+                    std::map<std::string,
+                    std::vector<cass::Mutation> > >& mutation_map,
+                    const cass::ConsistencyLevel::type consistency_level)
+  {
+    _aggregator->batch_mutate(_client, _target, mutation_map, consistency_level);
+  }
+
+  void get_slice(std::vector<cass::ColumnOrSuperColumn>& _return,
+                 const std::string& key,
+                 const cass::ColumnParent& column_parent,
+                 const cass::SlicePredicate& predicate,
+                 const cass::ConsistencyLevel::type consistency_level)
+  {
+    _client->get_slice(_return, key, column_parent, predicate, consistency_level);
+  }
+
+  void multiget_slice(std::map<std::string, std::vector<cass::ColumnOrSuperColumn> >& _return,
+                      const std::vector<std::string>& keys,
+                      const cass::ColumnParent& column_parent,
+                      const cass::SlicePredicate& predicate,
+                      const cass::ConsistencyLevel::type consistency_level)
+  {
+    _client->multiget_slice(_return, keys, column_parent, predicate, consistency_level);
+  }
+
+  void remove(const std::string& key,
+              const cass::ColumnPath& column_path,
+              const int64_t timestamp,
+              const cass::ConsistencyLevel::type consistency_level)
+  {
+    _client->remove(key, column_path, timestamp, consistency_level);
+  }
+
+  void get_range_slices(std::vector<cass::KeySlice> & _return,
+                        const cass::ColumnParent& column_parent,
+                        const cass::SlicePredicate& predicate,
+                        const cass::KeyRange& range,
+                        const cass::ConsistencyLevel::type consistency_level)
+  {
+    _client->get_range_slices(_return, column_parent, predicate, range, consistency_level);
+  }
+
+  void describe_ring(std::vector<cass::TokenRange>& _return,
+                     const std::string& keyspace)
+  {
+    _client->describe_ring(_return, keyspace);
+  }
+
+  void describe_partitioner(std::string& _return)
+  {
+    _client->describe_partitioner(_return);
+  }
+
+private:
+  Client* _client;
+  AddrInfo _target;
+  MutationAggregator* _aggregator;
+};
+
+/// A cursor over the rows of a column family, which fetches them a page at a
+/// time (with get_range_slices), so that scanning a large column family only
+/// needs one page in memory at once.
+///
+/// The cursor remembers where it has got to, so if fetching a page fails it
+/// can be retried (e.g. with another client) and the scan carries on from the
+/// same place.  Rows are returned in token order.
+class RowCursor
+{
+public:
+  /// Constructor.
+  ///
+  /// @param column_family     - The column family to scan.
+  /// @param predicate         - Which columns to get from each row.
+  /// @param page_size         - The number of rows to fetch at a time.
+  /// @param consistency_level - Cassandra consistency level.
+  RowCursor(const std::string& column_family,
+            const cass::SlicePredicate& predicate,
+            int32_t page_size,
+            cass::ConsistencyLevel::type consistency_level = cass::ConsistencyLevel::ONE);
+
+  /// Fetch the next page of rows.  Deleted rows (which Cassandra returns
+  /// with no columns) are skipped, so a page may have fewer than page_size
+  /// rows, or none, even if the scan isn't finished.
+  ///
+  /// @param client            - The client to fetch the rows with.
+  /// @param rows              - (out) The rows.
+  void next_page(Client* client, std::vector<cass::KeySlice>& rows);
+
+  /// @return                  - Whether all the rows have been fetched.
+  bool finished() const { return _finished; }
+
+private:
+  const std::string _column_family;
+  const cass::SlicePredicate _predicate;
+  const int32_t _page_size;
+  const cass::ConsistencyLevel::type _consistency_level;
+
+  // The key of the last row fetched (whether or not it was deleted).  The
+  // next page starts from this row, as range slices can't exclude their start
+  // key.
+  std::string _last_key;
+  bool _started;
+  bool _finished;
+};
+
+/// A cursor over the columns of a (wide) row, which fetches them a page at a
+/// time.  Like RowCursor, fetching a page can be retried.
+class ColumnCursor
+{
+public:
+  /// Constructor.
+  ///
+  /// @param column_family     - The column family to operate on.
+  /// @param key               - Row key.
+  /// @param page_size         - The number of columns to fetch at a time.
+  /// @param start             - The first column name to fetch (inclusive).
+  ///                            Empty means the start of the row.
+  /// @param finish            - The last column name to fetch (inclusive).
+  ///                            Empty means the end of the row.
+  /// @param consistency_level - Cassandra consistency level.
+  ColumnCursor(const std::string& column_family,
+               const std::string& key,
+               int32_t page_size,
+               const std::string& start = "",
+               const std::string& finish = "",
+               cass::ConsistencyLevel::type consistency_level = cass::ConsistencyLevel::ONE);
+
+  /// Fetch the next page of columns.  This does not throw
+  /// RowNotFoundException - if the row doesn't exist there are no columns.
+  ///
+  /// @param client            - The client to fetch the columns with.
+  /// @param columns           - (out) The columns.
+  void next_page(Client* client, std::vector<cass::ColumnOrSuperColumn>& columns);
+
+  /// @return                  - Whether all the columns have been fetched.
+  bool finished() const { return _finished; }
+
+private:
+  const std::string _column_family;
+  const std::string _key;
+  const int32_t _page_size;
+  const std::string _finish;
+  const cass::ConsistencyLevel::type _consistency_level;
+
+  // The name of the next column to fetch from (inclusive), and whether
+  // the first column returned is the last one of the previous page (and so
+  // should be skipped).
+  std::string _start;
+  bool _started;
+  bool _finished;
+};
+
+/// The token ring of a Cassandra cluster (as reported by describe_ring), used
+/// to find the nodes that hold a given row.  Only the Murmur3Partitioner
+/// (Cassandra's default) is supported - with any other partitioner the ring
+/// is empty.
+class TokenRing
+{
+public:
+  /// Constructor.
+  ///
+  /// @param partitioner    - The partitioner's class name (as reported by
+  ///                         describe_partitioner).
+  /// @param ranges         - The token ranges (as reported by describe_ring).
+  /// @param port           - The port to use to connect to the nodes.
+  TokenRing(const std::string& partitioner,
+            const std::vector<cass::TokenRange>& ranges,
+            int port);
+
+  /// @return               - Whether the ring has any nodes in it.
+  bool empty() const { return _ranges.empty(); }
+
+  /// Get the nodes holding a row.
+  ///
+  /// @param key            - The row key.
+  /// @param replicas       - (out) The nodes holding the row, in the order
+  ///                         Cassandra lists them.
+  void get_replicas(const std::string& key,
+                    std::vector<AddrInfo>& replicas) const;
+
+  /// Calculate the token of a row key using the Murmur3Partitioner's hash.
+  /// This reproduces Cassandra's MurmurHash3 implementation exactly
+  /// (including its sign extension of the trailing bytes).
+  static int64_t murmur3_token(const std::string& key);
+
+private:
+  // The end token (inclusive) of each range and the nodes that hold it,
+  // sorted by end token.  Each range starts just after the previous one ends,
+  // and the first also covers the tokens after the last.
+  std::vector<std::pair<int64_t, std::vector<AddrInfo> > > _ranges;
+};
+
 /// The possible outcomes of a cassandra interaction.
 ///
 /// These values are logged to SAS so:
@@ -377,6 +680,14 @@ public:
   /// @return                - The status of the store connection.
   virtual ResultCode connection_test();
 
+  /// Record per-operation and per-node statistics in the supplied object.
+  /// This must be called before the store is used.  The statistics object is
+  /// not owned by the store.
+  ///
+  /// Operations are recorded under the names returned by their
+  /// get_stats_table() and get_stats_operation() methods.
+  virtual void set_statistics(StoreStatistics* stats) { _stats = stats; }
+
   /// Perform an operation synchronously.  This blocks the current thread
   /// until the operation is complete.  The result of the operation is stored
   /// on the operation object.
@@ -417,6 +728,69 @@ public:
                                  unsigned int num_threads,
                                  unsigned int max_queue = 0);
 
+  /// Configure an elastic worker pool, whose number of threads varies with
+  /// load.  See ElasticThreadPool.
+  ///
+  /// @param exception_handler    - The exception handler
+  /// @param min_threads          - The minimum number of worker threads.
+  /// @param max_threads          - The maximum number of worker threads, and
+  ///                               hence of concurrent async requests to
+  ///                               cassandra.
+  /// @param max_queue            - As for configure_workers().
+  /// @param target_queue_wait_ms - How long a request can wait for a worker
+  ///                               thread before the pool adds a thread.
+  virtual void configure_elastic_workers(ExceptionHandler* exception_handler,
+                                         unsigned int min_threads,
+                                         unsigned int max_threads,
+                                         unsigned int max_queue = 0,
+                                         unsigned int target_queue_wait_ms = 10);
+
+  /// Merge the writes made by operations running at the same time (e.g. on
+  /// different worker threads) into a single batch_mutate request per node.
+  /// See MutationAggregator.  This must be called before the store is used.
+  ///
+  /// @param window_us         - How long (in microseconds) a write waits for
+  ///                            others to join its batch.
+  /// @param max_operations    - The maximum number of writes in a batch.
+  ///                            0 => no limit.
+  virtual void configure_write_batching(unsigned int window_us,
+                                        unsigned int max_operations = 0);
+
+  /// Speculatively retry HA reads at consistency level ONE.  By default an HA
+  /// read is only retried at level ONE once the level TWO read has failed,
+  /// which on a degraded cluster means waiting for a timeout.  With this
+  /// configured, the ONE read is also sent (on a separate connection) if the
+  /// TWO read hasn't completed within the hedge delay, and the first adequate
+  /// answer is used.  This must be called before the store is started.
+  ///
+  /// @param exception_handler - The exception handler
+  /// @param hedge_delay_ms    - How long (in milliseconds) to wait for the TWO
+  ///                            read before sending the ONE read.
+  /// @param num_threads       - The number of threads used to make the
+  ///                            speculative reads.  Each HA read in progress
+  ///                            uses up to two, but only once the ONE read
+  ///                            has been sent.
+  /// @param two_wins_table    - Optional counter of reads answered at level
+  ///                            TWO.
+  /// @param one_wins_table    - Optional counter of reads answered at level
+  ///                            ONE.
+  virtual void configure_speculative_reads(ExceptionHandler* exception_handler,
+                                           unsigned int hedge_delay_ms,
+                                           unsigned int num_threads,
+                                           SNMP::CounterTable* two_wins_table = NULL,
+                                           SNMP::CounterTable* one_wins_table = NULL);
+
+  /// Send operations that only access a single row (see
+  /// Operation::get_routing_key) to a node that holds the row, to save
+  /// Cassandra an extra hop to forward the request.  The store learns the
+  /// token ring from Cassandra on a background thread once it is started, and
+  /// refreshes it periodically.  Requests never wait for the ring - until the
+  /// store has learned it, and if the node is blacklisted or fails, the store
+  /// falls back to the resolver's targets.
+  ///
+  /// @param refresh_interval_ms - How often to refresh the token ring.
+  virtual void configure_token_aware_routing(unsigned int refresh_interval_ms = 60000);
+
   /// Start the store.
   ///
   /// Start any necessary worker threads.
@@ -455,14 +829,16 @@ public:
 
 private:
   /// The thread pool used by the store.  This is a simple subclass of
-  /// ThreadPool that also stores a pointer back to the store.
-  class Pool : public ThreadPool<std::pair<Operation*, Transaction*> >
+  /// ElasticThreadPool that also stores a pointer back to the store.
+  class Pool : public ElasticThreadPool<std::pair<Operation*, Transaction*> >
   {
   public:
     Pool(Store* store,
-         unsigned int num_threads,
+         unsigned int min_threads,
+         unsigned int max_threads,
          ExceptionHandler* exception_handler,
-         unsigned int max_queue = 0);
+         unsigned int max_queue = 0,
+         unsigned int target_queue_wait_ms = 10);
     virtual ~Pool();
 
   private:
@@ -477,11 +853,42 @@ private:
     }
   };
 
-  // Private method that is used by do_sync() and connection_test()
+  friend class HAOperation;
+
+  static void speculation_exception_callback(std::function<void()> work)
+  {
+    // No recovery behaviour, as the HA read that made the request will see
+    // that it never completed.
+  }
+
+  // Get the last known token ring to use for routing.  May return an empty
+  // pointer.
+  std::shared_ptr<const TokenRing> get_ring();
+
+  // Get the token ring from Cassandra.  Returns whether this succeeded.
+  bool refresh_ring(SAS::TrailId trail);
+
+  // The thread that refreshes the token ring.
+  static void* static_ring_thread_function(void* store);
+  void ring_thread_function();
+
+  // How long to wait before trying again to get the token ring, if it
+  // couldn't be fetched.
+  static const unsigned int RING_RETRY_MS = 1000;
+
+  // Get a connection to the specified Cassandra node and run the supplied
+  // function with it.  Thrift exceptions are passed back to the caller.
+  void run_on_connection(const AddrInfo& target,
+                         std::function<void(Client*)> fn);
+
+  // Private method that is used by do_sync() and connection_test().  If
+  // `attempts` is not NULL it is set to the number of times the operation was
+  // performed.
   bool perform_op(Operation* op,
                   SAS::TrailId trail,
                   ResultCode& cass_result,
-                  std::string& cass_error_text);
+                  std::string& cass_error_text,
+                  unsigned int* attempts = NULL);
 
   // DNS resolver
   CassandraResolver* _resolver;
@@ -493,21 +900,55 @@ private:
   std::string _cass_hostname;
   uint16_t _cass_port;
 
-  // Exception handler
+  // Exception handler, for the worker and speculative read pools.  Set up by
+  // the call to configure_workers(), configure_elastic_workers() or
+  // configure_speculative_reads().
   ExceptionHandler* _exception_handler;
 
   // Thread pool management.
   //
-  // _num_threads and _max_queue are set up by the call to configure().  These
-  // are used when creating the thread pool in the call to start().
+  // _num_threads, _max_threads, _max_queue and _target_queue_wait_ms are set
+  // up by the call to configure_workers() or configure_elastic_workers().
+  // These are used when creating the thread pool in the call to start().
+  // _num_threads is the minimum number of threads.
   unsigned int _num_threads;
+  unsigned int _max_threads;
   unsigned int _max_queue;
+  unsigned int _target_queue_wait_ms;
   Pool* _thread_pool;
 
   // Helper used to track local communication state, and issue/clear alarms
   // based upon recent activity.
   BaseCommunicationMonitor* _comm_monitor;
 
+  // Where to record statistics (may be NULL).
+  StoreStatistics* _stats;
+
+  // Used to batch writes, if configured (otherwise NULL).
+  MutationAggregator* _aggregator;
+
+  // Speculative HA reads.  _speculation_pool is created in start() if
+  // configure_speculative_reads() has been called, and is otherwise NULL.
+  // _speculation_running is cleared in stop() before the pool's queue is
+  // purged, after which no more reads are queued on it.
+  unsigned int _speculation_delay_ms;
+  unsigned int _speculation_threads;
+  FunctorThreadPool* _speculation_pool;
+  std::atomic<bool> _speculation_running;
+  SNMP::CounterTable* _two_wins_table;
+  SNMP::CounterTable* _one_wins_table;
+
+  // Token-aware routing.  _ring_lock protects the fields after it.
+  // _ring_cond is signalled to stop the refresh thread.
+  bool _token_aware;
+  unsigned int _ring_refresh_ms;
+  pthread_mutex_t _ring_lock;
+  CondVar _ring_cond;
+  std::shared_ptr<const TokenRing> _ring;
+  bool _ring_thread_running;
+  bool _ring_terminate;
+  pthread_t _ring_thread;
+
   // Cassandra connection management.
   //
   // The CassandraConnectionPool manages the actual connections. Each thread
@@ -587,6 +1028,19 @@ public:
   ///                 or an empty string if the operation succeeded.
   virtual std::string get_error_text();
 
+  /// @return       - The table (column family) to record statistics for this
+  ///                 operation against.  Operations that don't override this
+  ///                 (and get_stats_operation) are all recorded together.
+  virtual std::string get_stats_table() { return "cassandra"; }
+
+  /// @return       - The name of this operation in statistics (e.g. "get").
+  virtual const char* get_stats_operation() { return "operation"; }
+
+  /// @return       - The key of the row this operation accesses, if it only
+  ///                 accesses one row, so that the store can send it to a
+  ///                 node holding the row.  Empty (the default) otherwise.
+  virtual std::string get_routing_key() { return ""; }
+
 protected:
   friend class Store;
 
@@ -608,6 +1062,14 @@ protected:
   /// @return        - Whether the operation succeeded.
   virtual bool perform(Client* client, SAS::TrailId trail) = 0;
 
+  /// Called by the store before each call to perform() to say which store and
+  /// Cassandra node the client is connected to.  The default implementation
+  /// does nothing.
+  ///
+  /// @param store   - The store performing the operation.
+  /// @param target  - The node the client is connected to.
+  virtual void set_target(Store* store, const AddrInfo& target) {}
+
   /// Called automatically by the store if it catches an unhandled exception.
   /// The store converts these to a result code and a textual description.
   ///
@@ -630,6 +1092,46 @@ protected:
   std::string _cass_error_text;
 };
 
+/// An operation that scans a column family a page at a time, passing each page
+/// to process_rows() before fetching the next.  This is an abstract class -
+/// subclasses implement process_rows().
+///
+/// A scan can be run on the store's worker pool with do_async() like any other
+/// operation.  As the next page isn't fetched until the previous one has been
+/// processed, a slow consumer slows the scan down rather than rows building up
+/// in memory.  If the scan fails part way through and the store retries it, it
+/// carries on from where it got to.
+class ScanOperation : public Operation
+{
+public:
+  /// Constructor.  The parameters are as for RowCursor.
+  ScanOperation(const std::string& column_family,
+                const cass::SlicePredicate& predicate,
+                int32_t page_size,
+                cass::ConsistencyLevel::type consistency_level = cass::ConsistencyLevel::ONE);
+
+  virtual const char* get_stats_operation() { return "scan"; }
+
+  /// @return       - The number of rows passed to process_rows() so far.
+  uint64_t get_rows_scanned() { return _rows_scanned; }
+
+protected:
+  /// Process a page of rows.
+  ///
+  /// @param rows   - The rows.  May be empty.
+  /// @param trail  - SAS trail ID.
+  ///
+  /// @return       - Whether to carry on scanning.
+  virtual bool process_rows(std::vector<cass::KeySlice>& rows,
+                            SAS::TrailId trail) = 0;
+
+  bool perform(Client* client, SAS::TrailId trail);
+
+private:
+  RowCursor _cursor;
+  uint64_t _rows_scanned;
+};
+
 /// This is an abstract class that allows for HA get requests to be made.
 /// These requests make a consistency level TWO request the first time the
 /// operation is perfomed, and a consistency level ONE request for any
@@ -717,10 +1219,31 @@ public:
                                        const std::string& prefix,
                                        std::map<std::string, std::vector<cass::ColumnOrSuperColumn> >& columns,
                                        SAS::TrailId trail);
+protected:
+  virtual void set_target(Store* store, const AddrInfo& target);
+
 private:
+  // Whether the store is configured to make speculative reads (and is
+  // running).
+  bool speculate();
+
+  // Make a speculative HA get, by calling `fn` at consistency levels TWO and
+  // (after the hedge delay) ONE in parallel, and returning the first adequate
+  // result.  Returns false (having set _consistency_two_tried if the TWO
+  // request was made) if the store stopped before the get was answered, in
+  // which case the caller should make the remaining requests itself.
+  template <class T>
+  bool speculative_get(std::function<void(Client*, T&, cass::ConsistencyLevel::type)> fn,
+                       T& result,
+                       SAS::TrailId trail);
+
   // This tracks whether we have alrady made a consistency level TWO request,
   // and hence whether our next request should be ONE.
   bool _consistency_two_tried;
+
+  // The store and node that this operation is currently being performed on.
+  Store* _store;
+  AddrInfo _target;
 };
 
 }; // namespace CassandraStore
@@ -14,6 +14,7 @@
 
 #include <string>
 #include <list>
+#include <vector>
 
 #include "dnsrrecords.h"
 
@@ -24,25 +25,115 @@ public:
             int length);
   ~DnsParser();
 
+  /// Reference to an encoded domain name in the message buffer.  The name
+  /// is validated when the message is parsed, but compression pointers are
+  /// only followed (and the name decoded) when it is actually needed.
+  class NameRef
+  {
+  public:
+    NameRef() : _parser(NULL), _nptr(NULL) {}
+
+    /// Decodes the name into an owned string.
+    std::string to_string() const;
+
+    /// Case-insensitively compares the name with the supplied string,
+    /// without decoding it into a temporary string.
+    bool matches(const std::string& name) const;
+
+  private:
+    friend class DnsParser;
+    NameRef(const DnsParser* parser, const unsigned char* nptr) :
+      _parser(parser),
+      _nptr(nptr)
+    {
+    }
+
+    const DnsParser* _parser;
+    const unsigned char* _nptr;
+  };
+
+  /// Unmaterialised resource record.  This holds the fixed RR fields and
+  /// points into the message buffer for the owner name and RDATA, so it is
+  /// only valid while the parser and the buffer it was built on exist.
+  class RecordRef
+  {
+  public:
+    const NameRef& rrname() const { return _rrname; }
+    int rrtype() const { return _rrtype; }
+    int rrclass() const { return _rrclass; }
+    int ttl() const { return _ttl; }
+
+  private:
+    friend class DnsParser;
+    NameRef _rrname;
+    int _rrtype;
+    int _rrclass;
+    int _ttl;
+    const unsigned char* _rdata;
+    int _rdlength;
+  };
+
+  /// Range of record references within a section of the message.
+  class RecordRefRange
+  {
+  public:
+    RecordRefRange(const RecordRef* begin, const RecordRef* end) :
+      _begin(begin),
+      _end(end)
+    {
+    }
+
+    const RecordRef* begin() const { return _begin; }
+    const RecordRef* end() const { return _end; }
+    size_t size() const { return _end - _begin; }
+
+  private:
+    const RecordRef* _begin;
+    const RecordRef* _end;
+  };
+
+  /// Parses the message into owned DnsQuestion and DnsRRecord objects,
+  /// accessed using questions(), answers(), authorities() and additional().
   bool parse();
 
+  /// Parses the message into a single per-message array of RecordRefs
+  /// without allocating a string per name or an object per record.  The
+  /// records are accessed using answer_refs(), authority_refs() and
+  /// additional_refs(), and only the ones the caller wants to keep need to
+  /// be turned into DnsRRecords using materialise().
+  bool parse_refs();
+
   std::list<DnsQuestion*>& questions() { return _questions; }
   std::list<DnsRRecord*>& answers() { return _answers; }
   std::list<DnsRRecord*>& authorities() { return _authorities; }
   std::list<DnsRRecord*>& additional() { return _additional; }
 
+  RecordRefRange answer_refs() const;
+  RecordRefRange authority_refs() const;
+  RecordRefRange additional_refs() const;
+
+  /// Creates an owned DnsRRecord from a record reference.  The caller takes
+  /// ownership of the returned record.  Returns NULL if the RDATA of the
+  /// record is malformed.
+  DnsRRecord* materialise(const RecordRef& ref) const;
+
   static std::string display_records(const std::list<DnsRRecord*>& records);
 
 private:
   int parse_header(unsigned char* hptr);
-  int parse_domain_name(unsigned char* nptr, std::string& name);
-  int parse_character_string(unsigned char* sptr, std::string& cstring);
+  int parse_domain_name(const unsigned char* nptr, std::string& name) const;
+  int parse_character_string(const unsigned char* sptr, std::string& cstring) const;
   int parse_question(unsigned char* qptr, DnsQuestion*& question);
   int parse_rr(unsigned char* rptr, DnsRRecord*& record);
-  int read_int16(unsigned char* p);
-  int read_int32(unsigned char* p);
-  int label_length(unsigned char* lptr);
-  int label_offset(unsigned char* lptr);
+  int parse_rr_ref(unsigned char* rptr, RecordRef& ref);
+  DnsRRecord* create_rr(const RecordRef& ref) const;
+  int skip_question(unsigned char* qptr);
+  template <class F>
+  int walk_domain_name(const unsigned char* nptr, F fn) const;
+  int read_int16(const unsigned char* p) const;
+  int read_int32(const unsigned char* p) const;
+  int label_length(const unsigned char* lptr) const;
+  int label_offset(const unsigned char* lptr) const;
   std::string display_message();
 
   unsigned char* _data;
@@ -59,6 +150,11 @@ private:
   std::list<DnsRRecord*> _authorities;
   std::list<DnsRRecord*> _additional;
 
+  // Storage for the records parsed by parse_refs().  This is sized once per
+  // message, and the answer, authority and additional sections are
+  // contiguous ranges within it.
+  std::vector<RecordRef> _rr_refs;
+
   // Constants defining sizes and offsets in message header.
   static const int HDR_SIZE                = 12;
   static const int QDCOUNT_OFFSET          = 4;
@@ -0,0 +1,174 @@
+/**
+ * @file http_path_statistics.h Per-path statistics about HTTP requests.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef HTTP_PATH_STATISTICS_H__
+#define HTTP_PATH_STATISTICS_H__
+
+#include <pthread.h>
+
+#include <atomic>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <evhtp.h>
+
+namespace SNMP
+{
+class HttpPathStatsTable;
+}
+
+/// @class HttpPathStatistics
+///
+/// Statistics about the requests received by an HttpStack, broken down by
+/// the path each handler was registered with and by method.  For each path
+/// and method this records the number of requests, the number in flight, a
+/// histogram of latencies and the number of responses in each class (2xx,
+/// 4xx etc.).
+///
+/// Recording a request never takes a lock - the counters are updated with
+/// relaxed atomic operations.  Requests are recorded by whichever thread
+/// starts or completes them (the HttpStack's event threads, but also the
+/// worker threads that send replies), so each thread is assigned one of a
+/// fixed number of sets of counters ("shards") to record into.  Threads
+/// only share a shard if there are more of them than shards, so they rarely
+/// contend for cache lines.  The shards are summed when the statistics are
+/// read, so the statistics may be very slightly inconsistent with each
+/// other.
+class HttpPathStatistics
+{
+public:
+  /// The number of latency histogram buckets.  Bucket 0 counts latencies
+  /// below BUCKET_BASE_US, bucket i counts latencies below
+  /// (BUCKET_BASE_US << i), and the last bucket counts everything else.
+  static const int NUM_BUCKETS = 16;
+  static const unsigned long BUCKET_BASE_US = 250;
+
+  static const int NUM_METHODS = htp_method_UNKNOWN + 1;
+
+  /// The number of shards for each path.
+  static const int NUM_SHARDS = 16;
+
+  /// Responses are counted by class - index 1 counts 1xx responses, up to
+  /// index 5 for 5xx responses.  Index 0 counts invalid status codes.
+  static const int NUM_RC_CLASSES = 6;
+
+  /// The counters for one method on one path in one shard.
+  struct Counters
+  {
+    std::atomic<uint64_t> requests;
+    std::atomic<int64_t> in_flight;
+    std::atomic<uint64_t> latency_samples;
+    std::atomic<uint64_t> latency_total_us;
+    std::atomic<uint64_t> latency_buckets[NUM_BUCKETS];
+    std::atomic<uint64_t> responses[NUM_RC_CLASSES];
+  };
+
+  /// The counters for one path in one shard, indexed by method.
+  struct Shard
+  {
+    Counters methods[NUM_METHODS];
+  };
+
+  /// A registered path.
+  struct Path
+  {
+    std::string name;
+    unsigned int index;
+    std::vector<Shard*> shards;
+
+    // Whether each method has been seen on this path (and so should have a
+    // row in the SNMP table).
+    std::atomic<bool> seen[NUM_METHODS];
+  };
+
+  /// The statistics for one method on one path, summed over all shards.
+  struct Snapshot
+  {
+    std::string path;
+    std::string method;
+    uint64_t requests;
+    int64_t in_flight;
+    uint64_t latency_samples;
+    uint64_t latency_total_us;
+    uint64_t latency_buckets[NUM_BUCKETS];
+    uint64_t responses[NUM_RC_CLASSES];
+
+    /// @return - The mean latency in microseconds.
+    unsigned long mean_latency_us() const;
+
+    /// Estimate a latency percentile from the histogram.
+    ///
+    /// @param percent - The percentile (e.g. 99).
+    /// @return        - The upper bound of the bucket that the percentile
+    ///                  falls in, in microseconds.
+    unsigned long percentile_us(unsigned int percent) const;
+  };
+
+  /// Constructor.
+  ///
+  /// @param table - Optional SNMP table to report the statistics in.  The
+  ///                table has a row for each path and method that has
+  ///                received requests.  Not owned by this object.
+  HttpPathStatistics(SNMP::HttpPathStatsTable* table = NULL);
+  virtual ~HttpPathStatistics();
+
+  /// Add a path.
+  ///
+  /// @param name - The path (as registered with the HttpStack).
+  /// @return     - The path.  Owned by this object.
+  Path* add_path(const std::string& name);
+
+  /// Record the start of a request.
+  void request_started(Path* path, htp_method method);
+
+  /// Record the completion of a request.
+  ///
+  /// @param latency_valid - Whether latency_us is valid.  Requests that
+  ///                        don't track their latency are counted, but not
+  ///                        included in the latency statistics.
+  void request_complete(Path* path,
+                        htp_method method,
+                        int rc,
+                        bool latency_valid,
+                        unsigned long latency_us);
+
+  /// Get the statistics for one method on one path.
+  void get_snapshot(const Path* path, htp_method method, Snapshot& snapshot);
+
+  /// Get the statistics for every method on every path that has received
+  /// requests.
+  void get_snapshots(std::vector<Snapshot>& snapshots);
+
+  /// Get every method on every path that has received requests.
+  void get_active(std::vector<std::pair<const Path*, htp_method> >& active);
+
+  /// @return - The name of a method, as used in the statistics.
+  static const char* method_name(htp_method method);
+
+private:
+  static int method_index(htp_method method);
+
+  // Get the calling thread's shard of a path.
+  Shard* get_shard(Path* path);
+
+  // Holds the index (plus one) of each thread's shard, once it has one.
+  pthread_key_t _shard_key;
+
+  // The shard to assign to the next thread (modulo NUM_SHARDS).
+  std::atomic<unsigned int> _next_shard;
+
+  // Protects _paths.  Only taken when adding paths and reading statistics.
+  pthread_mutex_t _lock;
+  std::vector<Path*> _paths;
+};
+
+#endif
@@ -13,8 +13,11 @@
 #define HTTP_H__
 
 #include <pthread.h>
+#include <netdb.h>
+#include <atomic>
 #include <string>
 #include <set>
+#include <vector>
 
 #include <evhtp.h>
 
@@ -24,6 +27,7 @@
 #include "sas.h"
 #include "sasevent.h"
 #include "exception_handler.h"
+#include "http_path_statistics.h"
 
 class HttpStack
 {
@@ -47,12 +51,21 @@ public:
       _req(req),
       _stack(stack),
       _stopwatch(),
-      _track_latency(true)
+      _track_latency(true),
+      _chunked_rc(0),
+      _path_stats(NULL)
     {
       _stopwatch.start();
     }
     virtual ~Request() {};
 
+    // Requests can be moved (e.g. onto a worker thread) without copying the
+    // body.
+    Request(const Request&) = default;
+    Request(Request&&) = default;
+    Request& operator=(const Request&) = default;
+    Request& operator=(Request&&) = default;
+
     inline std::string path()
     {
       return Utils::url_unescape(std::string(_req->uri->path->path));
@@ -135,6 +148,31 @@ public:
     }
 
     void send_reply(int rc, SAS::TrailId trail);
+
+    /// Start a chunked reply.  This sends the status line and any headers
+    /// added so far, after which the body is sent with send_chunk() and the
+    /// reply is completed with end_chunked_reply() (which must be called
+    /// instead of send_reply()).
+    ///
+    /// @param rc    - The HTTP status code.
+    /// @param trail - The SAS trail ID for the request.
+    void start_chunked_reply(int rc, SAS::TrailId trail);
+
+    /// Send a chunk of a chunked reply.  The data is moved out of the
+    /// evbuffer, not copied, so the buffer is empty afterwards.
+    ///
+    /// @param chunk - The data to send.
+    void send_chunk(evbuffer* chunk);
+
+    /// Send a chunk of a chunked reply from a string.  This copies the data
+    /// once, into an evbuffer.
+    void send_chunk(const std::string& chunk);
+
+    /// Complete a chunked reply.
+    ///
+    /// @param trail - The SAS trail ID for the request.
+    void end_chunked_reply(SAS::TrailId trail);
+
     inline evhtp_request_t* req() { return _req; }
 
     void record_penalty() { _stack->record_penalty(); }
@@ -161,6 +199,13 @@ public:
 
     void set_sas_logger(SasLogger* logger) { _sas_logger = logger; }
 
+    /// Set the per-path statistics that this request is recorded in.
+    void set_path_stats(HttpPathStatistics::Path* path_stats)
+    {
+      _path_stats = path_stats;
+    }
+    HttpPathStatistics::Path* path_stats() { return _path_stats; }
+
     inline void sas_log_rx_http_req(SAS::TrailId trail,
                                     uint32_t instance_id = 0)
     {
@@ -207,6 +252,12 @@ public:
     SasLogger* _sas_logger;
     bool _track_latency;
 
+    // The status code of a chunked reply in progress.
+    int _chunked_rc;
+
+    // The per-path statistics for the request, or NULL if it isn't recorded.
+    HttpPathStatistics::Path* _path_stats;
+
     /// Utility method to convert an evbuffer to a C++ string.
     ///
     /// @param eb  - The evbuffer to convert
@@ -370,6 +421,37 @@ public:
     /// @param trail the SAS trail ID associated with the reqeust.
     virtual void process_request(Request& req, SAS::TrailId trail) = 0;
 
+    /// Whether this handler processes request bodies in chunks as they
+    /// arrive (see process_body_chunk).  This is checked when the handler is
+    /// registered with register_handler - handlers registered with
+    /// register_default_handler never stream request bodies.
+    ///
+    /// The default implementation returns false.
+    virtual bool streams_body() { return false; }
+
+    /// Process a chunk of a request body as it arrives.  This is called on
+    /// the HttpStack transport thread (so must not block), before
+    /// process_request is called for the request.  The same evhtp request
+    /// (req.req()) is passed to process_request, so handlers can use it to
+    /// find any state built up from the chunks.
+    ///
+    /// @param req   the request.  Only the request line and headers are
+    ///   available - the body is being read.
+    /// @param chunk the chunk of the body.  Data that the handler drains or
+    ///   moves out of the chunk (e.g. with evbuffer_remove_buffer) is not
+    ///   buffered, and so is not returned by Request::get_rx_body().
+    virtual void process_body_chunk(Request& req, evbuffer* chunk) {}
+
+    /// Called instead of process_request for a request whose body was
+    /// streamed to process_body_chunk, if the request ends without being
+    /// passed to process_request (e.g. the client disconnects while sending
+    /// the body, or the request is rejected due to overload).  Handlers
+    /// should free any state built up from the chunks.  This is called on
+    /// the HttpStack transport thread, as the evhtp request is being freed.
+    ///
+    /// @param req the request.
+    virtual void body_aborted(Request& req) {}
+
     /// Get the instance of the SasLogger that this handler uses to log HTTP
     /// transactions.
     ///
@@ -392,11 +474,28 @@ public:
     virtual void incr_http_rejected_overload() = 0;
   };
 
+  /// Constructor.
+  ///
+  /// @param num_threads       - The number of evhtp threads processing
+  ///                            requests on each event base.
+  /// @param num_event_bases   - The number of event bases, each with its own
+  ///                            thread accepting connections.  If there is
+  ///                            more than one, each event base listens on its
+  ///                            own TCP socket (bound with SO_REUSEPORT, so
+  ///                            the kernel shares connections out between
+  ///                            them), so ingress isn't limited to one core.
+  ///                            Unix sockets are only served by the first
+  ///                            event base.
+  /// @param path_stats_table  - Optional SNMP table reporting statistics for
+  ///                            each registered path and method.  Not owned
+  ///                            by the stack.
   HttpStack(int num_threads,
             ExceptionHandler* exception_handler,
             AccessLogger* access_logger = NULL,
             LoadMonitor* load_monitor = NULL,
-            StatsInterface* stats = NULL);
+            StatsInterface* stats = NULL,
+            int num_event_bases = 1,
+            SNMP::HttpPathStatsTable* path_stats_table = NULL);
   virtual ~HttpStack();
 
   virtual void initialize();
@@ -409,8 +508,19 @@ public:
   virtual void stop();
   virtual void wait_stopped();
   virtual void send_reply(Request& req, int rc, SAS::TrailId trail);
+  virtual void send_reply_chunk_start(Request& req, int rc, SAS::TrailId trail);
+  virtual void send_reply_chunk(Request& req, evbuffer* chunk);
+  virtual void send_reply_chunk_end(Request& req, int rc, SAS::TrailId trail);
   virtual void record_penalty();
 
+  /// Get the number of requests received on each event base.
+  ///
+  /// @param counts - (out) The number of requests, indexed by event base.
+  void get_request_counts(std::vector<uint64_t>& counts);
+
+  /// @return - The statistics for each registered path and method.
+  HttpPathStatistics* path_statistics() { return &_path_statistics; }
+
   void log(const std::string uri, std::string method, int rc, unsigned long latency_us)
   {
     if (_access_logger)
@@ -427,37 +537,82 @@ public:
 private:
   virtual void send_reply_internal(Request& req, int rc, SAS::TrailId trail);
   static void handler_callback_fn(evhtp_request_t* req, void* handler_reg_param);
-  static void* event_base_thread_fn(void* http_stack_ptr);
-  void handler_callback(evhtp_request_t* req, HandlerInterface* handler);
-  void event_base_thread_fn();
+  static evhtp_res body_chunk_fn(evhtp_request_t* req,
+                                 evbuffer* chunk,
+                                 void* handler_reg_param);
+  static evhtp_res request_fini_fn(evhtp_request_t* req,
+                                   void* handler_reg_param);
+  static void* event_base_thread_fn(void* event_base_ptr);
+  struct HandlerRegistration;
+  void handler_callback(evhtp_request_t* req, HandlerRegistration* handler_reg);
+
+  // Record a reply in the per-path statistics.
+  void record_path_stats(Request& req,
+                         int rc,
+                         bool latency_valid,
+                         unsigned long latency_us);
+
+  // Update the load monitor and statistics once a reply has been sent.
+  void reply_complete(Request& req, SAS::TrailId trail);
+
+  // An event base, with its own evhtp instance (and so its own listening
+  // sockets and evhtp threads), and the thread that runs it.
+  struct EventBase
+  {
+    EventBase() : evbase(nullptr), evhtp(nullptr), requests(0) {}
+
+    evbase_t* evbase;
+    evhtp_t* evhtp;
+    pthread_t thread;
+
+    // The number of requests received on this event base.
+    std::atomic<uint64_t> requests;
+  };
+
+  // Bind a TCP socket for one event base, with SO_REUSEPORT set so that the
+  // other event bases can bind the same address.
+  void bind_reuseport_socket(EventBase* event_base,
+                             const addrinfo* ai,
+                             unsigned short port);
 
   // Don't implement the following, to avoid copies of this instance.
   HttpStack(HttpStack const&);
   void operator=(HttpStack const&);
 
   int _num_threads;
+  int _num_event_bases;
 
   ExceptionHandler* _exception_handler;
   AccessLogger* _access_logger;
   LoadMonitor* _load_monitor;
   StatsInterface* _stats;
 
-  evbase_t* _evbase;
-  evhtp_t* _evhtp;
-  pthread_t _event_base_thread;
+  HttpPathStatistics _path_statistics;
+
+  std::vector<EventBase*> _event_bases;
 
   static bool _ev_using_pthreads;
 
   // Helper structure used to register handlers with libevhtp, while also
-  // allowing callbacks to get back to the HttpStack object.
+  // allowing callbacks to get back to the HttpStack object.  There is one
+  // per handler per event base.
   struct HandlerRegistration
   {
     HttpStack* stack;
     HandlerInterface* handler;
-
-    HandlerRegistration() : HandlerRegistration(nullptr, nullptr) {}
-    HandlerRegistration(HttpStack* stack_param, HandlerInterface* handler_param) :
-      stack(stack_param), handler(handler_param)
+    EventBase* event_base;
+    HttpPathStatistics::Path* path_stats;
+
+    HandlerRegistration() :
+      HandlerRegistration(nullptr, nullptr, nullptr, nullptr) {}
+    HandlerRegistration(HttpStack* stack_param,
+                        HandlerInterface* handler_param,
+                        EventBase* event_base_param,
+                        HttpPathStatistics::Path* path_stats_param) :
+      stack(stack_param),
+      handler(handler_param),
+      event_base(event_base_param),
+      path_stats(path_stats_param)
     {}
   };
 
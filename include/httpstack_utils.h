@@ -129,6 +129,29 @@ namespace HttpStackUtils
     }
   };
 
+  /// @class StatsHandler
+  ///
+  /// Handler that reports the HttpStack's per-path statistics (and the
+  /// number of requests received on each event base) as JSON, e.g.
+  ///
+  ///   stack->register_handler("^/stats$", &stats_handler);
+  class StatsHandler : public HttpStack::HandlerInterface
+  {
+  public:
+    StatsHandler(HttpStack* stack) : _stack(stack) {}
+
+    void process_request(HttpStack::Request& req, SAS::TrailId trail);
+
+    HttpStack::SasLogger* sas_logger(HttpStack::Request& req)
+    {
+      // Don't log any SAS events.
+      return &HttpStack::NULL_SAS_LOGGER;
+    }
+
+  private:
+    HttpStack* _stack;
+  };
+
   /// @class HandlerThreadPool
   ///
   /// The HttpStack has a limited number of transport threads so handlers
@@ -160,28 +183,43 @@ namespace HttpStackUtils
     /// @struct RequestParams
     ///
     /// Structure that is used for passing requests from the HttpStack transport
-    /// thread to the thread pool.
+    /// thread to the thread pool.  These are pooled by the HandlerThreadPool,
+    /// so passing a request to a worker thread doesn't allocate memory.
     struct RequestParams
     {
-      RequestParams(HttpStack::HandlerInterface* handler_param,
-                    HttpStack::Request& request_param,
-                    SAS::TrailId trail_param) :
-        handler(handler_param),
-        request(request_param),
-        trail(trail_param)
+      RequestParams(HandlerThreadPool* owner_param) :
+        owner(owner_param),
+        next(NULL),
+        handler(NULL),
+        request(NULL, NULL),
+        trail(0)
       {}
 
+      // The pool that this object is returned to when the request has been
+      // processed.
+      HandlerThreadPool* owner;
+
+      // The next object on the owner's free list.
+      RequestParams* next;
+
       HttpStack::HandlerInterface* handler;
       HttpStack::Request request;
       SAS::TrailId trail;
     };
 
+    /// Get a RequestParams object from the free list, allocating a new one
+    /// only if the list is empty.
+    RequestParams* get_params();
+
+    /// Return a RequestParams object to the free list.
+    void release_params(RequestParams* params);
+
   public:
     static void exception_callback(RequestParams* work)
     {
       // Respond with a 500
       work->request.send_reply(500, 0);
-      delete work; work = NULL;
+      work->owner->release_params(work); work = NULL;
     }
 
   private:
@@ -212,7 +250,7 @@ namespace HttpStackUtils
     class Wrapper : public HttpStack::HandlerInterface
     {
     public:
-      Wrapper(Pool* pool, HandlerInterface* handler);
+      Wrapper(HandlerThreadPool* owner, Pool* pool, HandlerInterface* handler);
       virtual ~Wrapper(){};
 
       /// Implementation of HandlerInterface::process_request(). This passes
@@ -223,7 +261,19 @@ namespace HttpStackUtils
       /// the method on the underlying handler.
       HttpStack::SasLogger* sas_logger(HttpStack::Request& req);
 
+      /// Implementations of HandlerInterface::streams_body(),
+      /// process_body_chunk() and body_aborted().  These call the methods on
+      /// the underlying handler - body chunks are processed on the transport
+      /// thread, not in the pool.
+      bool streams_body();
+      void process_body_chunk(HttpStack::Request& req, evbuffer* chunk);
+      void body_aborted(HttpStack::Request& req);
+
     private:
+      // The HandlerThreadPool that owns this wrapper, and the RequestParams
+      // objects used to pass requests to the pool.
+      HandlerThreadPool* _owner;
+
       // The pool that new requests are passed to.
       Pool* _pool;
 
@@ -234,6 +284,13 @@ namespace HttpStackUtils
     // The threadpool containing the worker threads.
     Pool _pool;
 
+    // Protects _free_params.
+    pthread_mutex_t _params_lock;
+
+    // RequestParams objects that aren't currently in use, linked through
+    // their next pointers.
+    RequestParams* _free_params;
+
     // Vector of all the wrapper objects that have been allocated.  These are
     // owned by the HandlerThreadPool (which is responsible for freeing
     // them) and we use this vector to keep track of them.
@@ -12,11 +12,24 @@
 #ifndef LOCALSTORE_H__
 #define LOCALSTORE_H__
 
-#include <map>
+#include <atomic>
+#include <queue>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 #include <pthread.h>
 
 #include "store.h"
 
+/// @class LocalStore
+///
+/// An in-memory implementation of the Store, for single node deployments,
+/// load tests and UTs.
+///
+/// Records are spread across a fixed number of shards by a hash of their key,
+/// each with its own lock, so that operations on different keys rarely
+/// contend.  Each shard also keeps a heap of record expiry times, and expired
+/// records are swept out a few at a time as the shard is written to.
 class LocalStore : public Store
 {
 public:
@@ -75,13 +88,49 @@ private:
     uint32_t expiry;
     uint64_t cas;
   } Record;
-  bool _data_contention_flag;
-  pthread_mutex_t _db_lock;
-  std::map<std::string, Record> _db;
-  bool _force_error_on_set_flag;
-  bool _force_error_on_get_flag;
-  bool _force_error_on_delete_flag;
-  std::map<std::string, Record> _old_db;
+
+  typedef std::unordered_map<std::string, Record> Records;
+
+  // An entry in a shard's expiry heap.  Entries aren't removed when a record
+  // is updated or deleted, so an entry only applies if the record still has
+  // the same expiry when the entry reaches the top of the heap.
+  typedef std::pair<uint32_t, std::string> ExpiryEntry;
+  typedef std::priority_queue<ExpiryEntry,
+                              std::vector<ExpiryEntry>,
+                              std::greater<ExpiryEntry>> ExpiryHeap;
+
+  struct Shard
+  {
+    Shard();
+    ~Shard();
+
+    // Remove up to `max` expired records.
+    void sweep(uint32_t now, size_t max);
+
+    pthread_mutex_t lock;
+    Records db;
+    Records old_db;
+    ExpiryHeap expiries;
+  };
+
+  // The number of shards.  This is a power of 2 so the shard can be picked by
+  // masking the hash.
+  static const size_t NUM_SHARDS = 32;
+
+  // The maximum number of expired records to sweep per write.
+  static const size_t SWEEP_BATCH = 8;
+
+  // Calculate the fully qualified key, and the shard it belongs to.
+  Shard& get_shard(const std::string& table,
+                   const std::string& key,
+                   std::string& fqkey);
+
+  Shard _shards[NUM_SHARDS];
+
+  std::atomic<bool> _data_contention_flag;
+  std::atomic<bool> _force_error_on_set_flag;
+  std::atomic<bool> _force_error_on_get_flag;
+  std::atomic<bool> _force_error_on_delete_flag;
 };
 
 
@@ -17,6 +17,7 @@
 
 #include <string>
 #include <pthread.h>
+#include <sys/uio.h>
 #include <atomic>
 
 /// Encodes the time as needed by the logger.
@@ -45,6 +46,11 @@ public:
   void set_flags(int flags);
 
   virtual void write(const char* data);
+
+  // Write a batch of logs with a single writev call.  Each iovec is one
+  // log, which must already be formatted (including any timestamp and the
+  // trailing newline) - the ADD_TIMESTAMPS flag is ignored.
+  virtual void write_batch(const struct iovec* iov, int iovcnt);
   virtual void flush();
   virtual void commit();
 
@@ -75,6 +81,10 @@ protected:
 
   void get_timestamp(timestamp_t& ts);
 private:
+  // Open or cycle the log file if necessary.  Returns whether there is a
+  // valid log file to write to.  Must be called with the lock held.
+  bool prepare_log_file(const timestamp_t& ts);
+
   void write_log_file(const char* data, const timestamp_t& ts);
   void cycle_log_file(const timestamp_t& ts);
 
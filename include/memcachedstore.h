@@ -15,6 +15,8 @@
 
 #include <pthread.h>
 
+#include <atomic>
+#include <memory>
 #include <sstream>
 #include <vector>
 
@@ -32,6 +34,10 @@ extern "C" {
 #include "communicationmonitor.h"
 #include "astaire_resolver.h"
 #include "memcached_connection_pool.h"
+#include "value_compressor.h"
+#include "store_statistics.h"
+#include "threadpool.h"
+#include "exception_handler.h"
 
 class BaseMemcachedStore : public Store
 {
@@ -43,6 +49,25 @@ public:
   // we expect there to be servers.
   bool has_servers() { return true; };
 
+  /// Configure compression of stored values.  This must be called before the
+  /// store is used.
+  ///
+  /// Compressed values are always decompressed on read (as other nodes may be
+  /// writing them), but they can only be read if this node has the same
+  /// dictionary as the writer.
+  ///
+  /// @param dictionary      - Preset compression dictionary.
+  /// @param compress_writes - Whether to compress values that we write.
+  /// @param min_length      - Values shorter than this are never compressed.
+  void configure_compression(const std::string& dictionary,
+                             bool compress_writes,
+                             size_t min_length = 256);
+
+  /// Record per-table and per-replica statistics in the supplied object.
+  /// This must be called before the store is used.  The statistics object is
+  /// not owned by the store.
+  void set_statistics(StoreStatistics* stats) { _stats = stats; }
+
 protected:
   // Whether this store is using the binary protocol (required for vbucket
   // support).
@@ -76,12 +101,47 @@ protected:
                      BaseCommunicationMonitor* comm_monitor,
                      const std::string& source_address = "");
 
-  // Perform a get request to a single replica.
+  // Used to compress and decompress stored values.
+  ValueCompressor* _compressor;
+
+  // Whether values we write should be compressed.
+  bool _compress_writes;
+
+  // Where to record statistics (may be NULL).
+  StoreStatistics* _stats;
+
+  // Perform a get request to a single replica.  If `flags` is not NULL it is
+  // set to the flags stored with the record.  The data is returned as stored
+  // (see decode_value).
   memcached_return_t get_from_replica(memcached_st* replica,
                                       const char* key_ptr,
                                       const size_t key_len,
                                       std::string& data,
-                                      uint64_t& cas);
+                                      uint64_t& cas,
+                                      uint32_t* flags = NULL);
+
+  // Encode data for writing to memcached, compressing it if configured to.
+  // Returns a reference to either `data` or `buffer` (whichever holds the
+  // encoded value) and sets `flags` to the flags to store with it.
+  const std::string& encode_value(const std::string& data,
+                                  std::string& buffer,
+                                  uint32_t& flags);
+
+  // Record a completed operation in the statistics (if configured).
+  void record_operation(const std::string& table,
+                        const char* operation,
+                        Utils::StopWatch& stopwatch,
+                        unsigned int attempts);
+
+  // Record the result of a request to a single replica in the statistics
+  // (if configured).
+  void record_replica_result(const AddrInfo& target,
+                             Utils::StopWatch& stopwatch,
+                             memcached_return_t rc);
+
+  // Decode data read from memcached with the specified flags, in place.
+  // Returns false if the data could not be decoded.
+  bool decode_value(uint32_t flags, std::string& data);
 
   // Add a record to memcached. This overwrites any tombstone record already
   // stored, but fails if any real data is stored.
@@ -99,7 +159,11 @@ protected:
   static inline std::string get_fq_key(const std::string& table,
                                        const std::string& key)
   {
-    return table + "\\\\" + key;
+    // Build the key in a single allocation - this is done on every request.
+    std::string fqkey;
+    fqkey.reserve(table.length() + 2 + key.length());
+    fqkey.append(table).append("\\\\").append(key);
+    return fqkey;
   }
 };
 
@@ -124,7 +188,7 @@ public:
                                 BaseCommunicationMonitor* comm_monitor = NULL,
                                 const std::string& source_address = "");
 
-  ~TopologyNeutralMemcachedStore() {}
+  ~TopologyNeutralMemcachedStore();
 
   using Store::get_data;
   using Store::set_data;
@@ -162,16 +226,152 @@ public:
                             const std::string& key,
                             SAS::TrailId trail = 0);
 
+  /// Gets the data for a batch of records, using a single multi-key GET to
+  /// each target.
+  void get_data_batch(std::vector<Store::BatchItem>& items,
+                      SAS::TrailId trail = 0);
+
+  /// Sets the data for a batch of records.  The targets are resolved once for
+  /// the whole batch.
+  void set_data_batch(std::vector<Store::BatchItem>& items,
+                      SAS::TrailId trail = 0);
+
+  /// Deletes the data for a batch of records.  The targets are resolved once
+  /// for the whole batch.
+  void delete_data_batch(std::vector<Store::BatchItem>& items,
+                         SAS::TrailId trail = 0);
+
+  ///
+  /// Asynchronous interface to the store.
+  ///
+
+  /// Callback used to report the result of an asynchronous get.  The data and
+  /// CAS are only meaningful if the status is OK.
+  typedef std::function<void(Store::Status status,
+                             const std::string& data,
+                             uint64_t cas)> GetCallback;
+
+  /// Callback used to report the result of an asynchronous set or delete.
+  typedef std::function<void(Store::Status status)> StatusCallback;
+
+  /// Configure the worker pool used for asynchronous requests.
+  ///
+  /// @param exception_handler - The exception handler
+  /// @param num_threads       - The number of worker threads to use for
+  ///                            processing memcached requests asynchronously.
+  /// @param max_queue         - The maximum number of requests that can be
+  ///                            queued waiting for a worker thread.  If more
+  ///                            requests are added the asynchronous call will
+  ///                            block until some existing requests have been
+  ///                            processed.  0 => no limit.
+  void configure_workers(ExceptionHandler* exception_handler,
+                         unsigned int num_threads,
+                         unsigned int max_queue = 0);
+
+  /// Start the worker threads (if any have been configured).
+  ///
+  /// @return                  - Whether the worker threads started.
+  bool start();
+
+  /// Stop the worker threads.  This discards any queued requests (without
+  /// calling their callbacks) and terminates the threads once their current
+  /// request has completed.
+  void stop();
+
+  /// Wait until the worker threads have stopped.  This method may block.
+  void wait_stopped();
+
+  /// Gets the data for the specified table and key on a worker thread, and
+  /// calls `callback` on that thread with the result.  If the worker pool has
+  /// not been started the request is processed on the calling thread.
+  void get_data_async(const std::string& table,
+                      const std::string& key,
+                      SAS::TrailId trail,
+                      GetCallback callback);
+
+  /// Sets the data for the specified table and key on a worker thread, and
+  /// calls `callback` on that thread with the result.
+  void set_data_async(const std::string& table,
+                      const std::string& key,
+                      const std::string& data,
+                      uint64_t cas,
+                      int expiry,
+                      SAS::TrailId trail,
+                      StatusCallback callback);
+
+  /// Sets the data for the specified table and key without performing CAS on
+  /// a worker thread, and calls `callback` on that thread with the result.
+  void set_data_without_cas_async(const std::string& table,
+                                  const std::string& key,
+                                  const std::string& data,
+                                  int expiry,
+                                  SAS::TrailId trail,
+                                  StatusCallback callback);
+
+  /// Deletes the data for the specified table and key on a worker thread, and
+  /// calls `callback` on that thread with the result.
+  void delete_data_async(const std::string& table,
+                         const std::string& key,
+                         SAS::TrailId trail,
+                         StatusCallback callback);
+
+  /// Enable hedged reads.  When enabled (and the worker pool is running), a
+  /// GET is sent to the first target and, if that has not answered within
+  /// `hedge_delay_ms`, to the second target as well.  The first definitive
+  /// answer is used.  A delay of zero sends to both targets at once, and a
+  /// negative delay disables hedging (the default).
+  ///
+  /// Hedged GETs run on the worker pool, so GETs made through the
+  /// asynchronous API (which are already on a worker) are never hedged, and
+  /// nor are GETs made once the pool has been stopped.
+  void set_hedged_reads(int hedge_delay_ms);
+
 protected:
   typedef std::function<memcached_return_t(ConnectionHandle<memcached_st*>&)> memcached_func;
   typedef std::function<memcached_return_t(ConnectionHandle<memcached_st*>&, time_t)> memcached_store_func;
 
-  // Set some data with the provided method
+  // Set some data with the provided method.  If `targets` is NULL the targets
+  // are resolved for this request, otherwise the supplied ones are used.  If
+  // `attempts` is not NULL it is set to the number of targets tried.
   Store::Status set_data(const std::string& fqkey,
                          const std::string& data,
                          int expiry,
+                         std::vector<AddrInfo>* targets,
                          SAS::TrailId trail,
-                         memcached_store_func f);
+                         memcached_store_func f,
+                         unsigned int* attempts = NULL);
+
+  // Implementation of set_data, using the supplied targets if `targets` is
+  // not NULL.
+  Store::Status set_data_on_targets(const std::string& table,
+                                    const std::string& key,
+                                    const std::string& data,
+                                    uint64_t cas,
+                                    int expiry,
+                                    std::vector<AddrInfo>* targets,
+                                    SAS::TrailId trail,
+                                    bool log_body,
+                                    Store::Format data_format);
+
+  // Implementation of delete_data, using the supplied targets if `targets` is
+  // not NULL.
+  Store::Status delete_data_on_targets(const std::string& table,
+                                       const std::string& key,
+                                       std::vector<AddrInfo>* targets,
+                                       SAS::TrailId trail);
+
+  // Perform a multi-key get to a single replica.  Only the items listed in
+  // `pending` are requested.  Any item that gets a definitive answer (found,
+  // tombstone, not found, or a value that can't be decoded) is filled in and
+  // removed from `pending`, so that on failure the caller can retry just the
+  // remaining items elsewhere.  Each item's entry in `item_rcs` is set to the
+  // return code for that item from this replica, so that errors can be
+  // reported per key.
+  memcached_return_t get_batch_from_replica(memcached_st* replica,
+                                            std::vector<Store::BatchItem>& items,
+                                            const std::vector<std::string>& fqkeys,
+                                            std::vector<size_t>& pending,
+                                            std::vector<memcached_return_t>& item_rcs);
 
   // The domain name for the memcached proxies.
   std::string _target_domain;
@@ -184,6 +384,63 @@ protected:
 
   MemcachedConnectionPool _conn_pool;
 
+  // Worker pool used for asynchronous requests.  _exception_handler,
+  // _num_threads and _max_queue are set up by configure_workers() and used to
+  // create the pool in start().
+  ExceptionHandler* _exception_handler;
+  unsigned int _num_threads;
+  unsigned int _max_queue;
+  FunctorThreadPool* _thread_pool;
+
+  // Whether the worker pool is running, i.e. has been started and not
+  // stopped.  Work added to the pool once it has stopped is never run.
+  std::atomic<bool> _pool_running;
+
+  // Pass a request to the worker pool, or run it inline if there isn't one.
+  void do_async(std::function<void()> work);
+
+  // Delay before hedging a GET to a second target (negative => no hedging).
+  int _hedge_delay_ms;
+
+  // State shared between a hedged GET and the worker threads querying each
+  // target on its behalf.
+  struct HedgedGetState;
+
+  // One leg of a hedged GET, as held by the work item queued to run it.  If
+  // the work item is discarded without being run (because the pool is
+  // stopped), this marks the leg as finished so the GET doesn't wait for it.
+  struct HedgedGetLeg;
+
+  // Queue a leg of a hedged GET on the worker pool.  Returns false if the
+  // pool has been stopped, in which case the leg may never run.
+  bool queue_hedged_get_leg(std::shared_ptr<HedgedGetState> state,
+                            int index,
+                            const AddrInfo& target,
+                            const std::string& fqkey,
+                            SAS::TrailId trail);
+
+  // Perform a hedged GET across the first two targets, falling back to the
+  // remaining targets in order if neither gives a definitive answer.
+  memcached_return_t hedged_get(std::vector<AddrInfo>& targets,
+                                const std::string& fqkey,
+                                std::string& data,
+                                uint64_t& cas,
+                                uint32_t& flags,
+                                SAS::TrailId trail);
+
+  // Run one leg of a hedged GET on a worker thread.
+  void hedged_get_from_target(std::shared_ptr<HedgedGetState> state,
+                              int index,
+                              AddrInfo target,
+                              std::string fqkey,
+                              SAS::TrailId trail);
+
+  static void exception_callback(std::function<void()> work)
+  {
+    // No recovery behaviour as this is asynchronous, so we can't sensibly
+    // respond.
+  }
+
   // Determine if for a given memcached return code it is worth retrying a
   // request to a different server in the domain.
   static bool can_retry_memcached_rc(memcached_return_t rc);
@@ -218,13 +475,15 @@ protected:
   //                             0);
   //     });
   //
-  // @param targets - The vector of targets to try.
-  // @param trail   - SAS trail ID.
-  // @param fn      - The subroutine to call on each target.
+  // @param targets  - The vector of targets to try.
+  // @param trail    - SAS trail ID.
+  // @param fn       - The subroutine to call on each target.
+  // @param attempts - If not NULL, set to the number of targets tried.
   memcached_return_t iterate_through_targets(
     std::vector<AddrInfo>& targets,
     SAS::TrailId trail,
-    memcached_func fn);
+    memcached_func fn,
+    unsigned int* attempts = NULL);
 };
 
 #endif
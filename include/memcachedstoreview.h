@@ -16,6 +16,7 @@
 #include <map>
 #include <string>
 #include <vector>
+#include <stdint.h>
 
 #include "memcached_config.h"
 
@@ -37,12 +38,26 @@ public:
   const std::vector<std::string>& read_replicas(int vbucket) const { return _read_set[vbucket]; };
   const std::vector<std::string>& write_replicas(int vbucket) const { return _write_set[vbucket]; };
 
+  /// A replica set, as indexes into the server list.
+  typedef std::vector<uint16_t> ReplicaIds;
+
+  /// Returns the current read and write replica sets for each vbucket as
+  /// indexes into servers().  This avoids having to compare server names to
+  /// find a target.
+  const ReplicaIds& read_replica_ids(int vbucket) const { return _read_ids[vbucket]; };
+  const ReplicaIds& write_replica_ids(int vbucket) const { return _write_ids[vbucket]; };
+
   /// Calculates the vbucket moves that are currently ongoing.
   ///
   /// The returned object has an entry for each moving vbucket ID, giving the
   /// old replica list and the new one.  vBuckets that are not moving are
   /// skipped in the output (thus, if there's no move ongoing, this map is
   /// empty).
+  ///
+  /// The moves are worked out when the view is updated, not when this is
+  /// called.  They are recalculated in full (one ring lookup per vbucket) on
+  /// each configuration change, and not at all if the configuration is
+  /// unchanged.
   typedef std::vector<std::string> ReplicaList;
   typedef std::pair<ReplicaList, ReplicaList> ReplicaChange;
   const std::map<int, ReplicaChange>& calculate_vbucket_moves() const
@@ -69,6 +84,9 @@ private:
   std::string view_to_string();
   void generate_ring_from_stable_servers();
 
+  /// Converts the replica ID sets into the equivalent server name sets.
+  void generate_replica_names();
+
   /// Converts a set of replicas into an ordered string suitable for logging.
   std::string replicas_to_string(const std::vector<std::string>& replicas);
 
@@ -77,6 +95,11 @@ private:
   std::vector<std::string> merge_servers(const std::vector<std::string>& list1,
                                          const std::vector<std::string>& list2);
 
+  /// Converts a vector of server indexes into a vector of server indexes in
+  /// a different server list, using the supplied mapping.
+  static ReplicaIds map_server_ids(const std::vector<int>& ids,
+                                   const std::vector<uint16_t>& mapping);
+
   /// Converts a vector of server indexes into a vector of server names.
   ///
   /// For example given an ids vector of [1, 3] and a name table of ["kermit",
@@ -86,9 +109,23 @@ private:
   /// @param lookup_table - Table in which to look up the names.
   ///
   /// @return             - A vector of replica names.
+  template <class T>
   static std::vector<std::string>
-    server_ids_to_names(const std::vector<int>& ids,
-                        const std::vector<std::string>& lookup_table);
+    server_ids_to_names(const std::vector<T>& ids,
+                        const std::vector<std::string>& lookup_table)
+  {
+    std::vector<std::string> names;
+    names.reserve(ids.size());
+
+    for (typename std::vector<T>::const_iterator it = ids.begin();
+         it != ids.end();
+         ++it)
+    {
+      names.push_back(lookup_table[*it]);
+    }
+
+    return names;
+  }
 
   /// Calculates the ring used to generate the vbucket configurations.  The
   /// ring essentially maps each vbucket slot to a particular node which is
@@ -106,7 +143,7 @@ private:
     // Gets the list of replica nodes for the specified slot in the ring.
     // The nodes are guaranteed to be unique if replicas <= nodes, but
     // not otherwise.
-    std::vector<int> get_nodes(int slot, int replicas);
+    std::vector<int> get_nodes(int slot, int replicas) const;
 
   private:
 
@@ -130,6 +167,20 @@ private:
     std::vector<std::map<int, int> > _node_slots;
   };
 
+  /// Returns the ring for the specified number of nodes.  Rings are cached,
+  /// as the ring for a given number of nodes never changes, and a new ring is
+  /// built by growing the largest cached ring that is smaller than it.
+  const Ring& get_ring(int nodes);
+
+  // Cache of rings, indexed by number of nodes.
+  std::map<int, Ring> _rings;
+
+  // The server lists the view was last built from, so that an update with
+  // unchanged configuration can be skipped.
+  bool _built;
+  std::vector<std::string> _config_servers;
+  std::vector<std::string> _config_new_servers;
+
   // The number of replicas required normally.  During scale-up/down periods
   // some vbuckets may have more read and/or write replicas to maintain
   // redundancy.
@@ -149,6 +200,11 @@ private:
   std::vector<std::vector<std::string> > _read_set;
   std::vector<std::vector<std::string> > _write_set;
 
+  // The same replica sets as indexes into _servers.  These are calculated
+  // first, and the name sets are generated from them.
+  std::vector<ReplicaIds> _read_ids;
+  std::vector<ReplicaIds> _write_ids;
+
   // vBucket allocation changes currently ongoing in the cluster (may be
   // empty).
   std::map<int, ReplicaChange> _changes;
@@ -0,0 +1,180 @@
+/**
+ * @file nearcachestore.h Declarations for the NearCacheStore class.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef NEARCACHESTORE_H__
+#define NEARCACHESTORE_H__
+
+#include <pthread.h>
+
+#include <functional>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "store.h"
+#include "snmp_success_fail_count_table.h"
+
+/// @class NearCacheStore
+///
+/// A Store that keeps a small, short-lived, in-process cache of records read
+/// from another Store (typically a memcached store), so that repeated reads of
+/// the same record within a short period don't each need a network round
+/// trip.
+///
+/// Only successful reads are cached.  Any write or delete made through this
+/// store removes the cached copy of the record, as does a write that fails
+/// with DATA_CONTENTION (which means our cached CAS is stale).  Writes made by
+/// other nodes are only seen once the cached copy expires, so the TTL should
+/// be kept short - a stale read is then caught by the CAS check on the next
+/// write, as it would be for a read from a lagging replica.
+class NearCacheStore : public Store
+{
+public:
+  /// Constructor.
+  ///
+  /// @param store       - The store to cache.  Not owned by the near-cache.
+  /// @param max_entries - The maximum number of records to cache.  The least
+  ///                      recently used record is evicted when this is hit.
+  /// @param ttl_ms      - How long (in milliseconds) to cache each record.
+  /// @param stats_table - Optional table to track hits and misses.  Each read
+  ///                      is an attempt, each hit a success and each miss a
+  ///                      failure.
+  NearCacheStore(Store* store,
+                 size_t max_entries,
+                 uint64_t ttl_ms,
+                 SNMP::SuccessFailCountTable* stats_table = NULL);
+
+  virtual ~NearCacheStore();
+
+  using Store::get_data;
+  using Store::set_data;
+
+  Store::Status get_data(const std::string& table,
+                         const std::string& key,
+                         std::string& data,
+                         uint64_t& cas,
+                         SAS::TrailId trail,
+                         bool log_body,
+                         Store::Format data_format) override;
+
+  Store::Status set_data(const std::string& table,
+                         const std::string& key,
+                         const std::string& data,
+                         uint64_t cas,
+                         int expiry,
+                         SAS::TrailId trail,
+                         bool log_body,
+                         Store::Format data_format) override;
+
+  Store::Status set_data_without_cas(const std::string& table,
+                                     const std::string& key,
+                                     const std::string& data,
+                                     int expiry,
+                                     SAS::TrailId trail,
+                                     bool log_body,
+                                     Store::Format data_format=Store::Format::HEX) override;
+
+  Store::Status delete_data(const std::string& table,
+                            const std::string& key,
+                            SAS::TrailId trail = 0) override;
+
+  void get_data_batch(std::vector<Store::BatchItem>& items,
+                      SAS::TrailId trail = 0) override;
+
+  void set_data_batch(std::vector<Store::BatchItem>& items,
+                      SAS::TrailId trail = 0) override;
+
+  void delete_data_batch(std::vector<Store::BatchItem>& items,
+                         SAS::TrailId trail = 0) override;
+
+  bool has_servers() override { return _store->has_servers(); }
+
+  /// Empty the cache.
+  void flush_all();
+
+private:
+  struct Entry
+  {
+    std::string data;
+    uint64_t cas;
+    uint64_t expires_ms;
+    std::list<std::string>::iterator lru;
+  };
+
+  // Look up a record in the cache.  Returns true (filling in data and cas) on
+  // a hit.
+  bool lookup(const std::string& fqkey, std::string& data, uint64_t& cas);
+
+  // Add a record to the cache, unless the record has been invalidated since
+  // `generation` was read (in which case the record may already be stale).
+  void insert(const std::string& fqkey,
+              const std::string& data,
+              uint64_t cas,
+              uint64_t generation);
+
+  // Remove a record from the cache.
+  void invalidate(const std::string& fqkey);
+
+  // Read the current invalidation generation for a record.
+  uint64_t generation(const std::string& fqkey);
+
+  // The invalidation generation for a record.  Must be called with _lock
+  // held.
+  uint64_t& generation_locked(const std::string& fqkey)
+  {
+    return _generations[std::hash<std::string>()(fqkey) % NUM_GENERATIONS];
+  }
+
+  // Record a hit or miss in the stats table.
+  void record_read(bool hit);
+
+  // SAS log a read served from the cache.
+  static void log_hit(const std::string& fqkey,
+                      const std::string& data,
+                      uint64_t cas,
+                      SAS::TrailId trail,
+                      bool log_body,
+                      Store::Format data_format);
+
+  static inline std::string get_fq_key(const std::string& table,
+                                       const std::string& key)
+  {
+    std::string fqkey;
+    fqkey.reserve(table.length() + 2 + key.length());
+    fqkey.append(table).append("\\\\").append(key);
+    return fqkey;
+  }
+
+  Store* _store;
+  const size_t _max_entries;
+  const uint64_t _ttl_ms;
+  SNMP::SuccessFailCountTable* _stats_table;
+
+  // Protects all the fields below.
+  pthread_mutex_t _lock;
+
+  std::unordered_map<std::string, Entry> _entries;
+
+  // Keys in least recently used order (most recently used at the front).
+  std::list<std::string> _lru;
+
+  // Invalidation generations.  Records are hashed into NUM_GENERATIONS
+  // buckets, and a bucket's generation is incremented every time a record in
+  // it is invalidated.  A read that misses the cache only adds its result if
+  // the record's generation hasn't changed while the read was in progress, so
+  // a concurrent write can't leave stale data in the cache, while writes to
+  // other records (almost always) don't stop the read being cached.
+  static const size_t NUM_GENERATIONS = 1024;
+  uint64_t _generations[NUM_GENERATIONS];
+};
+
+#endif
@@ -138,6 +138,9 @@ namespace SASEvent {
   const int MEMCACHED_SET_WITHOUT_DATA_START = COMMON_BASE + 0x000111;
   const int MEMCACHED_SET_WITHOUT_DATA_OR_CAS_START = COMMON_BASE + 0x000112;
   const int MEMCACHED_REQ_TOO_LARGE = COMMON_BASE + 0x000113;
+  const int MEMCACHED_GET_ANSWERED_BY = COMMON_BASE + 0x000114;
+  const int NEAR_CACHE_GET_HIT = COMMON_BASE + 0x000115;
+  const int NEAR_CACHE_GET_HIT_WITHOUT_DATA = COMMON_BASE + 0x000116;
 
   const int BASERESOLVE_SRV_RESULT = COMMON_BASE + 0x000200;
   const int BASERESOLVE_A_RESULT_TARGET_SELECT = COMMON_BASE + 0x000201;
@@ -0,0 +1,57 @@
+/**
+ * @file snmp_http_path_stats_table.h
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+
+#include "http_path_statistics.h"
+
+#ifndef SNMP_HTTP_PATH_STATS_TABLE_H
+#define SNMP_HTTP_PATH_STATS_TABLE_H
+
+// This file contains the interface for a table that reports the statistics
+// collected by an HttpPathStatistics object.  The table:
+//   - is indexed by an integer, with one row per HTTP path and method
+//   - reports the path and method, the number of requests and the number
+//     in flight, the mean, 50th, 90th and 99th percentile latencies (in
+//     microseconds) and the number of 1xx, 2xx, 3xx, 4xx and 5xx responses.
+//     The request and response counts are Counter64s.
+//
+// The statistics are cumulative (not per time period) and are read from the
+// HttpPathStatistics object when the table is queried.
+//
+// To use one, create it and pass it to the HttpStack:
+//
+// SNMP::HttpPathStatsTable* http_table = SNMP::HttpPathStatsTable::create("http_paths", ".1.2.3");
+//
+// When the table is queried, it adds a row for each path and method that has
+// received requests since it was last queried.  Rows are never removed.
+//
+// This is defined as an interface in order not to pollute the codebase with netsnmp include files
+// (which indiscriminately #define things like READ and WRITE).
+//
+namespace SNMP
+{
+
+class HttpPathStatsTable
+{
+public:
+  HttpPathStatsTable() {};
+  virtual ~HttpPathStatsTable() {};
+
+  static HttpPathStatsTable* create(std::string name, std::string oid);
+
+  // Set the statistics to report.  This is called by the HttpPathStatistics
+  // object, which must outlive the table.
+  virtual void set_statistics(HttpPathStatistics* statistics) = 0;
+};
+
+}
+#endif
@@ -101,6 +101,14 @@ public:
   };
 
 protected:
+  // Add a Row into the underlying table from a Net-SNMP handler.  Handlers
+  // run on the Net-SNMP thread with the Net-SNMP lock held, so this calls
+  // into Net-SNMP directly.
+  void add_in_handler(T* row)
+  {
+    netsnmp_tdata_add_row(_table, row->get_netsnmp_row());
+  };
+
   std::string _name;
   oid _tbl_oid[64];
   size_t _oidlen;
@@ -35,6 +35,8 @@ public:
   static Value uint(uint32_t val);
   // Utility constructor for ASN_INTEGERS
   static Value integer(int val);
+  // Utility constructor for ASN_COUNTER64s
+  static Value counter64(uint64_t val);
 
   // Empty constructor so this can be easily stored in a std::map.
   Value(): type(0), size(0), value(NULL) {};
@@ -15,6 +15,9 @@
 #include <string>
 #include <map>
 #include <vector>
+#include <memory>
+#include <unordered_map>
+#include <pthread.h>
 
 #include "dnsrrecords.h"
 
@@ -24,23 +27,60 @@ public:
   StaticDnsCache(const std::string filename = "");
   ~StaticDnsCache();
 
-  // Parse the _dns_config_file.
+  // Parse the _dns_config_file and atomically replace the current index.
+  // Lookups in progress carry on using the old index, and are never blocked
+  // by a reload.
   void reload_static_records();
 
   // Returns the number of records in the static cache.
-  int size() {return _static_records.size();};
+  int size();
 
-  // Returns all DNS records from _static_records that match the given
-  // domain/type combination (_static_records are parsed from the
+  // Returns all DNS records from the static records that match the given
+  // domain/type combination (the static records are parsed from the
   // _dns_config_file).
-  DnsResult get_static_dns_records(std::string domain, int dns_type);
+  DnsResult get_static_dns_records(const std::string& domain, int dns_type);
 
-  // Resolves a CNAME record and returns the associated canonical domain.
-  std::string get_canonical_name(std::string domain);
+  // Resolves a CNAME record (following any chain of CNAME records) and
+  // returns the associated canonical domain.
+  std::string get_canonical_name(const std::string& domain);
 
 private:
+  // An immutable index of the static records, built by
+  // reload_static_records.  Readers take a reference to the current index,
+  // so an index is only destroyed once the last reader has finished with it.
+  struct Index
+  {
+    struct Entry
+    {
+      // The records for this hostname.
+      std::vector<DnsRRecord*> records;
+
+      // The result of following any CNAME chain from this hostname, or
+      // empty if the hostname does not have a CNAME record.
+      std::string canonical_name;
+    };
+
+    ~Index();
+
+    std::unordered_map<std::string, Entry> entries;
+  };
+
+  // Resolves the CNAME chain for each entry in the index.
+  static void resolve_cname_chains(Index* index);
+
+  std::shared_ptr<const Index> current_index() const;
+
+  // The maximum length of a CNAME chain we will follow.
+  static const int MAX_CNAME_CHAIN = 16;
+
   std::string _dns_config_file;
-  std::map<std::string, std::vector<DnsRRecord*>> _static_records;
+
+  // The current index.  This is only ever read and written using
+  // std::atomic_load and std::atomic_store.
+  std::shared_ptr<const Index> _index;
+
+  // Serializes reloads.  Not taken by lookups.
+  pthread_mutex_t _reload_lock;
 };
 
 #endif
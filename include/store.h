@@ -11,6 +11,10 @@
 
 #ifndef STORE_H_
 #define STORE_H_
+
+#include <string>
+#include <vector>
+
 #include "sas.h"
 
 /// @class Store
@@ -212,6 +216,99 @@ public:
                              const std::string& key,
                              SAS::TrailId trail = 0) = 0;
 
+  /// A single record within a batched get, set or delete.  The caller fills
+  /// in the table and key (plus the data, CAS and expiry for a set), and the
+  /// store fills in the status (plus the data and CAS for a get).  As for the
+  /// single-key operations, the caller can also say whether the body should
+  /// be logged to SAS and in what format.
+  struct BatchItem
+  {
+    BatchItem(const std::string& table,
+              const std::string& key,
+              const std::string& data = "",
+              uint64_t cas = 0,
+              int expiry = 0,
+              bool log_body = true,
+              Format data_format = Format::HEX) :
+      table(table),
+      key(key),
+      data(data),
+      cas(cas),
+      expiry(expiry),
+      log_body(log_body),
+      data_format(data_format),
+      status(ERROR)
+    {
+    }
+
+    std::string table;
+    std::string key;
+    std::string data;
+    uint64_t cas;
+    int expiry;
+    bool log_body;
+    Format data_format;
+    Status status;
+  };
+
+  /// Gets the data for each of the specified records.  Each record's status,
+  /// data and CAS are set exactly as get_data would set them for that key.
+  ///
+  /// The default implementation simply issues one get_data per record.
+  /// Stores that can fetch several keys in one round trip should override it.
+  ///
+  /// @param items    The records to read.
+  /// @param trail    SAS Trail on which to log the data
+  virtual void get_data_batch(std::vector<BatchItem>& items,
+                              SAS::TrailId trail = 0)
+  {
+    for (BatchItem& item : items)
+    {
+      item.status = get_data(item.table,
+                             item.key,
+                             item.data,
+                             item.cas,
+                             trail,
+                             item.log_body,
+                             item.data_format);
+    }
+  }
+
+  /// Sets the data for each of the specified records.  Each record is written
+  /// with its own CAS and expiry and has its own status, exactly as if
+  /// set_data had been called for it - the batch is not atomic.
+  ///
+  /// @param items    The records to write.
+  /// @param trail    SAS Trail on which to log the data
+  virtual void set_data_batch(std::vector<BatchItem>& items,
+                              SAS::TrailId trail = 0)
+  {
+    for (BatchItem& item : items)
+    {
+      item.status = set_data(item.table,
+                             item.key,
+                             item.data,
+                             item.cas,
+                             item.expiry,
+                             trail,
+                             item.log_body,
+                             item.data_format);
+    }
+  }
+
+  /// Deletes the data for each of the specified records.
+  ///
+  /// @param items    The records to delete.  Only the table and key are used.
+  /// @param trail    SAS Trail on which to log the data
+  virtual void delete_data_batch(std::vector<BatchItem>& items,
+                                 SAS::TrailId trail = 0)
+  {
+    for (BatchItem& item : items)
+    {
+      item.status = delete_data(item.table, item.key, trail);
+    }
+  }
+
   virtual bool has_servers() { return true; }
 };
 
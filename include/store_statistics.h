@@ -0,0 +1,94 @@
+/**
+ * @file store_statistics.h Statistics about the operations made on a store.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef STORE_STATISTICS_H__
+#define STORE_STATISTICS_H__
+
+#include <string>
+
+#include "snmp_time_and_string_based_event_table.h"
+#include "snmp_infinite_scalar_table.h"
+
+/// @class StoreStatistics
+///
+/// Records statistics about the operations made on a store (memcached or
+/// Cassandra) in a set of SNMP tables, so that it's possible to see which
+/// tables are busiest and which replicas are slow or failing.
+///
+/// Operation statistics are indexed by "<table>:<operation>" (e.g.
+/// "impi:get") and replica statistics by the replica's address and port.
+///
+/// Any of the tables may be NULL, in which case those statistics are not
+/// recorded.  The tables are not owned by this object.
+class StoreStatistics
+{
+public:
+  /// Constructor.
+  ///
+  /// @param latency_table         - The latency (in microseconds) of each
+  ///                                operation, including any retries.
+  /// @param retries_table         - The number of retries each operation
+  ///                                needed (0 if the first replica answered).
+  /// @param contention_table      - One sample per CAS write, of 100 if the
+  ///                                write hit contention and 0 otherwise, so
+  ///                                the mean is the contention rate as a
+  ///                                percentage.
+  /// @param replica_latency_table - The latency (in microseconds) of each
+  ///                                request to each replica.
+  /// @param replica_errors_table  - The number of errors from each replica.
+  StoreStatistics(SNMP::TimeAndStringBasedEventTable* latency_table,
+                  SNMP::TimeAndStringBasedEventTable* retries_table,
+                  SNMP::TimeAndStringBasedEventTable* contention_table,
+                  SNMP::TimeAndStringBasedEventTable* replica_latency_table,
+                  SNMP::InfiniteScalarTable* replica_errors_table);
+
+  virtual ~StoreStatistics() {}
+
+  /// Record a completed operation.
+  ///
+  /// @param table      - The table the operation was on.
+  /// @param operation  - The operation (e.g. "get").
+  /// @param latency_us - How long the operation took.
+  /// @param attempts   - How many replicas were tried.
+  void record_operation(const std::string& table,
+                        const char* operation,
+                        unsigned long latency_us,
+                        unsigned int attempts);
+
+  /// Record the outcome of a CAS write.
+  ///
+  /// @param table      - The table written to.
+  /// @param contention - Whether the write failed with data contention.
+  void record_cas_write(const std::string& table, bool contention);
+
+  /// Record the result of a single request to a replica.
+  ///
+  /// @param replica    - The replica's address and port.
+  /// @param latency_us - How long the replica took to respond.
+  /// @param error      - Whether the request failed in a way that suggests
+  ///                     the replica is unhealthy (a connection failure or
+  ///                     timeout, but not e.g. "not found").
+  void record_replica_result(const std::string& replica,
+                             unsigned long latency_us,
+                             bool error);
+
+private:
+  static std::string get_index(const std::string& table,
+                               const char* operation);
+
+  SNMP::TimeAndStringBasedEventTable* _latency_table;
+  SNMP::TimeAndStringBasedEventTable* _retries_table;
+  SNMP::TimeAndStringBasedEventTable* _contention_table;
+  SNMP::TimeAndStringBasedEventTable* _replica_latency_table;
+  SNMP::InfiniteScalarTable* _replica_errors_table;
+};
+
+#endif
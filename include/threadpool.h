@@ -9,7 +9,10 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
+#include <algorithm>
 #include <functional>
+#include <vector>
+#include <time.h>
 
 #include <eventq.h>
 #include "exception_handler.h"
@@ -230,6 +233,360 @@ private:
 };
 
 
+// A thread pool whose number of threads varies between a minimum and a
+// maximum, depending on how busy it is.  It is used in the same way as
+// ThreadPool.
+//
+// - The pool starts with the minimum number of threads.
+// - A thread is added when work has waited on the queue for longer than the
+//   target queue wait time, or when every thread is busy and none has taken
+//   any work off the queue for that long.
+// - No threads are added while the time taken to process work (the in-flight
+//   latency) is more than double its long term average, as that means
+//   whatever the work is waiting on is already overloaded, and more
+//   concurrency would only add to its load.
+// - A thread exits if it has been idle for the idle timeout (unless the pool
+//   is at its minimum size).
+template <class T>
+class ElasticThreadPool
+{
+public:
+  // Create the thread pool.
+  //
+  // @param min_threads the minimum number of threads in the pool (at least 1).
+  // @param max_threads the maximum number of threads in the pool.
+  // @param max_queue the number of work items that can be queued waiting for a
+  //                  free thread (0 => no limit).
+  // @param target_queue_wait_ms how long work can wait on the queue before the
+  //                             pool adds a thread.
+  // @param idle_timeout_ms how long a thread can be idle before it exits.
+  ElasticThreadPool(unsigned int min_threads,
+                    unsigned int max_threads,
+                    ExceptionHandler* exception_handler,
+                    void (*callback)(T),
+                    unsigned int max_queue = 0,
+                    unsigned int target_queue_wait_ms = 10,
+                    unsigned int idle_timeout_ms = 10000) :
+    _min_threads(std::max(min_threads, 1u)),
+    _max_threads(std::max(max_threads, std::max(min_threads, 1u))),
+    _target_queue_wait_us(target_queue_wait_ms * 1000),
+    _idle_timeout_ms(idle_timeout_ms),
+    _exception_handler(exception_handler),
+    _callback(callback),
+    _queue(max_queue),
+    _lock(PTHREAD_MUTEX_INITIALIZER),
+    _terminated(false),
+    _num_threads(0),
+    _busy_threads(0),
+    _queued(0),
+    _last_pop_us(0),
+    _latency_us(0),
+    _average_latency_us(0),
+    _threads(),
+    _exited_threads()
+  {}
+
+  // Destroy the thread pool.
+  virtual ~ElasticThreadPool()
+  {
+    pthread_mutex_destroy(&_lock);
+  }
+
+  // Start the thread pool by creating the minimum number of worker threads.
+  //
+  // @return whether the thread pool started successfully.
+  bool start()
+  {
+    bool success = true;
+
+    pthread_mutex_lock(&_lock);
+    _last_pop_us = now_us();
+
+    for (unsigned int ii = 0; ii < _min_threads; ++ii)
+    {
+      if (!add_thread())
+      {
+        success = false;
+        break;
+      }
+    }
+
+    pthread_mutex_unlock(&_lock);
+
+    if (!success)
+    {
+      // Terminate the pool so that all existing threads will exit.
+      stop();
+    }
+
+    return success;
+  }
+
+  // Stop the thread pool and shutdown the worker threads.  Work items on the
+  // queue are not guaranteed to be processed.
+  void stop()
+  {
+    pthread_mutex_lock(&_lock);
+    _terminated = true;
+    pthread_mutex_unlock(&_lock);
+
+    _queue.purge();
+    _queue.terminate();
+  }
+
+  // Wait for the threadpool to shutdown.
+  void join()
+  {
+    // No threads are added once the pool has been stopped, so _threads can't
+    // change under us.
+    for (unsigned int ii = 0; ii < _threads.size(); ++ii)
+    {
+      pthread_join(_threads[ii], NULL);
+    }
+
+    _threads.clear();
+    _exited_threads.clear();
+  }
+
+  // Add a work item to the thread pool.
+  //
+  // @param work the work item to add.
+  void add_work(T& work)
+  {
+    Item item;
+    item.work = work;
+    item.queued_us = now_us();
+    _queue.push(item);
+
+    pthread_mutex_lock(&_lock);
+    ++_queued;
+
+    // If every thread is tied up and none has taken any work for a while,
+    // the work won't be picked up until we add a thread.
+    if ((_busy_threads == _num_threads) &&
+        (item.queued_us > _last_pop_us + _target_queue_wait_us))
+    {
+      maybe_add_thread();
+    }
+
+    pthread_mutex_unlock(&_lock);
+  }
+
+  // Add a work item to the thread pool by moving it into the pool.
+  //
+  // @param work the work item to add.
+  void add_work(T&& work)
+  {
+    add_work(work);
+  }
+
+  // @return the current number of threads in the pool.
+  unsigned int num_threads()
+  {
+    pthread_mutex_lock(&_lock);
+    unsigned int num_threads = _num_threads;
+    pthread_mutex_unlock(&_lock);
+    return num_threads;
+  }
+
+private:
+  // A work item, and when it was queued.  queued_us is 0 if the item is
+  // empty.
+  struct Item
+  {
+    Item() : work(), queued_us(0) {}
+    T work;
+    uint64_t queued_us;
+  };
+
+  static uint64_t now_us()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+  }
+
+  // Create a new worker thread.  Must be called with `_lock` held.
+  //
+  // @return whether the thread was created successfully.
+  bool add_thread()
+  {
+    // Tidy up any threads that have exited.
+    for (unsigned int ii = 0; ii < _exited_threads.size(); ++ii)
+    {
+      pthread_join(_exited_threads[ii], NULL);
+      _threads.erase(std::find(_threads.begin(),
+                               _threads.end(),
+                               _exited_threads[ii]));
+    }
+
+    _exited_threads.clear();
+
+    pthread_t thread_handle;
+    int rc = pthread_create(&thread_handle,
+                            NULL,
+                            static_worker_thread_func,
+                            this);
+    if (rc != 0)
+    {
+      TRC_ERROR("Failed to create thread in thread pool");
+      return false;
+    }
+
+    _threads.push_back(thread_handle);
+    ++_num_threads;
+    return true;
+  }
+
+  // Add a thread if the pool is allowed to grow.  Must be called with `_lock`
+  // held.
+  void maybe_add_thread()
+  {
+    if ((!_terminated) &&
+        (_num_threads < _max_threads) &&
+        (_latency_us <= 2 * _average_latency_us))
+    {
+      if (add_thread())
+      {
+        TRC_DEBUG("Grew thread pool to %u threads", _num_threads);
+      }
+    }
+  }
+
+  // Static worker thread function that is passed into pthread_create.
+  static void* static_worker_thread_func(void* pool)
+  {
+    ((ElasticThreadPool<T>*)pool)->worker_thread_func();
+    return NULL;
+  }
+
+  // Function executed by a single worker thread.  This loops pulling work off
+  // the queue and processing it, until the queue is terminated or the thread
+  // has been idle long enough to exit.
+  void worker_thread_func()
+  {
+    on_thread_startup();
+
+    while (true)
+    {
+      Item item;
+      bool running = _queue.pop(item, _idle_timeout_ms);
+
+      if (!running)
+      {
+        break;
+      }
+
+      uint64_t start_us = now_us();
+
+      pthread_mutex_lock(&_lock);
+
+      if (item.queued_us == 0)
+      {
+        // Idle timeout.
+        if (_num_threads > _min_threads)
+        {
+          --_num_threads;
+          _exited_threads.push_back(pthread_self());
+          TRC_DEBUG("Shrunk thread pool to %u threads", _num_threads);
+          pthread_mutex_unlock(&_lock);
+          break;
+        }
+
+        pthread_mutex_unlock(&_lock);
+        continue;
+      }
+
+      _last_pop_us = start_us;
+      --_queued;
+      ++_busy_threads;
+
+      // Add a thread if this work waited too long and there's more behind it.
+      if ((start_us > item.queued_us + _target_queue_wait_us) &&
+          (_queued > 0))
+      {
+        maybe_add_thread();
+      }
+
+      pthread_mutex_unlock(&_lock);
+
+      CW_TRY
+      {
+        process_work(item.work);
+      }
+      CW_EXCEPT(_exception_handler)
+      {
+        _callback(item.work);
+      }
+      CW_END
+
+      uint64_t latency_us = now_us() - start_us;
+
+      pthread_mutex_lock(&_lock);
+      --_busy_threads;
+
+      // Track the recent latency (over roughly the last 8 work items) and the
+      // long term average (over roughly the last 128).
+      if (_average_latency_us == 0)
+      {
+        _latency_us = latency_us;
+        _average_latency_us = latency_us;
+      }
+      else
+      {
+        _latency_us = (7 * _latency_us + latency_us) / 8;
+        _average_latency_us = (127 * _average_latency_us + latency_us) / 128;
+      }
+
+      pthread_mutex_unlock(&_lock);
+    }
+
+    on_thread_shutdown();
+  }
+
+  // (Optional) thread startup and shutdown hooks.  The default
+  // implementations are no-ops.
+  virtual void on_thread_startup() {};
+  virtual void on_thread_shutdown() {};
+
+  // Process a work item. This method must be overridden by the subclass.
+  virtual void process_work(T& work) = 0;
+
+  const unsigned int _min_threads;
+  const unsigned int _max_threads;
+  const uint64_t _target_queue_wait_us;
+  const int _idle_timeout_ms;
+  ExceptionHandler* _exception_handler;
+
+  // Recovery function provided by the callers
+  void (*_callback)(T);
+
+  eventq<Item> _queue;
+
+  // Protects the fields below.
+  pthread_mutex_t _lock;
+  bool _terminated;
+  unsigned int _num_threads;
+  unsigned int _busy_threads;
+
+  // The number of work items on the queue.  This can briefly be negative, as
+  // items are counted after they are pushed.
+  int _queued;
+
+  // When a thread last took work off the queue.
+  uint64_t _last_pop_us;
+
+  // The recent and long term average time taken to process work.
+  uint64_t _latency_us;
+  uint64_t _average_latency_us;
+
+  // All threads that haven't been joined, and those that have exited because
+  // they were idle (and so need joining).
+  std::vector<pthread_t> _threads;
+  std::vector<pthread_t> _exited_threads;
+};
+
+
 /// An alternative thread pool where the work items are callable objects. When a
 /// thread processes a work item it just calls the object. This allows thread
 /// pools to be used ergonomically with lambdas and std::binds.
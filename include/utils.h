@@ -396,6 +396,25 @@ namespace Utils
   /// Utility function to parse a target name to see if it is a valid IPv4 or IPv6 address.
   bool parse_ip_target(const std::string& target, IP46Address& address);
 
+  /// Fast per-thread pseudo-random number generator (xorshift128+).  Unlike
+  /// rand(), this doesn't take a process-wide lock, so it is suitable for use
+  /// on every request (for example for load balancing).  It must not be used
+  /// for anything security-related.
+  class FastRandom
+  {
+  public:
+    /// Returns a random 64-bit number.
+    static uint64_t next();
+
+    /// Returns a random number in the range [0, n).  n must be non-zero.
+    static uint32_t uniform(uint32_t n);
+
+  private:
+    static void seed();
+
+    static thread_local uint64_t _state[2];
+  };
+
   /// Generates a random number which is exponentially distributed
   class ExponentialDistribution
   {
@@ -754,7 +773,7 @@ namespace Utils
 ///     CW_IO_COMPLETES()
 #define CW_IO_STARTS(REASON)                                                   \
   {                                                                            \
-    std::string description = REASON;                                          \
+    const std::string& description = REASON;                                   \
     Utils::IOMonitor::io_starts(description);                                  \
     Utils::IOHook::io_starts(description);
 
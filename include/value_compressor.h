@@ -0,0 +1,76 @@
+/**
+ * @file value_compressor.h Compression of values written to a store.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef VALUE_COMPRESSOR_H__
+#define VALUE_COMPRESSOR_H__
+
+#include <stdint.h>
+#include <string>
+
+/// @class ValueCompressor
+///
+/// Compresses and decompresses store values using zlib, optionally primed
+/// with a preset dictionary of text that is common to the values (e.g. the
+/// JSON field names of a registration document).
+///
+/// A compressed value is a small header followed by the zlib stream:
+///
+///   - 1 byte   format version (currently 1)
+///   - 4 bytes  length of the uncompressed value (network byte order)
+///
+/// The header does not identify the value as compressed - the store records
+/// that out of band (see FLAG) so existing uncompressed values, including
+/// tombstones, are never misread.
+class ValueCompressor
+{
+public:
+  /// The memcached item flag used to mark a value as compressed.
+  static const uint32_t FLAG = 0x1;
+
+  /// Constructor.
+  ///
+  /// @param dictionary  - Preset dictionary.  Values compressed with one
+  ///                      dictionary can only be decompressed with the same
+  ///                      dictionary, so this must be the same on every node.
+  /// @param min_length  - Values shorter than this are never compressed.
+  /// @param level       - zlib compression level (1-9, or -1 for the default).
+  ValueCompressor(const std::string& dictionary = "",
+                  size_t min_length = 256,
+                  int level = -1);
+
+  /// Compress a value.
+  ///
+  /// @return            - Whether the value was compressed.  False if the
+  ///                      value is too short or wouldn't get any smaller, in
+  ///                      which case it should be stored as is.
+  bool compress(const std::string& value, std::string& compressed) const;
+
+  /// Decompress a value.
+  ///
+  /// @return            - Whether the value was successfully decompressed.
+  bool decompress(const std::string& compressed, std::string& value) const;
+
+private:
+  static const uint8_t VERSION = 1;
+  static const size_t HEADER_LENGTH = 5;
+
+  // The zlib window size (as a power of 2).  Values are at most 64KB, so a
+  // smaller window than zlib's default costs little in ratio but keeps the
+  // per-value working memory down.
+  static const int WINDOW_BITS = 13;
+  static const int MEM_LEVEL = 6;
+
+  const std::string _dictionary;
+  const size_t _min_length;
+  const int _level;
+};
+
+#endif
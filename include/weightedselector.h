@@ -18,7 +18,8 @@
 
 /// The WeightedSelector class is used to implement resource
 /// selection between a number of different options at a single priority
-/// level according to the weighting of each record.
+/// level according to the weighting of each record, without replacement
+/// (each selection sets the weight of the selected entry to zero).
 /// T is a class with a visible member weight.
 template <class T>
 class WeightedSelector
@@ -132,9 +133,150 @@ int WeightedSelector<T>::total_weight()
 template <class T>
 int WeightedSelector<T>::get_rand()
 {
-  int s = rand() % _tree[0];
+  // Use the per-thread generator rather than rand(), which takes a global
+  // lock.
+  int s = Utils::FastRandom::uniform(_tree[0]);
   return s;
 }
 
 
+/// The AliasSelector class selects between a number of different options
+/// according to their weights *with* replacement (so the same option can be
+/// selected repeatedly), using Vose's alias method.  Building the selector is
+/// O(n), after which each selection is O(1) and doesn't modify the selector,
+/// so a single selector can be shared between threads.
+/// T is a class with a visible member get_weight().
+template <class T>
+class AliasSelector
+{
+public:
+  /// Constructor.
+  AliasSelector(const std::vector<T>& items);
+
+  /// Destructor.
+  virtual ~AliasSelector();
+
+  /// Selects an entry, returning its index.  There must be at least one
+  /// entry.
+  int select() const;
+
+  /// Returns the number of entries in the selector.
+  size_t size() const { return _prob.size(); }
+
+  // function to generate a random number in the range [0, n).  Implemented
+  // separately to allow mocking in tests.
+  virtual uint32_t get_rand(uint32_t n) const;
+
+private:
+  // For each entry, the probability (scaled by _total_weight) of selecting
+  // the entry itself rather than its alias, and the index of its alias.
+  std::vector<uint64_t> _prob;
+  std::vector<int> _alias;
+  uint64_t _total_weight;
+};
+
+template <class T>
+AliasSelector<T>::AliasSelector(const std::vector<T>& items) :
+  _prob(items.size()),
+  _alias(items.size()),
+  _total_weight(0)
+{
+  size_t n = items.size();
+
+  for (size_t ii = 0; ii < n; ++ii)
+  {
+    _total_weight += items[ii].get_weight();
+  }
+
+  // Scale each weight by the number of entries, so that an entry with exactly
+  // the average weight has a scaled weight of _total_weight.  If all the
+  // weights are zero, treat them as equal.
+  bool all_zero = (_total_weight == 0);
+  if (all_zero)
+  {
+    _total_weight = n;
+  }
+
+  std::vector<uint64_t> scaled(n);
+  std::vector<int> small;
+  std::vector<int> large;
+
+  for (size_t ii = 0; ii < n; ++ii)
+  {
+    scaled[ii] = (all_zero ? 1 : (uint64_t)items[ii].get_weight()) * n;
+    if (scaled[ii] < _total_weight)
+    {
+      small.push_back(ii);
+    }
+    else
+    {
+      large.push_back(ii);
+    }
+  }
+
+  // Pair each below-average entry with an above-average entry, which makes up
+  // the remainder of its column.
+  while ((!small.empty()) && (!large.empty()))
+  {
+    int l = small.back();
+    small.pop_back();
+    int g = large.back();
+    large.pop_back();
+
+    _prob[l] = scaled[l];
+    _alias[l] = g;
+
+    scaled[g] = (scaled[g] + scaled[l]) - _total_weight;
+    if (scaled[g] < _total_weight)
+    {
+      small.push_back(g);
+    }
+    else
+    {
+      large.push_back(g);
+    }
+  }
+
+  // Anything left fills its whole column.  (All the arithmetic is exact, so
+  // small should be empty by now.)
+  while (!large.empty())
+  {
+    _prob[large.back()] = _total_weight;
+    _alias[large.back()] = large.back();
+    large.pop_back();
+  }
+
+  while (!small.empty())
+  {
+    // LCOV_EXCL_START
+    _prob[small.back()] = _total_weight;
+    _alias[small.back()] = small.back();
+    small.pop_back();
+    // LCOV_EXCL_STOP
+  }
+}
+
+template <class T>
+AliasSelector<T>::~AliasSelector()
+{
+}
+
+template <class T>
+int AliasSelector<T>::select() const
+{
+  // Pick a column uniformly, then pick either the entry or its alias
+  // according to the column's probability.
+  int ii = get_rand(_prob.size());
+  uint64_t r = ((_total_weight <= UINT32_MAX) ?
+                  get_rand((uint32_t)_total_weight) :
+                  Utils::FastRandom::next() % _total_weight);
+  return (r < _prob[ii]) ? ii : _alias[ii];
+}
+
+template <class T>
+uint32_t AliasSelector<T>::get_rand(uint32_t n) const
+{
+  return Utils::FastRandom::uniform(n);
+}
+
 #endif
@@ -0,0 +1,241 @@
+/**
+ * @file writecoalescingstore.h Declarations for the WriteCoalescingStore class.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef WRITECOALESCINGSTORE_H__
+#define WRITECOALESCINGSTORE_H__
+
+#include <pthread.h>
+
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "store.h"
+#include "cond_var.h"
+#include "snmp_counter_table.h"
+#include "exception_handler.h"
+#include "threadpool.h"
+
+/// @class WriteCoalescingStore
+///
+/// A Store that delays writes made with set_data_without_cas for a short
+/// window before passing them on to another Store (typically a
+/// TopologyNeutralMemcachedStore).  If the same record is written again
+/// within the window only the latest value is sent, which saves a network
+/// round trip for callers that repeatedly refresh the same record.
+///
+/// Because the writes happen in the background, set_data_without_cas always
+/// returns OK once the write has been queued - failures are only logged.
+///
+/// Writes that are due are sent in parallel on a pool of threads.  Writes to
+/// the same record are never sent concurrently, so they can't be reordered.
+/// The number of queued writes is bounded - once the queue is full, writes
+/// are sent synchronously instead.
+///
+/// All other operations are passed straight through, but any queued write to
+/// the same record is sent (or, for a delete, discarded) first, so callers
+/// always read their own writes.
+///
+/// Writes are only delayed while the store is running (between start() and
+/// stop()).  stop() sends all queued writes before returning.
+class WriteCoalescingStore : public Store
+{
+public:
+  /// Constructor.
+  ///
+  /// @param store           - The store to write to.  Not owned by this
+  ///                          store.
+  /// @param window_ms       - How long (in milliseconds) to hold on to each
+  ///                          write.
+  /// @param exception_handler
+  ///                        - Handles exceptions on the threads that send
+  ///                          writes.
+  /// @param coalesced_table - Optional counter of the writes that were never
+  ///                          sent because a later write replaced them.
+  /// @param num_threads     - The number of threads to send writes on.
+  /// @param max_queue       - The most writes that can be queued.
+  WriteCoalescingStore(Store* store,
+                       uint64_t window_ms,
+                       ExceptionHandler* exception_handler,
+                       SNMP::CounterTable* coalesced_table = NULL,
+                       unsigned int num_threads = DEFAULT_NUM_THREADS,
+                       size_t max_queue = DEFAULT_MAX_QUEUE);
+
+  /// Destructor.  Stops the store (sending any queued writes) if it is still
+  /// running.
+  virtual ~WriteCoalescingStore();
+
+  /// Start the threads that send queued writes.
+  ///
+  /// @return - Whether the threads were started successfully.
+  bool start();
+
+  /// Send all queued writes and stop the store.  This blocks until the
+  /// writes are complete.
+  void stop();
+
+  /// Send all queued writes now.  This blocks until the writes are complete.
+  void flush();
+
+  using Store::get_data;
+  using Store::set_data;
+
+  Store::Status get_data(const std::string& table,
+                         const std::string& key,
+                         std::string& data,
+                         uint64_t& cas,
+                         SAS::TrailId trail,
+                         bool log_body,
+                         Store::Format data_format) override;
+
+  Store::Status set_data(const std::string& table,
+                         const std::string& key,
+                         const std::string& data,
+                         uint64_t cas,
+                         int expiry,
+                         SAS::TrailId trail,
+                         bool log_body,
+                         Store::Format data_format) override;
+
+  Store::Status set_data_without_cas(const std::string& table,
+                                     const std::string& key,
+                                     const std::string& data,
+                                     int expiry,
+                                     SAS::TrailId trail,
+                                     bool log_body,
+                                     Store::Format data_format=Store::Format::HEX) override;
+
+  Store::Status delete_data(const std::string& table,
+                            const std::string& key,
+                            SAS::TrailId trail = 0) override;
+
+  void get_data_batch(std::vector<Store::BatchItem>& items,
+                      SAS::TrailId trail = 0) override;
+
+  void set_data_batch(std::vector<Store::BatchItem>& items,
+                      SAS::TrailId trail = 0) override;
+
+  void delete_data_batch(std::vector<Store::BatchItem>& items,
+                         SAS::TrailId trail = 0) override;
+
+  bool has_servers() override { return _store->has_servers(); }
+
+  static const unsigned int DEFAULT_NUM_THREADS = 4;
+  static const size_t DEFAULT_MAX_QUEUE = 10000;
+
+private:
+  // A queued write.
+  struct Write
+  {
+    std::string table;
+    std::string key;
+    std::string data;
+    int expiry;
+    SAS::TrailId trail;
+    bool log_body;
+    Store::Format data_format;
+
+    // When the write is due to be sent.
+    uint64_t due_ms;
+
+    // Set if the write was due while an earlier write to the same record was
+    // in flight.  It is sent when that write completes.
+    bool deferred;
+  };
+
+  static void* static_flush_thread_function(void* store);
+  void flush_thread_function();
+
+  // Wait for any write to the record that is in progress to complete, then
+  // send (or, if `discard` is true, throw away) any queued write to it.
+  // Afterwards the underlying store holds the latest value written through
+  // this store.  This only waits for writes to this record.
+  void settle(const std::string& fqkey, bool discard);
+
+  // Remove queued writes that are due at or before `now` (or all of them if
+  // `all` is true) and mark them as in flight.  Writes to records that
+  // already have a write in flight are deferred until it completes.  Must be
+  // called with `_lock` held.
+  void take_writes(uint64_t now, bool all, std::vector<Write>& writes);
+
+  // Pass writes removed by take_writes to the send pool.  Must be called
+  // without `_lock` held.
+  void dispatch(std::vector<Write>& writes);
+
+  // Send a write to the underlying store, and then complete it.
+  void send(const Write& write);
+
+  // Clear the in-flight mark for a record once a write to it has been sent,
+  // and take any deferred write to it.  Must be called with `_lock` held.
+  void complete(const std::string& fqkey, std::vector<Write>& writes);
+
+  // Whether a write to the record has been taken (but not completed), either
+  // because it is in flight or because it is deferred behind another write.
+  // Must be called with `_lock` held.
+  bool taken(const std::string& fqkey);
+
+  static void exception_callback(std::function<void()> work)
+  {
+    // No recovery behaviour as the write is asynchronous, so we can't
+    // sensibly respond.
+  }
+
+  static inline std::string get_fq_key(const std::string& table,
+                                       const std::string& key)
+  {
+    std::string fqkey;
+    fqkey.reserve(table.length() + 2 + key.length());
+    fqkey.append(table).append("\\\\").append(key);
+    return fqkey;
+  }
+
+  Store* _store;
+  const uint64_t _window_ms;
+  ExceptionHandler* _exception_handler;
+  SNMP::CounterTable* _coalesced_table;
+
+  const unsigned int _num_threads;
+  const size_t _max_queue;
+
+  // The pool that sends writes.  Only exists while the store is running, and
+  // is only stopped once all the writes given to it have completed (as
+  // stopping it discards any queued work).
+  FunctorThreadPool* _pool;
+
+  // Protects all the fields below.
+  pthread_mutex_t _lock;
+
+  // Signalled when a write is queued and when the store is stopping.
+  CondVar _cond;
+
+  // Broadcast whenever a write completes.
+  CondVar _complete_cond;
+
+  bool _running;
+  bool _terminate;
+  pthread_t _flush_thread;
+
+  // Queued writes, by fully qualified key.
+  std::unordered_map<std::string, Write> _pending;
+
+  // The order in which queued writes are due.  An entry is stale (and
+  // skipped) if the write it refers to has already been sent or discarded.
+  // Its length is limited to _max_queue, which also limits _pending.
+  std::deque<std::pair<uint64_t, std::string>> _queue;
+
+  // Records that are currently being written to the underlying store.  At
+  // most one write to each record is in flight at once.
+  std::unordered_set<std::string> _in_flight;
+};
+
+#endif
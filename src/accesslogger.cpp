@@ -10,18 +10,78 @@
  */
 
 #include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include <algorithm>
 
 #include "accesslogger.h"
+#include "log.h"
 
-AccessLogger::AccessLogger(const std::string& directory)
+AccessLogger::AccessLogger(const std::string& directory,
+                           bool async,
+                           unsigned int ring_size) :
+  _async(async),
+  _ring(NULL),
+  _ring_mask(0),
+  _write_pos(0),
+  _read_pos(0),
+  _dropped(0),
+  _dropped_reported(0),
+  _lock(PTHREAD_MUTEX_INITIALIZER),
+  _cond(&_lock),
+  _terminate(false),
+  _writer_waiting(false)
 {
   _logger = new Logger(directory, std::string("access"));
   _logger->set_flags(Logger::ADD_TIMESTAMPS|Logger::FLUSH_ON_WRITE);
+
+  if (_async)
+  {
+    uint64_t size = 1;
+
+    while (size < std::max(ring_size, 2u))
+    {
+      size <<= 1;
+    }
+
+    _ring = new Record[size];
+    _ring_mask = size - 1;
+
+    for (uint64_t ii = 0; ii < size; ++ii)
+    {
+      _ring[ii].sequence.store(ii, std::memory_order_relaxed);
+    }
+
+    int rc = pthread_create(&_writer_thread, NULL, writer_thread_fn, this);
+
+    if (rc != 0)
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to start access log thread (%d), logging synchronously",
+                rc);
+      _async = false;
+      // LCOV_EXCL_STOP
+    }
+  }
 }
 
 AccessLogger::~AccessLogger()
 {
+  if (_async)
+  {
+    // The writer thread writes any remaining logs before exiting.
+    pthread_mutex_lock(&_lock);
+    _terminate = true;
+    _cond.signal();
+    pthread_mutex_unlock(&_lock);
+
+    pthread_join(_writer_thread, NULL);
+  }
+
+  delete[] _ring; _ring = NULL;
   delete _logger;
+  pthread_mutex_destroy(&_lock);
 }
 
 void AccessLogger::log(const std::string& uri,
@@ -29,13 +89,234 @@ void AccessLogger::log(const std::string& uri,
                        int rc,
                        unsigned long latency_us)
 {
-  char buf[BUFFER_SIZE];
-  snprintf(buf, sizeof(buf),
-           "%d %s %s %ld.%6.6ld seconds\n",
-           rc,
-           method.c_str(),
-           uri.c_str(),
-           latency_us / 1000000,
-           latency_us % 1000000);
-  _logger->write(buf);
+  if (!_async)
+  {
+    char buf[BUFFER_SIZE];
+    snprintf(buf, sizeof(buf),
+             "%d %s %s %ld.%6.6ld seconds\n",
+             rc,
+             method.c_str(),
+             uri.c_str(),
+             latency_us / 1000000,
+             latency_us % 1000000);
+    _logger->write(buf);
+    return;
+  }
+
+  // Claim a slot.  A slot is free if its sequence number matches the write
+  // position - if it is behind, the writer thread hasn't read it yet, so the
+  // ring is full.
+  uint64_t pos = _write_pos.load(std::memory_order_relaxed);
+  Record* record;
+
+  while (true)
+  {
+    record = &_ring[pos & _ring_mask];
+    uint64_t sequence = record->sequence.load(std::memory_order_acquire);
+
+    if (sequence == pos)
+    {
+      if (_write_pos.compare_exchange_weak(pos,
+                                           pos + 1,
+                                           std::memory_order_relaxed))
+      {
+        break;
+      }
+    }
+    else if (sequence < pos)
+    {
+      _dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    else
+    {
+      // Another thread claimed this slot - try again.
+      pos = _write_pos.load(std::memory_order_relaxed);
+    }
+  }
+
+  clock_gettime(CLOCK_REALTIME, &record->time);
+  record->rc = rc;
+  record->latency_us = latency_us;
+  record->method_length = std::min(method.length(), (size_t)MAX_METHOD_LENGTH);
+  memcpy(record->method, method.data(), record->method_length);
+  record->url_length = std::min(uri.length(), (size_t)MAX_URL_LENGTH);
+  memcpy(record->url, uri.data(), record->url_length);
+
+  // Publish the record to the writer thread, and wake it if it is waiting
+  // for an empty ring.  Publishing the record and checking the flag are
+  // sequentially consistent (as are setting the flag and checking the ring
+  // in writer_thread_fn), so either the writer sees this record before it
+  // waits or we see that it is waiting.
+  record->sequence.store(pos + 1, std::memory_order_seq_cst);
+
+  if ((_writer_waiting.load(std::memory_order_seq_cst)) &&
+      (_writer_waiting.exchange(false)))
+  {
+    pthread_mutex_lock(&_lock);
+    _cond.signal();
+    pthread_mutex_unlock(&_lock);
+  }
+}
+
+int AccessLogger::format(char* buf,
+                         const char* timestamp,
+                         int rc,
+                         const char* method,
+                         int method_length,
+                         const char* url,
+                         int url_length,
+                         unsigned long latency_us)
+{
+  int length = snprintf(buf, BUFFER_SIZE,
+                        "%s %d %.*s %.*s %ld.%6.6ld seconds\n",
+                        timestamp,
+                        rc,
+                        method_length,
+                        method,
+                        url_length,
+                        url,
+                        latency_us / 1000000,
+                        latency_us % 1000000);
+
+  // snprintf returns the length the line would have had if it had fitted.
+  // Lines that don't fit lose their newline, as they do when logging
+  // synchronously.
+  return std::min(length, BUFFER_SIZE - 1);
+}
+
+void* AccessLogger::writer_thread_fn(void* access_logger)
+{
+  ((AccessLogger*)access_logger)->writer_thread_fn();
+  return NULL;
+}
+
+void AccessLogger::writer_thread_fn()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (true)
+  {
+    bool terminate = _terminate;
+    pthread_mutex_unlock(&_lock);
+
+    // Write batches until the ring is empty.
+    while (write_batch() > 0)
+    {
+    }
+
+    pthread_mutex_lock(&_lock);
+
+    if (terminate)
+    {
+      break;
+    }
+
+    // Wait for a producer to signal that it has added a log.  The lock is
+    // held from setting the flag until waiting, so the signal can't be lost.
+    _writer_waiting.store(true, std::memory_order_seq_cst);
+
+    if ((!_terminate) && (!record_ready()))
+    {
+      struct timespec deadline;
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      deadline.tv_sec += FLUSH_INTERVAL_MS / 1000;
+      deadline.tv_nsec += (FLUSH_INTERVAL_MS % 1000) * 1000000;
+
+      if (deadline.tv_nsec >= 1000000000)
+      {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000;
+      }
+
+      _cond.timedwait(&deadline);
+    }
+
+    _writer_waiting.store(false, std::memory_order_relaxed);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+bool AccessLogger::record_ready()
+{
+  Record* record = &_ring[_read_pos & _ring_mask];
+  return (record->sequence.load(std::memory_order_seq_cst) == _read_pos + 1);
+}
+
+int AccessLogger::write_batch()
+{
+  char lines[MAX_BATCH_SIZE + 1][BUFFER_SIZE];
+  struct iovec iov[MAX_BATCH_SIZE + 1];
+  int count = 0;
+
+  // Formatting the timestamp is relatively expensive, so only do it when
+  // the time (to the millisecond) changes.
+  char timestamp[100] = "";
+  time_t last_sec = 0;
+  long last_msec = -1;
+
+  while ((count < MAX_BATCH_SIZE) && (record_ready()))
+  {
+    Record* record = &_ring[_read_pos & _ring_mask];
+
+    long msec = record->time.tv_nsec / 1000000;
+
+    if ((record->time.tv_sec != last_sec) || (msec != last_msec))
+    {
+      timestamp_t ts;
+      Logger::get_timestamp(ts, record->time);
+      Logger::format_timestamp(ts, timestamp, sizeof(timestamp));
+      last_sec = record->time.tv_sec;
+      last_msec = msec;
+    }
+
+    iov[count].iov_base = lines[count];
+    iov[count].iov_len = format(lines[count],
+                                timestamp,
+                                record->rc,
+                                record->method,
+                                record->method_length,
+                                record->url,
+                                record->url_length,
+                                record->latency_us);
+    ++count;
+
+    // Free the slot for the producers' next lap of the ring.
+    record->sequence.store(_read_pos + _ring_mask + 1, std::memory_order_release);
+    ++_read_pos;
+  }
+
+  // Report any logs that have been dropped since the last batch.
+  uint64_t dropped = _dropped.load(std::memory_order_relaxed);
+
+  if (dropped != _dropped_reported)
+  {
+    if (count == 0)
+    {
+      // No logs in this batch, so timestamp the line with the current time.
+      struct timespec now;
+      clock_gettime(CLOCK_REALTIME, &now);
+      timestamp_t ts;
+      Logger::get_timestamp(ts, now);
+      Logger::format_timestamp(ts, timestamp, sizeof(timestamp));
+    }
+
+    iov[count].iov_base = lines[count];
+    iov[count].iov_len = std::min(snprintf(lines[count], BUFFER_SIZE,
+                                           "%s %lu access logs dropped\n",
+                                           timestamp,
+                                           dropped - _dropped_reported),
+                                  BUFFER_SIZE - 1);
+    TRC_WARNING("%lu access logs dropped", dropped - _dropped_reported);
+    _dropped_reported = dropped;
+    ++count;
+  }
+
+  if (count > 0)
+  {
+    _logger->write_batch(iov, count);
+  }
+
+  return count;
 }
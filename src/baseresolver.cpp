@@ -9,6 +9,7 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
+#include <string.h>
 #include <time.h>
 
 #include <algorithm>
@@ -44,13 +45,24 @@ BaseResolver::BaseResolver(DnsCachedResolver* dns_client) :
   _naptr_cache(),
   _srv_factory(),
   _srv_cache(),
-  _hosts(),
+  _host_table(new HostSlot[HOST_TABLE_SIZE]),
+  _host_table_entries(0),
+  _host_overflow(),
+  _host_overflow_used(false),
   _dns_client(dns_client)
 {
 }
 
 BaseResolver::~BaseResolver()
 {
+  for (std::map<AddrInfo, Host*>::iterator i = _host_overflow.begin();
+       i != _host_overflow.end();
+       ++i)
+  {
+    delete i->second;
+  }
+
+  delete[] _host_table; _host_table = NULL;
 }
 
 // Removes all the entries from the blacklist.
@@ -58,7 +70,25 @@ void BaseResolver::clear_blacklist()
 {
   TRC_DEBUG("Clear blacklist");
   pthread_mutex_lock(&_hosts_lock);
-  _hosts.clear();
+
+  for (size_t ii = 0; ii < HOST_TABLE_SIZE; ++ii)
+  {
+    if (_host_table[ii].state.load(std::memory_order_relaxed) == HostSlot::USED)
+    {
+      tombstone_host_slot(_host_table[ii]);
+    }
+  }
+
+  for (std::map<AddrInfo, Host*>::iterator i = _host_overflow.begin();
+       i != _host_overflow.end();
+       ++i)
+  {
+    delete i->second;
+  }
+
+  _host_overflow.clear();
+  _host_overflow_used.store(false, std::memory_order_release);
+
   pthread_mutex_unlock(&_hosts_lock);
 }
 
@@ -224,9 +254,9 @@ void BaseResolver::blacklist(const AddrInfo& ai,
   std::string ai_str = ai.to_string();
   TRC_DEBUG("Add %s to blacklist for %d seconds, graylist for %d seconds",
             ai_str.c_str(), blacklist_ttl, graylist_ttl);
+
   pthread_mutex_lock(&_hosts_lock);
-  _hosts.erase(ai);
-  _hosts.emplace(ai, Host(blacklist_ttl, graylist_ttl));
+  find_or_add_host(ai, time(NULL))->blacklist(blacklist_ttl, graylist_ttl);
   pthread_mutex_unlock(&_hosts_lock);
 }
 
@@ -482,12 +512,11 @@ bool BaseResolver::SRVCacheFactory::compare_srv_priority(DnsRRecord* r1,
   return (((DnsSrvRecord*)r1)->priority() < ((DnsSrvRecord*)r2)->priority());
 }
 
-BaseResolver::Host::Host(int blacklist_ttl, int graylist_ttl) :
+BaseResolver::Host::Host() :
+  _blacklist_expiry_time(0),
+  _graylist_expiry_time(0),
   _being_probed(false)
 {
-  time_t current_time = time(NULL);
-  _blacklist_expiry_time = current_time + blacklist_ttl;
-  _graylist_expiry_time = current_time + blacklist_ttl + graylist_ttl;
 }
 
 BaseResolver::Host::~Host()
@@ -513,7 +542,7 @@ std::string BaseResolver::Host::state_to_string(State state)
   }
 }
 
-BaseResolver::Host::State BaseResolver::Host::get_state(time_t current_time)
+BaseResolver::Host::State BaseResolver::Host::get_state(time_t current_time) const
 {
   if (current_time < _blacklist_expiry_time)
   {
@@ -536,6 +565,23 @@ BaseResolver::Host::State BaseResolver::Host::get_state(time_t current_time)
   }
 }
 
+void BaseResolver::Host::blacklist(int blacklist_ttl, int graylist_ttl)
+{
+  // Set the blacklist expiry time first, so concurrent readers see the Host
+  // as blacklisted while the other fields are updated.
+  time_t blacklist_expiry_time = time(NULL) + blacklist_ttl;
+  _blacklist_expiry_time = blacklist_expiry_time;
+  _graylist_expiry_time = blacklist_expiry_time + graylist_ttl;
+  _being_probed = false;
+}
+
+void BaseResolver::Host::clear()
+{
+  _being_probed = false;
+  _blacklist_expiry_time = 0;
+  _graylist_expiry_time = 0;
+}
+
 void BaseResolver::Host::success()
 {
   if (get_state() != State::BLACK)
@@ -546,43 +592,311 @@ void BaseResolver::Host::success()
   }
 }
 
-void BaseResolver::Host::selected_for_probing(pthread_t user_id)
+bool BaseResolver::Host::selected_for_probing(pthread_t user_id)
 {
+  bool selected = false;
+
   if (get_state() == State::GRAY_NOT_PROBING)
   {
-    _being_probed = true;
-    _probing_user_id = user_id;
+    // Only one user may probe the Host, so only the first user to set the
+    // flag is selected.
+    bool expected = false;
+    selected = _being_probed.compare_exchange_strong(expected, true);
+    if (selected)
+    {
+      _probing_user_id = user_id;
+    }
   }
+
+  return selected;
 }
 
-BaseResolver::Host::State BaseResolver::host_state(const AddrInfo& ai,
+bool BaseResolver::read_host_state(const HostKey& key,
+                                   time_t current_time,
+                                   Host::State& state)
+{
+  size_t home = host_hash(key);
+
+  for (size_t ii = 0; ii < MAX_HOST_PROBES; ++ii)
+  {
+    HostSlot& slot = _host_table[(home + ii) & (HOST_TABLE_SIZE - 1)];
+
+    while (true)
+    {
+      uint32_t sequence = slot.sequence.load(std::memory_order_acquire);
+
+      if (sequence & 1)
+      {
+        // The slot is being claimed or tombstoned - try again.
+        continue; // LCOV_EXCL_LINE
+      }
+
+      // These loads have acquire semantics, so the sequence number can't be
+      // reread until they're complete.
+      int slot_state = slot.state.load(std::memory_order_acquire);
+      bool match = (slot_state == HostSlot::USED);
+
+      for (int jj = 0; (match) && (jj < HOST_KEY_WORDS); ++jj)
+      {
+        match = (slot.key[jj].load(std::memory_order_acquire) == key[jj]);
+      }
+
+      Host::State host_state = (match) ? slot.host.get_state(current_time) :
+                                         Host::State::WHITE;
+
+      if (slot.sequence.load(std::memory_order_acquire) != sequence)
+      {
+        // The slot changed while we were reading it - try again.
+        continue; // LCOV_EXCL_LINE
+      }
+
+      if (match)
+      {
+        state = host_state;
+        return true;
+      }
+      else if (slot_state == HostSlot::EMPTY)
+      {
+        // Slots never become empty again once claimed, so the key isn't in
+        // the table.
+        return false;
+      }
+
+      break;
+    }
+  }
+
+  return false;
+}
+
+BaseResolver::HostSlot* BaseResolver::find_host_slot(const HostKey& key)
+{
+  size_t home = host_hash(key);
+
+  for (size_t ii = 0; ii < MAX_HOST_PROBES; ++ii)
+  {
+    HostSlot& slot = _host_table[(home + ii) & (HOST_TABLE_SIZE - 1)];
+    int slot_state = slot.state.load(std::memory_order_relaxed);
+
+    if (slot_state == HostSlot::EMPTY)
+    {
+      break;
+    }
+
+    if (slot_state == HostSlot::USED)
+    {
+      bool match = true;
+
+      for (int jj = 0; (match) && (jj < HOST_KEY_WORDS); ++jj)
+      {
+        match = (slot.key[jj].load(std::memory_order_relaxed) == key[jj]);
+      }
+
+      if (match)
+      {
+        return &slot;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+BaseResolver::Host* BaseResolver::find_host(const AddrInfo& ai)
+{
+  HostKey key;
+  host_key(ai, key);
+  HostSlot* slot = find_host_slot(key);
+
+  if (slot != NULL)
+  {
+    return &slot->host;
+  }
+
+  std::map<AddrInfo, Host*>::const_iterator i = _host_overflow.find(ai);
+  return (i != _host_overflow.end()) ? i->second : NULL;
+}
+
+BaseResolver::Host* BaseResolver::find_or_add_host(const AddrInfo& ai,
                                                    time_t current_time)
 {
-  Host::State state;
-  Hosts::iterator i = _hosts.find(ai);
-  std::string ai_str;
+  Host* host = find_host(ai);
 
-  if (Log::enabled(Log::DEBUG_LEVEL))
+  if (host != NULL)
   {
-    ai_str = ai.to_string();
+    return host;
   }
 
-  if (i != _hosts.end())
+  HostKey key;
+  host_key(ai, key);
+  size_t home = host_hash(key);
+  HostSlot* free_slot = NULL;
+
+  for (size_t ii = 0; ii < MAX_HOST_PROBES; ++ii)
   {
-    state = i->second.get_state(current_time);
-    if (state == Host::State::WHITE)
+    HostSlot& slot = _host_table[(home + ii) & (HOST_TABLE_SIZE - 1)];
+    int slot_state = slot.state.load(std::memory_order_relaxed);
+
+    if ((slot_state == HostSlot::USED) &&
+        (slot.host.get_state(current_time) == Host::State::WHITE))
+    {
+      // This Host's graylist time has elapsed, so reclaim its slot.
+      tombstone_host_slot(slot);
+      slot_state = HostSlot::TOMBSTONE;
+    }
+
+    if ((slot_state != HostSlot::USED) && (free_slot == NULL))
+    {
+      free_slot = &slot;
+    }
+
+    if (slot_state == HostSlot::EMPTY)
     {
-      TRC_DEBUG("%s graylist time elapsed", ai_str.c_str());
-      _hosts.erase(i);
+      break;
     }
   }
-  else
+
+  if ((free_slot != NULL) && (_host_table_entries < MAX_HOST_TABLE_ENTRIES))
+  {
+    // The slot's Host is whitelisted when it is claimed.
+    claim_host_slot(*free_slot, key);
+    return &free_slot->host;
+  }
+
+  // LCOV_EXCL_START - only hit if a very large number of hosts are
+  // blacklisted or graylisted at once.
+  TRC_WARNING("No room in the blacklist hosts table, adding to overflow");
+  sweep_host_overflow(current_time);
+
+  host = new Host();
+  _host_overflow[ai] = host;
+  _host_overflow_used.store(true, std::memory_order_release);
+
+  return host;
+  // LCOV_EXCL_STOP
+}
+
+void BaseResolver::claim_host_slot(HostSlot& slot, const HostKey& key)
+{
+  // Make the sequence number odd while the slot changes.  The stores below
+  // have release semantics, so a reader that sees any of them also sees the
+  // odd sequence number when it rechecks it.
+  uint32_t sequence = slot.sequence.load(std::memory_order_relaxed);
+  slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+
+  for (int ii = 0; ii < HOST_KEY_WORDS; ++ii)
+  {
+    slot.key[ii].store(key[ii], std::memory_order_release);
+  }
+
+  slot.host.clear();
+  slot.state.store(HostSlot::USED, std::memory_order_release);
+  slot.sequence.store(sequence + 2, std::memory_order_release);
+
+  ++_host_table_entries;
+}
+
+void BaseResolver::tombstone_host_slot(HostSlot& slot)
+{
+  uint32_t sequence = slot.sequence.load(std::memory_order_relaxed);
+  slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+  slot.state.store(HostSlot::TOMBSTONE, std::memory_order_release);
+  slot.sequence.store(sequence + 2, std::memory_order_release);
+
+  --_host_table_entries;
+}
+
+void BaseResolver::sweep_host_overflow(time_t current_time)
+{
+  std::map<AddrInfo, Host*>::iterator i = _host_overflow.begin();
+
+  while (i != _host_overflow.end())
+  {
+    if (i->second->get_state(current_time) == Host::State::WHITE)
+    {
+      delete i->second;
+      _host_overflow.erase(i++);
+    }
+    else
+    {
+      ++i;
+    }
+  }
+
+  _host_overflow_used.store(!_host_overflow.empty(), std::memory_order_release);
+}
+
+void BaseResolver::host_key(const AddrInfo& ai, HostKey& key)
+{
+  key[0] = ((uint64_t)(uint32_t)ai.address.af << 32) | (uint32_t)ai.transport;
+  key[1] = (uint64_t)(uint32_t)ai.port;
+  key[2] = 0;
+  key[3] = 0;
+
+  if (ai.address.af == AF_INET)
+  {
+    key[2] = ai.address.addr.ipv4.s_addr;
+  }
+  else if (ai.address.af == AF_INET6)
+  {
+    memcpy(&key[2], &ai.address.addr.ipv6, sizeof(ai.address.addr.ipv6));
+  }
+}
+
+size_t BaseResolver::host_hash(const HostKey& key)
+{
+  // FNV-1a over the key.
+  const unsigned char* bytes = (const unsigned char*)key;
+  uint32_t hash = 2166136261u;
+
+  for (size_t ii = 0; ii < sizeof(HostKey); ++ii)
+  {
+    hash = (hash ^ bytes[ii]) * 16777619u;
+  }
+
+  return hash & (HOST_TABLE_SIZE - 1);
+}
+
+BaseResolver::Host::State BaseResolver::lookup_host_state(const AddrInfo& ai,
+                                                          time_t current_time)
+{
+  HostKey key;
+  host_key(ai, key);
+  Host::State state;
+
+  if (!read_host_state(key, current_time, state))
   {
     state = Host::State::WHITE;
+
+    if (_host_overflow_used.load(std::memory_order_acquire))
+    {
+      // LCOV_EXCL_START - only hit if a very large number of hosts are
+      // blacklisted or graylisted at once.
+      pthread_mutex_lock(&_hosts_lock);
+      sweep_host_overflow(current_time);
+
+      std::map<AddrInfo, Host*>::const_iterator i = _host_overflow.find(ai);
+      if (i != _host_overflow.end())
+      {
+        state = i->second->get_state(current_time);
+      }
+
+      pthread_mutex_unlock(&_hosts_lock);
+      // LCOV_EXCL_STOP
+    }
   }
 
+  return state;
+}
+
+BaseResolver::Host::State BaseResolver::host_state(const AddrInfo& ai,
+                                                   time_t current_time)
+{
+  Host::State state = lookup_host_state(ai, current_time);
+
   if (Log::enabled(Log::DEBUG_LEVEL))
   {
+    std::string ai_str = ai.to_string();
     std::string state_str = Host::state_to_string(state);
     TRC_DEBUG("%s has state: %s", ai_str.c_str(), state_str.c_str());
   }
@@ -598,8 +912,6 @@ bool BaseResolver::select_address(const AddrInfo& addr,
   const bool whitelisted_allowed = allowed_host_state & BaseResolver::WHITELISTED;
   const bool blacklisted_allowed = allowed_host_state & BaseResolver::BLACKLISTED;
 
-  pthread_mutex_lock(&_hosts_lock);
-
   BaseResolver::Host::State state = host_state(addr);
 
   switch (state)
@@ -612,10 +924,12 @@ bool BaseResolver::select_address(const AddrInfo& addr,
     allowed = whitelisted_allowed;
 
     // If the address is allowed, we need to mark it as being probed (so that
-    // further requests do not consider it to whitelisted).
-    if (allowed)
+    // further requests do not consider it to whitelisted).  If another
+    // request has just been selected to probe it, treat it as being probed.
+    if ((allowed) && (!select_for_probing(addr)))
     {
-      select_for_probing(addr);
+      state = BaseResolver::Host::State::GRAY_PROBING;
+      allowed = blacklisted_allowed;
     }
     break;
 
@@ -635,8 +949,6 @@ bool BaseResolver::select_address(const AddrInfo& addr,
     // LCOV_EXCL_STOP
   }
 
-  pthread_mutex_unlock(&_hosts_lock);
-
   std::string host_state_str = BaseResolver::Host::state_to_string(state);
   std::string addr_str = addr.address_and_port_to_string();
 
@@ -672,28 +984,72 @@ void BaseResolver::success(const AddrInfo& ai)
     TRC_DEBUG("Successful response from  %s", ai_str.c_str());
   }
 
+  time_t current_time = time(NULL);
+
+  if (lookup_host_state(ai, current_time) == Host::State::WHITE)
+  {
+    // Nothing to do, so don't take the lock.
+    return;
+  }
+
   pthread_mutex_lock(&_hosts_lock);
 
-  Hosts::iterator i = _hosts.find(ai);
+  HostKey key;
+  host_key(ai, key);
+  HostSlot* slot = find_host_slot(key);
+
+  if (slot != NULL)
+  {
+    slot->host.success();
 
-  if (i != _hosts.end())
+    if (slot->host.get_state(current_time) == Host::State::WHITE)
+    {
+      tombstone_host_slot(*slot);
+    }
+  }
+  else
   {
-    i->second.success();
+    // LCOV_EXCL_START - only hit if a very large number of hosts are
+    // blacklisted or graylisted at once.
+    std::map<AddrInfo, Host*>::const_iterator i = _host_overflow.find(ai);
+    if (i != _host_overflow.end())
+    {
+      i->second->success();
+      sweep_host_overflow(current_time);
+    }
+    // LCOV_EXCL_STOP
   }
 
   pthread_mutex_unlock(&_hosts_lock);
 }
 
-void BaseResolver::select_for_probing(const AddrInfo& ai)
+bool BaseResolver::select_for_probing(const AddrInfo& ai)
 {
-  Hosts::iterator i = _hosts.find(ai);
+  bool selected = false;
+
+  if (lookup_host_state(ai, time(NULL)) != Host::State::GRAY_NOT_PROBING)
+  {
+    // The Host can't be probed, so don't take the lock.
+    return false;
+  }
 
-  if (i != _hosts.end())
+  pthread_mutex_lock(&_hosts_lock);
+  Host* host = find_host(ai);
+
+  if (host != NULL)
+  {
+    selected = host->selected_for_probing(pthread_self());
+  }
+
+  pthread_mutex_unlock(&_hosts_lock);
+
+  if (selected)
   {
     std::string ai_str = ai.to_string();
     TRC_DEBUG("%s selected for probing", ai_str.c_str());
-    i->second.selected_for_probing(pthread_self());
   }
+
+  return selected;
 }
 
 // If no targets were resolved in either a_resolve_iter or srv_resolve_iter and
@@ -736,6 +1092,113 @@ std::shared_ptr<BaseResolver::SRVPriorityList> BaseResolver::get_srv_list(const
   return _srv_cache->get(srv_name, ttl, trail);
 }
 
+std::shared_ptr<const BaseResolver::SRVSelectionPlan>
+  BaseResolver::get_selection_plan(SRVPriorityList& srv_list,
+                                   SRVPriorityList::const_iterator level,
+                                   int af,
+                                   SAS::TrailId trail)
+{
+  std::shared_ptr<const SRVSelectionPlan> plan = srv_list.get_plan(level->first, af);
+
+  if (plan == nullptr)
+  {
+    // There's no current plan for this priority level, so build one.  If
+    // several iterators get here at once they will each build a plan, but
+    // the plans are equivalent so it doesn't matter which one is kept.
+    TRC_DEBUG("Build selection plan for %ld SRVs with priority %d",
+              level->second.size(), level->first);
+    SRVSelectionPlan* new_plan = new SRVSelectionPlan(level->second);
+
+    // Do A/AAAA record look-ups for the SRV targets.
+    std::vector<std::string> a_targets;
+    std::vector<DnsResult> a_results;
+    a_targets.reserve(level->second.size());
+    a_results.reserve(level->second.size());
+
+    for (size_t ii = 0; ii < level->second.size(); ++ii)
+    {
+      a_targets.push_back(level->second[ii].target);
+    }
+
+    TRC_VERBOSE("Do A record look-ups for %ld SRVs", a_targets.size());
+    dns_query(a_targets, (af == AF_INET) ? ns_t_a : ns_t_aaaa, a_results, trail);
+
+    time_t now = time(NULL);
+    int min_ttl = DEFAULT_TTL;
+    int min_records_ttl = 0;
+
+    for (size_t ii = 0; ii < a_results.size(); ++ii)
+    {
+      DnsResult& a_result = a_results[ii];
+      std::vector<IP46Address>& addresses = new_plan->addresses[ii];
+      addresses.reserve(a_result.records().size());
+
+      for (size_t jj = 0; jj < a_result.records().size(); ++jj)
+      {
+        addresses.push_back(to_ip46(a_result.records()[jj]));
+      }
+
+      if (!a_result.records().empty())
+      {
+        min_records_ttl = (new_plan->records_expiry == 0) ?
+                            a_result.ttl() :
+                            std::min(min_records_ttl, a_result.ttl());
+        new_plan->records_expiry = now + min_records_ttl;
+      }
+
+      min_ttl = std::min(min_ttl, a_result.ttl());
+    }
+
+    // The plan must be rebuilt when any of the A/AAAA records it was built
+    // from (or any negative results) expire.
+    new_plan->expires = now + min_ttl;
+
+    plan.reset(new_plan);
+    srv_list.set_plan(level->first, af, plan);
+  }
+
+  return plan;
+}
+
+BaseResolver::SRVPriorityList::SRVPriorityList() :
+  std::map<int, std::vector<SRV> >(),
+  _plans()
+{
+  pthread_mutex_init(&_plans_lock, NULL);
+}
+
+BaseResolver::SRVPriorityList::~SRVPriorityList()
+{
+  pthread_mutex_destroy(&_plans_lock);
+}
+
+std::shared_ptr<const BaseResolver::SRVSelectionPlan>
+  BaseResolver::SRVPriorityList::get_plan(int priority, int af)
+{
+  std::shared_ptr<const SRVSelectionPlan> plan;
+
+  pthread_mutex_lock(&_plans_lock);
+  std::map<std::pair<int, int>, std::shared_ptr<const SRVSelectionPlan> >::const_iterator i =
+                                                      _plans.find(std::make_pair(priority, af));
+  if ((i != _plans.end()) &&
+      (i->second->expires > time(NULL)))
+  {
+    plan = i->second;
+  }
+  pthread_mutex_unlock(&_plans_lock);
+
+  return plan;
+}
+
+void BaseResolver::SRVPriorityList::set_plan(int priority,
+                                             int af,
+                                             std::shared_ptr<const SRVSelectionPlan> plan)
+{
+  pthread_mutex_lock(&_plans_lock);
+  _plans[std::make_pair(priority, af)] = plan;
+  pthread_mutex_unlock(&_plans_lock);
+}
+
 bool BaseAddrIterator::next(AddrInfo &target)
 {
   bool value_set;
@@ -801,7 +1264,9 @@ LazyAResolveIter::LazyAResolveIter(DnsResult& dns_result,
   }
 
   // Shuffle the results for load balancing purposes
-  std::random_shuffle(_unused_results.begin(), _unused_results.end());
+  std::random_shuffle(_unused_results.begin(),
+                      _unused_results.end(),
+                      Utils::FastRandom::uniform);
 }
 
 std::vector<AddrInfo> LazyAResolveIter::take(int num_requested_targets)
@@ -819,10 +1284,6 @@ std::vector<AddrInfo> LazyAResolveIter::take(int num_requested_targets)
   std::vector<AddrInfo> targets;
   std::string targets_log_str;
 
-  // This lock must be held to safely call the host_state method of
-  // BaseResolver.
-  pthread_mutex_lock(&(_resolver->_hosts_lock));
-
   // If there are any graylisted records, and we're set to return whitelisted
   // records, the Iterator should return one first, and then no more.
   if (_first_call && whitelisted_allowed)
@@ -834,10 +1295,10 @@ std::vector<AddrInfo> LazyAResolveIter::take(int num_requested_targets)
          result_it != _unused_results.rend();
          ++result_it)
     {
-      if (_resolver->host_state(*result_it) == BaseResolver::Host::State::GRAY_NOT_PROBING)
+      if ((_resolver->host_state(*result_it) == BaseResolver::Host::State::GRAY_NOT_PROBING) &&
+          (_resolver->select_for_probing(*result_it)))
       {
         // Add the record to the targets list.
-        _resolver->select_for_probing(*result_it);
         targets.push_back(*result_it);
 
         // Update logging.
@@ -915,8 +1376,6 @@ std::vector<AddrInfo> LazyAResolveIter::take(int num_requested_targets)
     }
   }
 
-  pthread_mutex_unlock(&(_resolver->_hosts_lock));
-
   // If the targets vector does not yet contain enough targets, add unhealthy
   // targets. If only whitelisted or only blacklisted targets were requested,
   // the unhealthy results vector is empty.
@@ -1135,15 +1594,26 @@ bool LazySRVResolveIter::prepare_priority_level()
     // to start searching the priority level from the first SRV.
     _current_srv = 0;
 
-    std::vector<const BaseResolver::SRV*> srvs;
-    srvs.reserve(_next_priority_level->second.size());
+    // Get the selection plan for this priority level.  This holds a selector
+    // for the SRVs and the addresses each SRV resolves to, so we don't need
+    // to rebuild it or repeat the A/AAAA record look-ups.
+    std::shared_ptr<const BaseResolver::SRVSelectionPlan> plan =
+      _resolver->get_selection_plan(*_srv_list, _next_priority_level, _af, _trail);
+
+    // Take the smallest ttl returned so far.
+    if (plan->records_expiry != 0)
+    {
+      _ttl = std::min(_ttl, (int)(plan->records_expiry - time(NULL)));
+    }
 
-    // Build a cumulative weighted tree for this priority level. This will use
+    // Copy the cumulative weighted tree for this priority level. This will use
     // the weights of the SRVs in this priority level to put them in a random
     // permutation, where an SRV is more likely to be close to the front if it
     // has a higher weight. This is used for load balancing purposes, as a
     // request will be sent to the first SRV if possible.
-    WeightedSelector<BaseResolver::SRV> selector(_next_priority_level->second);
+    WeightedSelector<BaseResolver::SRV> selector(plan->selector);
+    std::vector<int> srv_indexes;
+    srv_indexes.reserve(_next_priority_level->second.size());
 
     // Select entries while there are any with non-zero weights.
     while (selector.total_weight() > 0)
@@ -1153,55 +1623,35 @@ bool LazySRVResolveIter::prepare_priority_level()
                 _next_priority_level->second[ii].target.c_str(),
                 _next_priority_level->second[ii].port,
                 _next_priority_level->second[ii].weight);
-      srvs.push_back(&_next_priority_level->second[ii]);
-    }
-
-    // Do A/AAAA record look-ups for the selected SRV targets.
-    std::vector<std::string> a_targets;
-    std::vector<DnsResult> a_results;
-    a_targets.reserve(srvs.size());
-    a_results.reserve(srvs.size());
-
-    for (size_t ii = 0; ii < srvs.size(); ++ii)
-    {
-      a_targets.push_back(srvs[ii]->target);
+      srv_indexes.push_back(ii);
     }
 
-    TRC_VERBOSE("Do A record look-ups for %ld SRVs", a_targets.size());
-    _resolver->dns_query(a_targets,
-                         (_af == AF_INET) ? ns_t_a : ns_t_aaaa,
-                         a_results,
-                         _trail);
-
     // Give each 2D vector an empty vector corresponding to each SRV record.
-    _whitelisted_addresses_by_srv.resize(srvs.size());
-    _unhealthy_addresses_by_srv.resize(srvs.size());
+    _whitelisted_addresses_by_srv.resize(srv_indexes.size());
+    _unhealthy_addresses_by_srv.resize(srv_indexes.size());
 
-    for (size_t ii = 0; ii < srvs.size(); ++ii)
+    for (size_t ii = 0; ii < srv_indexes.size(); ++ii)
     {
-      DnsResult& a_result = a_results[ii];
-      TRC_DEBUG("SRV %s:%d returned %ld IP addresses",
-                srvs[ii]->target.c_str(),
-                srvs[ii]->port,
-                a_result.records().size());
+      const BaseResolver::SRV& srv = _next_priority_level->second[srv_indexes[ii]];
+      const std::vector<IP46Address>& addresses = plan->addresses[srv_indexes[ii]];
+      TRC_DEBUG("SRV %s:%d resolved to %ld IP addresses",
+                srv.target.c_str(),
+                srv.port,
+                addresses.size());
       std::vector<AddrInfo> &whitelisted_addresses = _whitelisted_addresses_by_srv[ii];
       std::vector<AddrInfo> &unhealthy_addresses = _unhealthy_addresses_by_srv[ii];
 
-      // This lock must be held to safely call the host_state method of
-      // BaseResolver.
-      pthread_mutex_lock(&(_resolver->_hosts_lock));
-
       // Creates a template address info object. Each iteration of the for loop
       // adds a copy with the correct address to a *_addresses vector.
       AddrInfo ai;
       ai.transport = _transport;
-      ai.port = srvs[ii]->port;
-      ai.weight = srvs[ii]->weight;
-      ai.priority = srvs[ii]->priority;
+      ai.port = srv.port;
+      ai.weight = srv.weight;
+      ai.priority = srv.priority;
 
-      for (size_t jj = 0; jj < a_result.records().size(); ++jj)
+      for (size_t jj = 0; jj < addresses.size(); ++jj)
       {
-        ai.address = _resolver->to_ip46(a_result.records()[jj]);
+        ai.address = addresses[jj];
 
         BaseResolver::Host::State addr_state = _resolver->host_state(ai);
         std::string target = "[" + ai.address_and_port_to_string() + "] ";
@@ -1256,16 +1706,15 @@ bool LazySRVResolveIter::prepare_priority_level()
             unhealthy_addresses.push_back(ai);
           }
         }
-
-        // Take the smallest ttl returned so far.
-        _ttl = std::min(_ttl, a_result.ttl());
       }
 
-      pthread_mutex_unlock(&(_resolver->_hosts_lock));
-
       // Randomize the order of both vectors.
-      std::random_shuffle(whitelisted_addresses.begin(), whitelisted_addresses.end());
-      std::random_shuffle(unhealthy_addresses.begin(), unhealthy_addresses.end());
+      std::random_shuffle(whitelisted_addresses.begin(),
+                          whitelisted_addresses.end(),
+                          Utils::FastRandom::uniform);
+      std::random_shuffle(unhealthy_addresses.begin(),
+                          unhealthy_addresses.end(),
+                          Utils::FastRandom::uniform);
     }
 
     // The next time prepare_priority_level is called it will prepare the next
@@ -1293,25 +1742,31 @@ int LazySRVResolveIter::get_from_priority_level(std::vector<AddrInfo> &targets,
 
   if (_gray_found && (num_targets_to_find > 0))
   {
-    // prepare_priority_level found a graylisted target to probe, so return it.
-    // It is guaranteed that this target will be the first ever returned by the
-    // iterator, since prepare_priority_level will only search for a graylisted
-    // target to probe at the highest priority level, or if no targets at higher
-    // priority levels were returned.
-    targets.push_back(_unprobed_gray_target);
-    BaseResolver::add_target_to_log_string(targets_log_str,
-                                           _unprobed_gray_target,
-                                           "graylisted");
-
-    // This lock must be held to safely call the select_for_probing method of
-    // BaseResolver.
-    pthread_mutex_lock(&(_resolver->_hosts_lock));
-    _resolver->select_for_probing(_unprobed_gray_target);
-    pthread_mutex_unlock(&(_resolver->_hosts_lock));
-
     _gray_found = false;
-    --num_targets_to_find;
-    TRC_DEBUG("Added a graylisted server for probing to targets, now have 1 of %d", num_requested_targets);
+
+    // prepare_priority_level found a graylisted target to probe, so return it
+    // if this request is selected to probe it.  It is guaranteed that this
+    // target will be the first ever returned by the iterator, since
+    // prepare_priority_level will only search for a graylisted target to probe
+    // at the highest priority level, or if no targets at higher priority levels
+    // were returned.
+    if (_resolver->select_for_probing(_unprobed_gray_target))
+    {
+      targets.push_back(_unprobed_gray_target);
+      BaseResolver::add_target_to_log_string(targets_log_str,
+                                             _unprobed_gray_target,
+                                             "graylisted");
+
+      --num_targets_to_find;
+      TRC_DEBUG("Added a graylisted server for probing to targets, now have 1 of %d", num_requested_targets);
+    }
+    else if (_blacklisted_allowed)
+    {
+      // Another request has been selected to probe the target since
+      // prepare_priority_level found it, so treat it like any other target
+      // that is being probed.
+      _unhealthy_targets.push_back(_unprobed_gray_target);
+    }
   }
 
   // Select the appropriate number of targets by looping through the SRV records
@@ -1331,10 +1786,6 @@ int LazySRVResolveIter::get_from_priority_level(std::vector<AddrInfo> &targets,
   // next time this function is called.
   while ((num_targets_to_find > 0) && (!priority_level_complete()))
   {
-    // This lock must be held to safely call the host_state method of
-    // BaseResolver.
-    pthread_mutex_lock(&(_resolver->_hosts_lock));
-
     // If we're at the end of the SRV Records, start from the beginning. This
     // lets get_from_priority_level pause the for loop if it finds enough
     // targets before reaching the end of the SRV Records and resume when it is
@@ -1414,10 +1865,6 @@ int LazySRVResolveIter::get_from_priority_level(std::vector<AddrInfo> &targets,
         _unhealthy_targets.push_back(ai);
       }
     }
-
-    // host_state no longer needs to be called, so this lock can be
-    // released.
-    pthread_mutex_unlock(&(_resolver->_hosts_lock));
   }
 
   if (targets.size() > 0)
@@ -11,8 +11,11 @@
  */
 
 #include <boost/format.hpp>
+#include <stdlib.h>
 #include <time.h>
 
+#include <algorithm>
+
 #include "cassandra_store.h"
 #include "sasevent.h"
 #include "sas.h"
@@ -39,13 +42,340 @@ public:
   }
 };
 
+//
+// ScanOperation methods
+//
+
+ScanOperation::ScanOperation(const std::string& column_family,
+                             const SlicePredicate& predicate,
+                             int32_t page_size,
+                             ConsistencyLevel::type consistency_level) :
+  _cursor(column_family, predicate, page_size, consistency_level),
+  _rows_scanned(0)
+{
+}
+
+bool ScanOperation::perform(Client* client, SAS::TrailId trail)
+{
+  std::vector<KeySlice> rows;
+
+  while (!_cursor.finished())
+  {
+    _cursor.next_page(client, rows);
+    _rows_scanned += rows.size();
+
+    if (!process_rows(rows, trail))
+    {
+      TRC_DEBUG("Scan stopped after %lu rows", _rows_scanned);
+      break;
+    }
+  }
+
+  return true;
+}
+
 //
 // HAOperation methods
 //
 
 HAOperation::HAOperation() :
-  _consistency_two_tried(false)
+  _consistency_two_tried(false),
+  _store(NULL),
+  _target()
+{
+}
+
+void HAOperation::set_target(Store* store, const AddrInfo& target)
+{
+  _store = store;
+  _target = target;
+}
+
+bool HAOperation::speculate()
+{
+  return ((_store != NULL) && (_store->_speculation_running.load()));
+}
+
+// Whether an exception thrown by a consistency level TWO request means that
+// it should be retried at level ONE.
+static bool is_consistency_failure(std::exception_ptr exception)
 {
+  try
+  {
+    std::rethrow_exception(exception);
+  }
+  catch(UnavailableException& ue)
+  {
+    return true;
+  }
+  catch(TimedOutException& te)
+  {
+    return true;
+  }
+  catch(...)
+  {
+    return false;
+  }
+}
+
+// The state of a speculative HA get, shared between the operation and the two
+// requests (TWO and ONE) it makes.  The requests may outlive the operation.
+template <class T>
+struct SpeculativeGetState
+{
+  SpeculativeGetState() :
+    lock(PTHREAD_MUTEX_INITIALIZER),
+    cond(&lock),
+    complete(false),
+    winner(-1)
+  {
+    ran[0] = ran[1] = false;
+    finished[0] = finished[1] = false;
+  }
+
+  ~SpeculativeGetState()
+  {
+    pthread_mutex_destroy(&lock);
+  }
+
+  pthread_mutex_t lock;
+  CondVar cond;
+
+  // Whether one of the requests has given an adequate answer, and if so which
+  // (0 for TWO, 1 for ONE).
+  bool complete;
+  int winner;
+
+  // The outcome of each request.  A request has finished without running if
+  // it was discarded when the store stopped, or if it wasn't needed.
+  bool ran[2];
+  bool finished[2];
+  std::exception_ptr exception[2];
+  T result[2];
+};
+
+// One of the two requests for a speculative HA get, as queued on the
+// speculation pool.  The work item holds the only reference, so if it is
+// purged from the queue when the store is stopped, the request is marked as
+// finished (without having run) when it is destroyed.
+template <class T>
+struct SpeculativeGetLeg
+{
+  SpeculativeGetLeg(std::shared_ptr<SpeculativeGetState<T> > state, int index) :
+    state(state),
+    index(index)
+  {
+  }
+
+  ~SpeculativeGetLeg()
+  {
+    pthread_mutex_lock(&state->lock);
+
+    if (!state->finished[index])
+    {
+      state->finished[index] = true;
+      state->cond.broadcast();
+    }
+
+    pthread_mutex_unlock(&state->lock);
+  }
+
+  std::shared_ptr<SpeculativeGetState<T> > state;
+  int index;
+};
+
+// Make one of the two requests for a speculative HA get.  Gives up if the get
+// is already complete (e.g. the TWO request answered while the ONE request was
+// waiting for a thread).
+template <class T>
+static void speculative_get_request(std::shared_ptr<SpeculativeGetState<T> > state,
+                                    int index,
+                                    std::function<void(T&, ConsistencyLevel::type)> request)
+{
+  pthread_mutex_lock(&state->lock);
+
+  if (state->complete)
+  {
+    state->finished[index] = true;
+    state->cond.broadcast();
+    pthread_mutex_unlock(&state->lock);
+    return;
+  }
+
+  state->ran[index] = true;
+  pthread_mutex_unlock(&state->lock);
+
+  ConsistencyLevel::type consistency_level =
+                       (index == 0) ? ConsistencyLevel::TWO : ConsistencyLevel::ONE;
+  T result;
+  std::exception_ptr exception;
+
+  try
+  {
+    request(result, consistency_level);
+  }
+  catch(...)
+  {
+    exception = std::current_exception();
+  }
+
+  pthread_mutex_lock(&state->lock);
+
+  state->finished[index] = true;
+  state->exception[index] = exception;
+  std::swap(state->result[index], result);
+
+  // A successful answer is always adequate.  So is a failure from the TWO
+  // request that a ONE request wouldn't fix (e.g. the row doesn't exist).
+  bool adequate = ((!exception) ||
+                   ((index == 0) && (!is_consistency_failure(exception))));
+
+  if ((!state->complete) && (adequate))
+  {
+    state->complete = true;
+    state->winner = index;
+  }
+
+  state->cond.broadcast();
+  pthread_mutex_unlock(&state->lock);
+}
+
+template <class T>
+bool HAOperation::speculative_get(std::function<void(Client*, T&, ConsistencyLevel::type)> fn,
+                                  T& result,
+                                  SAS::TrailId trail)
+{
+  // The requests hold their own references to the state as they may still be
+  // running (or queued) after this get has returned.
+  std::shared_ptr<SpeculativeGetState<T> > state =
+                                    std::make_shared<SpeculativeGetState<T> >();
+
+  // Each request uses its own connection to the node.
+  Store* store = _store;
+  AddrInfo target = _target;
+  std::function<void(T&, ConsistencyLevel::type)> request =
+    [store, target, fn](T& out, ConsistencyLevel::type consistency_level)
+    {
+      store->run_on_connection(target, [&](Client* client) {
+        fn(client, out, consistency_level);
+      });
+    };
+
+  // Queue a request, returning whether the store is still running.  stop()
+  // clears _speculation_running before purging the pool's queue, so if it is
+  // still set the request will either run or be discarded (and marked as
+  // finished).  Otherwise the request may sit on the stopped pool's queue
+  // forever, so mustn't be waited for.
+  auto queue_request = [store, state, request](int index) -> bool
+  {
+    std::shared_ptr<SpeculativeGetLeg<T> > leg =
+                           std::make_shared<SpeculativeGetLeg<T> >(state, index);
+    store->_speculation_pool->add_work([leg, request]() {
+      speculative_get_request<T>(leg->state, leg->index, request);
+    });
+
+    return store->_speculation_running.load();
+  };
+
+  bool running = queue_request(0);
+
+  pthread_mutex_lock(&state->lock);
+
+  if (running)
+  {
+    // Wait for the hedge delay, or until the TWO request finishes.  The ONE
+    // request is only queued after this, so it doesn't hold a thread while
+    // it waits.
+    unsigned int delay_ms = _store->_speculation_delay_ms;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += delay_ms / 1000;
+    deadline.tv_nsec += (delay_ms % 1000) * 1000000;
+
+    if (deadline.tv_nsec >= 1000000000)
+    {
+      deadline.tv_sec += 1;
+      deadline.tv_nsec -= 1000000000;
+    }
+
+    while ((!state->finished[0]) &&
+           (state->cond.timedwait(&deadline) != ETIMEDOUT))
+    {
+    }
+  }
+
+  bool hedge = (!state->complete);
+  pthread_mutex_unlock(&state->lock);
+
+  if ((hedge) && (running))
+  {
+    running = queue_request(1);
+  }
+
+  pthread_mutex_lock(&state->lock);
+
+  if ((hedge) && (running))
+  {
+    while ((!state->complete) &&
+           (!(state->finished[0] && state->finished[1])))
+    {
+      state->cond.wait();
+    }
+  }
+
+  bool complete = state->complete;
+  int winner = state->winner;
+
+  if (complete)
+  {
+    std::swap(result, state->result[winner]);
+  }
+
+  // If neither request gave an adequate answer, report the result of the ONE
+  // request, as the non-speculative path would.  If that didn't run, the get
+  // hasn't been answered.
+  bool answered = ((complete) || ((state->ran[1]) && (state->finished[1])));
+  bool two_tried = ((answered) || (state->ran[0]));
+  std::exception_ptr exception = state->exception[(complete) ? winner : 1];
+
+  pthread_mutex_unlock(&state->lock);
+
+  _consistency_two_tried = two_tried;
+
+  if ((two_tried) && ((!complete) || (winner == 1)))
+  {
+    // The TWO request didn't give an adequate answer (in time).
+    SAS::Event event(trail, SASEvent::CASS_REQUEST_TWO_FAIL, 2);
+    SAS::report_event(event);
+  }
+
+  if (!answered)
+  {
+    TRC_DEBUG("Store stopped during speculative HA get");
+    return false;
+  }
+
+  if (complete)
+  {
+    TRC_DEBUG("Speculative HA get answered at consistency level %s",
+              (winner == 0) ? "TWO" : "ONE");
+    SNMP::CounterTable* wins_table =
+             (winner == 0) ? _store->_two_wins_table : _store->_one_wins_table;
+
+    if (wins_table != NULL)
+    {
+      wins_table->increment();
+    }
+  }
+
+  if (exception)
+  {
+    // Either the winning answer was a failure, or neither request gave an
+    // adequate answer.
+    std::rethrow_exception(exception);
+  }
+
+  return true;
 }
 
 // Macro to turn an underlying (non-HA) get method into an HA one.
@@ -53,7 +383,9 @@ HAOperation::HAOperation() :
 // This macro takes the following arguments:
 // -  A pointer to the Cassandra Client to use to make the get request.
 // -  The name of the underlying get method to call.
-// -  The arguments for the underlying get method.
+// -  The SAS trail ID.
+// -  The output parameter of the underlying get method.
+// -  The other arguments for the underlying get method.
 //
 // It works as follows:
 // -  If this Operation has not yet been called, it calls the method with a
@@ -69,19 +401,36 @@ HAOperation::HAOperation() :
 //    ONE read.  In this case at most one of the replicas for the data is still
 //    up, so we can't do any better.
 //
+// -  If the store is configured for speculative reads, the first call instead
+//    makes the TWO request and (after the hedge delay, or as soon as the TWO
+//    request fails) the ONE request in parallel on separate connections, and
+//    uses the first adequate answer.  This means a degraded cluster costs the
+//    hedge delay rather than a full timeout.  If the store stops before the
+//    speculative requests answer, the remaining requests are made as normal.
+//
 // The Operation will have already been run if we have made a TWO request to a
 // different Cassandra process already. In that case, we want to skip straight
 // to the consistency level ONE attempt, as we've already spent a chunk of our
 // latency budget on the previous attempt, and we want to make sure we can
 // return a result in a timely fashion.
-#define HA(CLIENT, METHOD, TRAIL_ID, ...)                                      \
+#define HA(CLIENT, METHOD, TRAIL_ID, RESULT, ...)                              \
+        typedef std::remove_reference<decltype(RESULT)>::type ResultType;      \
         bool success = false;                                                  \
+        if ((!_consistency_two_tried) && (speculate()))                        \
+        {                                                                      \
+          success = speculative_get<ResultType>(                               \
+            [=](Client* c, ResultType& out, ConsistencyLevel::type cl) {       \
+              c->METHOD(__VA_ARGS__, out, cl);                                 \
+            },                                                                 \
+            RESULT,                                                            \
+            TRAIL_ID);                                                         \
+        }                                                                      \
         if (!_consistency_two_tried)                                           \
         {                                                                      \
           _consistency_two_tried = true;                                       \
           try                                                                  \
           {                                                                    \
-            CLIENT->METHOD(__VA_ARGS__, ConsistencyLevel::TWO);                \
+            CLIENT->METHOD(__VA_ARGS__, RESULT, ConsistencyLevel::TWO);        \
             success = true;                                                    \
           }                                                                    \
           catch(UnavailableException& ue)                                      \
@@ -101,7 +450,7 @@ HAOperation::HAOperation() :
         }                                                                      \
         if (!success)                                                          \
         {                                                                      \
-          CLIENT->METHOD(__VA_ARGS__, ConsistencyLevel::ONE);                  \
+          CLIENT->METHOD(__VA_ARGS__, RESULT, ConsistencyLevel::ONE);          \
         }
 
 void HAOperation::
@@ -112,7 +461,7 @@ ha_get_columns(Client* client,
                std::vector<cass::ColumnOrSuperColumn>& columns,
                SAS::TrailId trail)
 {
-  HA(client, get_columns, trail, column_family, key, names, columns);
+  HA(client, get_columns, trail, columns, column_family, key, names);
 }
 
 void HAOperation::
@@ -123,7 +472,7 @@ ha_get_columns_with_prefix(Client* client,
                            std::vector<ColumnOrSuperColumn>& columns,
                            SAS::TrailId trail)
 {
-  HA(client, get_columns_with_prefix, trail, column_family, key, prefix, columns);
+  HA(client, get_columns_with_prefix, trail, columns, column_family, key, prefix);
 }
 
 
@@ -135,7 +484,7 @@ ha_multiget_columns_with_prefix(Client* client,
                                 std::map<std::string, std::vector<ColumnOrSuperColumn> >& columns,
                                 SAS::TrailId trail)
 {
-  HA(client, multiget_columns_with_prefix, trail, column_family, keys, prefix, columns);
+  HA(client, multiget_columns_with_prefix, trail, columns, column_family, keys, prefix);
 }
 
 void HAOperation::
@@ -145,7 +494,7 @@ ha_get_all_columns(Client* client,
                    std::vector<ColumnOrSuperColumn>& columns,
                    SAS::TrailId trail)
 {
-  HA(client, get_row, trail, column_family, key, columns);
+  HA(client, get_row, trail, columns, column_family, key);
 }
 
 
@@ -207,23 +556,389 @@ void RealThriftClient::multiget_slice(std::map<std::string, std::vector<cass::Co
   _cass_client.multiget_slice(_return, keys, column_parent, predicate, consistency_level);
 }
 
-void RealThriftClient::remove(const std::string& key,
-                              const cass::ColumnPath& column_path,
-                              const int64_t timestamp,
-                              const cass::ConsistencyLevel::type consistency_level)
-{
-  _cass_client.remove(key, column_path, timestamp, consistency_level);
-}
+void RealThriftClient::remove(const std::string& key,
+                              const cass::ColumnPath& column_path,
+                              const int64_t timestamp,
+                              const cass::ConsistencyLevel::type consistency_level)
+{
+  _cass_client.remove(key, column_path, timestamp, consistency_level);
+}
+
+void RealThriftClient::get_range_slices(std::vector<KeySlice> & _return,
+                                        const ColumnParent& column_parent,
+                                        const SlicePredicate& predicate,
+                                        const KeyRange& range,
+                                        const ConsistencyLevel::type consistency_level)
+{
+  _cass_client.get_range_slices(_return, column_parent, predicate, range, consistency_level);
+}
+
+void RealThriftClient::describe_ring(std::vector<TokenRange>& _return,
+                                     const std::string& keyspace)
+{
+  _cass_client.describe_ring(_return, keyspace);
+}
+
+void RealThriftClient::describe_partitioner(std::string& _return)
+{
+  _cass_client.describe_partitioner(_return);
+}
+// LCOV_EXCL_STOP
+
+
+//
+// RowCursor methods
+//
+
+RowCursor::RowCursor(const std::string& column_family,
+                     const SlicePredicate& predicate,
+                     int32_t page_size,
+                     ConsistencyLevel::type consistency_level) :
+  _column_family(column_family),
+  _predicate(predicate),
+  _page_size(std::max(page_size, 1)),
+  _consistency_level(consistency_level),
+  _last_key(),
+  _started(false),
+  _finished(false)
+{
+}
+
+void RowCursor::next_page(Client* client, std::vector<KeySlice>& rows)
+{
+  rows.clear();
+
+  if (_finished)
+  {
+    return;
+  }
+
+  ColumnParent cparent;
+  cparent.column_family = _column_family;
+
+  // After the first page, the first row returned is the last one we've
+  // already seen, so fetch one extra.
+  int32_t count = _started ? _page_size + 1 : _page_size;
+  KeyRange range;
+  range.__set_start_key(_last_key);
+  range.__set_end_key("");
+  range.__set_count(count);
+
+  client->get_range_slices(rows, cparent, _predicate, range, _consistency_level);
+
+  if ((int32_t)rows.size() < count)
+  {
+    _finished = true;
+  }
+
+  if (!rows.empty())
+  {
+    bool skip_first = (_started && (rows.front().key == _last_key));
+    _last_key = rows.back().key;
+
+    rows.erase(std::remove_if(rows.begin() + (skip_first ? 1 : 0),
+                              rows.end(),
+                              [](const KeySlice& row)
+                              { return row.columns.empty(); }),
+               rows.end());
+
+    if (skip_first)
+    {
+      rows.erase(rows.begin());
+    }
+  }
+
+  _started = true;
+  TRC_DEBUG("Fetched %d rows from %s", rows.size(), _column_family.c_str());
+}
+
+
+//
+// ColumnCursor methods
+//
+
+ColumnCursor::ColumnCursor(const std::string& column_family,
+                           const std::string& key,
+                           int32_t page_size,
+                           const std::string& start,
+                           const std::string& finish,
+                           ConsistencyLevel::type consistency_level) :
+  _column_family(column_family),
+  _key(key),
+  _page_size(std::max(page_size, 1)),
+  _finish(finish),
+  _consistency_level(consistency_level),
+  _start(start),
+  _started(false),
+  _finished(false)
+{
+}
+
+void ColumnCursor::next_page(Client* client,
+                             std::vector<ColumnOrSuperColumn>& columns)
+{
+  columns.clear();
+
+  if (_finished)
+  {
+    return;
+  }
+
+  ColumnParent cparent;
+  cparent.column_family = _column_family;
+
+  // After the first page, the first column returned is the last one we've
+  // already seen, so fetch one extra.
+  int32_t count = _started ? _page_size + 1 : _page_size;
+  SliceRange sr;
+  sr.start = _start;
+  sr.finish = _finish;
+  sr.count = count;
+
+  SlicePredicate sp;
+  sp.slice_range = sr;
+  sp.__isset.slice_range = true;
+
+  client->get_slice(columns, _key, cparent, sp, _consistency_level);
+
+  if ((int32_t)columns.size() < count)
+  {
+    _finished = true;
+  }
+
+  if (!columns.empty())
+  {
+    bool skip_first = (_started && (columns.front().column.name == _start));
+    _start = columns.back().column.name;
+
+    if (skip_first)
+    {
+      columns.erase(columns.begin());
+    }
+  }
+
+  _started = true;
+}
+
+
+//
+// TokenRing methods
+//
+
+TokenRing::TokenRing(const std::string& partitioner,
+                     const std::vector<TokenRange>& ranges,
+                     int port) :
+  _ranges()
+{
+  if (partitioner != "org.apache.cassandra.dht.Murmur3Partitioner")
+  {
+    TRC_WARNING("Token-aware routing not supported with partitioner %s",
+                partitioner.c_str());
+    return;
+  }
+
+  for (const TokenRange& range : ranges)
+  {
+    // Prefer the addresses the nodes serve thrift on, if they're set.
+    const std::vector<std::string>& endpoints =
+      (range.rpc_endpoints.size() == range.endpoints.size()) ?
+                                      range.rpc_endpoints : range.endpoints;
+    std::vector<AddrInfo> replicas;
+
+    for (unsigned int ii = 0; ii < endpoints.size(); ++ii)
+    {
+      AddrInfo replica;
+      std::string endpoint = endpoints[ii];
+
+      if ((endpoint == "0.0.0.0") && (ii < range.endpoints.size()))
+      {
+        // The node serves thrift on all addresses.
+        endpoint = range.endpoints[ii];
+      }
+
+      if (Utils::parse_ip_target(endpoint, replica.address))
+      {
+        replica.port = port;
+        replica.transport = IPPROTO_TCP;
+        replicas.push_back(replica);
+      }
+      else
+      {
+        TRC_WARNING("Ignoring unparseable Cassandra endpoint %s",
+                    endpoint.c_str());
+      }
+    }
+
+    _ranges.push_back(std::make_pair(strtoll(range.end_token.c_str(), NULL, 10),
+                                     replicas));
+  }
+
+  std::sort(_ranges.begin(),
+            _ranges.end(),
+            [](const std::pair<int64_t, std::vector<AddrInfo> >& lhs,
+               const std::pair<int64_t, std::vector<AddrInfo> >& rhs)
+            { return lhs.first < rhs.first; });
+
+  TRC_DEBUG("Learnt token ring with %d ranges", _ranges.size());
+}
+
+void TokenRing::get_replicas(const std::string& key,
+                             std::vector<AddrInfo>& replicas) const
+{
+  if (_ranges.empty())
+  {
+    return;
+  }
+
+  int64_t token = murmur3_token(key);
+
+  // Find the first range that ends at or after the token.  If there isn't one
+  // the token is in the range that wraps round the end of the ring.
+  std::vector<std::pair<int64_t, std::vector<AddrInfo> > >::const_iterator it =
+    std::lower_bound(_ranges.begin(),
+                     _ranges.end(),
+                     token,
+                     [](const std::pair<int64_t, std::vector<AddrInfo> >& range,
+                        int64_t token)
+                     { return range.first < token; });
+
+  if (it == _ranges.end())
+  {
+    it = _ranges.begin();
+  }
+
+  replicas = it->second;
+}
+
+static inline uint64_t rotl64(uint64_t v, int n)
+{
+  return (v << n) | (v >> (64 - n));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+int64_t TokenRing::murmur3_token(const std::string& key)
+{
+  const uint8_t* data = (const uint8_t*)key.data();
+  const size_t length = key.length();
+  const size_t num_blocks = length / 16;
+  const uint64_t c1 = 0x87c37b91114253d5ULL;
+  const uint64_t c2 = 0x4cf5ad432745937fULL;
+  uint64_t h1 = 0;
+  uint64_t h2 = 0;
+
+  for (size_t ii = 0; ii < num_blocks; ++ii)
+  {
+    uint64_t k1 = 0;
+    uint64_t k2 = 0;
+
+    for (int jj = 7; jj >= 0; --jj)
+    {
+      k1 = (k1 << 8) | data[ii * 16 + jj];
+      k2 = (k2 << 8) | data[ii * 16 + 8 + jj];
+    }
+
+    k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+    k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+  }
+
+  // Cassandra sign-extends each trailing byte, so we must too.
+  const int8_t* tail = (const int8_t*)(data + num_blocks * 16);
+  size_t tail_length = length & 15;
+  uint64_t k1 = 0;
+  uint64_t k2 = 0;
+
+  for (size_t ii = tail_length; ii > 8; --ii)
+  {
+    k2 ^= (uint64_t)(int64_t)tail[ii - 1] << ((ii - 9) * 8);
+  }
+
+  if (tail_length > 8)
+  {
+    k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+  }
+
+  for (size_t ii = std::min(tail_length, (size_t)8); ii > 0; --ii)
+  {
+    k1 ^= (uint64_t)(int64_t)tail[ii - 1] << ((ii - 1) * 8);
+  }
+
+  if (tail_length > 0)
+  {
+    k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+  }
+
+  h1 ^= length;
+  h2 ^= length;
+  h1 += h2;
+  h2 += h1;
+  h1 = fmix64(h1);
+  h2 = fmix64(h2);
+  h1 += h2;
+
+  // The partitioner reserves the minimum token.
+  int64_t token = (int64_t)h1;
+  return (token == INT64_MIN) ? INT64_MAX : token;
+}
+
+// AddrInfo iterator that returns a node holding the row first, followed by the
+// targets from another iterator (skipping that node).  Takes ownership of the
+// other iterator.
+class TokenAwareAddrIterator : public BaseAddrIterator
+{
+public:
+  TokenAwareAddrIterator(const AddrInfo& replica, BaseAddrIterator* it) :
+    _replica(replica), _replica_taken(false), _it(it)
+  {}
+
+  virtual ~TokenAwareAddrIterator()
+  {
+    delete _it; _it = NULL;
+  }
+
+  virtual std::vector<AddrInfo> take(int num_requested_targets)
+  {
+    std::vector<AddrInfo> targets;
+
+    if ((!_replica_taken) && (num_requested_targets > 0))
+    {
+      targets.push_back(_replica);
+      _replica_taken = true;
+    }
+
+    while ((int)targets.size() < num_requested_targets)
+    {
+      std::vector<AddrInfo> next = _it->take(1);
 
-void RealThriftClient::get_range_slices(std::vector<KeySlice> & _return,
-                                        const ColumnParent& column_parent,
-                                        const SlicePredicate& predicate,
-                                        const KeyRange& range,
-                                        const ConsistencyLevel::type consistency_level)
-{
-  _cass_client.get_range_slices(_return, column_parent, predicate, range, consistency_level);
-}
-// LCOV_EXCL_STOP
+      if (next.empty())
+      {
+        break;
+      }
+
+      if (next.front() != _replica)
+      {
+        targets.push_back(next.front());
+      }
+    }
+
+    return targets;
+  }
+
+private:
+  AddrInfo _replica;
+  bool _replica_taken;
+  BaseAddrIterator* _it;
+};
 
 
 //
@@ -250,10 +965,28 @@ Store::Store(const std::string& keyspace) :
   _keyspace(keyspace),
   _cass_hostname(""),
   _cass_port(0),
+  _exception_handler(NULL),
   _num_threads(0),
+  _max_threads(0),
   _max_queue(0),
+  _target_queue_wait_ms(0),
   _thread_pool(NULL),
   _comm_monitor(NULL),
+  _stats(NULL),
+  _aggregator(NULL),
+  _speculation_delay_ms(0),
+  _speculation_threads(0),
+  _speculation_pool(NULL),
+  _speculation_running(false),
+  _two_wins_table(NULL),
+  _one_wins_table(NULL),
+  _token_aware(false),
+  _ring_refresh_ms(0),
+  _ring_lock(PTHREAD_MUTEX_INITIALIZER),
+  _ring_cond(&_ring_lock),
+  _ring(),
+  _ring_thread_running(false),
+  _ring_terminate(false),
   _conn_pool(new CassandraConnectionPool())
 {
 }
@@ -298,7 +1031,63 @@ void Store::configure_workers(ExceptionHandler* exception_handler,
   TRC_STATUS("  Max Queue: %u", max_queue);
   _exception_handler = exception_handler;
   _num_threads = num_threads;
+  _max_threads = num_threads;
+  _max_queue = max_queue;
+}
+
+
+void Store::configure_elastic_workers(ExceptionHandler* exception_handler,
+                                      unsigned int min_threads,
+                                      unsigned int max_threads,
+                                      unsigned int max_queue,
+                                      unsigned int target_queue_wait_ms)
+{
+  TRC_STATUS("Configuring elastic store worker pool");
+  TRC_STATUS("  Threads:   %u-%u", min_threads, max_threads);
+  TRC_STATUS("  Max Queue: %u", max_queue);
+  TRC_STATUS("  Max Wait:  %u ms", target_queue_wait_ms);
+  _exception_handler = exception_handler;
+  _num_threads = min_threads;
+  _max_threads = max_threads;
   _max_queue = max_queue;
+  _target_queue_wait_ms = target_queue_wait_ms;
+}
+
+
+void Store::configure_write_batching(unsigned int window_us,
+                                     unsigned int max_operations)
+{
+  TRC_STATUS("Configuring store write batching");
+  TRC_STATUS("  Window:    %u us", window_us);
+  TRC_STATUS("  Max Batch: %u", max_operations);
+  delete _aggregator;
+  _aggregator = new MutationAggregator(window_us, max_operations);
+}
+
+
+void Store::configure_speculative_reads(ExceptionHandler* exception_handler,
+                                        unsigned int hedge_delay_ms,
+                                        unsigned int num_threads,
+                                        SNMP::CounterTable* two_wins_table,
+                                        SNMP::CounterTable* one_wins_table)
+{
+  TRC_STATUS("Configuring store speculative reads");
+  TRC_STATUS("  Delay:     %u ms", hedge_delay_ms);
+  TRC_STATUS("  Threads:   %u", num_threads);
+  _exception_handler = exception_handler;
+  _speculation_delay_ms = hedge_delay_ms;
+  _speculation_threads = num_threads;
+  _two_wins_table = two_wins_table;
+  _one_wins_table = one_wins_table;
+}
+
+
+void Store::configure_token_aware_routing(unsigned int refresh_interval_ms)
+{
+  TRC_STATUS("Configuring store token-aware routing");
+  TRC_STATUS("  Refresh:   %u ms", refresh_interval_ms);
+  _token_aware = true;
+  _ring_refresh_ms = refresh_interval_ms;
 }
 
 
@@ -317,8 +1106,10 @@ ResultCode Store::start()
   {
     _thread_pool = new Pool(this,
                             _num_threads,
+                            _max_threads,
                             _exception_handler,
-                            _max_queue);
+                            _max_queue,
+                            _target_queue_wait_ms);
 
     if (!_thread_pool->start())
     {
@@ -326,6 +1117,45 @@ ResultCode Store::start()
     }
   }
 
+  // Start the pool used for speculative reads.
+  if (_speculation_threads > 0)
+  {
+    _speculation_pool = new FunctorThreadPool(_speculation_threads,
+                                              _exception_handler,
+                                              &speculation_exception_callback);
+
+    if (_speculation_pool->start())
+    {
+      _speculation_running = true;
+    }
+    else
+    {
+      rc = RESOURCE_ERROR; // LCOV_EXCL_LINE
+    }
+  }
+
+  // Start the thread that keeps the token ring up to date.
+  if ((_token_aware) && (!_ring_thread_running))
+  {
+    _ring_terminate = false;
+    int thread_rc = pthread_create(&_ring_thread,
+                                   NULL,
+                                   &Store::static_ring_thread_function,
+                                   (void*)this);
+
+    if (thread_rc == 0)
+    {
+      _ring_thread_running = true;
+    }
+    else
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to start token ring thread: %d", thread_rc);
+      rc = RESOURCE_ERROR;
+      // LCOV_EXCL_STOP
+    }
+  }
+
   return rc;
 }
 
@@ -337,6 +1167,22 @@ void Store::stop()
   {
     _thread_pool->stop();
   }
+
+  if (_speculation_pool != NULL)
+  {
+    // Stop making speculative reads before purging the queue - see
+    // HAOperation::speculative_get().
+    _speculation_running = false;
+    _speculation_pool->stop();
+  }
+
+  if (_ring_thread_running)
+  {
+    pthread_mutex_lock(&_ring_lock);
+    _ring_terminate = true;
+    _ring_cond.signal();
+    pthread_mutex_unlock(&_ring_lock);
+  }
 }
 
 
@@ -349,12 +1195,27 @@ void Store::wait_stopped()
 
     delete _thread_pool; _thread_pool = NULL;
   }
+
+  if (_speculation_pool != NULL)
+  {
+    _speculation_pool->join();
+
+    delete _speculation_pool; _speculation_pool = NULL;
+  }
+
+  if (_ring_thread_running)
+  {
+    pthread_join(_ring_thread, NULL);
+    _ring_thread_running = false;
+  }
 }
 
 
 Store::~Store()
 {
-  if (_thread_pool != NULL)
+  if ((_thread_pool != NULL) ||
+      (_speculation_pool != NULL) ||
+      (_ring_thread_running))
   {
     // It is only safe to destroy the store once the thread pool has been deleted
     // (as the pool stores a pointer to the store). Make sure this is the case.
@@ -363,13 +1224,142 @@ Store::~Store()
   }
 
   delete _conn_pool; _conn_pool = NULL;
+  delete _aggregator; _aggregator = NULL;
+  pthread_mutex_destroy(&_ring_lock);
+}
+
+
+void Store::run_on_connection(const AddrInfo& target,
+                              std::function<void(Client*)> fn)
+{
+  ConnectionHandle<Client*> conn_handle = _conn_pool->get_connection(target);
+
+  try
+  {
+    Client* client = conn_handle.get_connection();
+
+    if (!client->is_connected())
+    {
+      TRC_DEBUG("Connecting to %s", target.to_string().c_str());
+      client->connect();
+      client->set_keyspace(_keyspace);
+    }
+
+    fn(client);
+  }
+  catch(TTransportException& te)
+  {
+    // Don't reuse a connection that has failed.
+    conn_handle.set_return_to_pool(false);
+    throw;
+  }
+}
+
+
+std::shared_ptr<const TokenRing> Store::get_ring()
+{
+  pthread_mutex_lock(&_ring_lock);
+  std::shared_ptr<const TokenRing> ring = _ring;
+  pthread_mutex_unlock(&_ring_lock);
+
+  return ring;
+}
+
+
+void* Store::static_ring_thread_function(void* store)
+{
+  ((Store*)store)->ring_thread_function();
+  return NULL;
+}
+
+
+void Store::ring_thread_function()
+{
+  pthread_mutex_lock(&_ring_lock);
+
+  while (!_ring_terminate)
+  {
+    pthread_mutex_unlock(&_ring_lock);
+    bool success = refresh_ring(0);
+    pthread_mutex_lock(&_ring_lock);
+
+    // Wait until the next refresh is due (or sooner if this one failed).
+    unsigned int delay_ms = _ring_refresh_ms;
+
+    if ((!success) && (delay_ms > RING_RETRY_MS))
+    {
+      delay_ms = RING_RETRY_MS;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += delay_ms / 1000;
+    deadline.tv_nsec += (delay_ms % 1000) * 1000000;
+
+    if (deadline.tv_nsec >= 1000000000)
+    {
+      deadline.tv_sec += 1;
+      deadline.tv_nsec -= 1000000000;
+    }
+
+    while ((!_ring_terminate) &&
+           (_ring_cond.timedwait(&deadline) != ETIMEDOUT))
+    {
+    }
+  }
+
+  pthread_mutex_unlock(&_ring_lock);
+}
+
+
+bool Store::refresh_ring(SAS::TrailId trail)
+{
+  std::string partitioner;
+  std::vector<TokenRange> ranges;
+  std::shared_ptr<const TokenRing> ring;
+
+  BaseAddrIterator* target_it = _resolver->resolve_iter(_cass_hostname,
+                                                        _cass_port,
+                                                        trail);
+  AddrInfo target;
+
+  if (target_it->next(target))
+  {
+    try
+    {
+      run_on_connection(target, [&](Client* client) {
+        client->describe_partitioner(partitioner);
+        client->describe_ring(ranges, _keyspace);
+      });
+
+      ring = std::make_shared<TokenRing>(partitioner, ranges, _cass_port);
+    }
+    catch(TException& te)
+    {
+      // Carry on with the ring we have (if any), and try again later.
+      TRC_WARNING("Failed to get token ring from %s: %s",
+                  target.to_string().c_str(), te.what());
+    }
+  }
+
+  delete target_it; target_it = NULL;
+
+  if (ring)
+  {
+    pthread_mutex_lock(&_ring_lock);
+    _ring = ring;
+    pthread_mutex_unlock(&_ring_lock);
+  }
+
+  return (bool)ring;
 }
 
 
 bool Store::perform_op(Operation* op,
                        SAS::TrailId trail,
                        ResultCode& cass_result,
-                       std::string& cass_error_text)
+                       std::string& cass_error_text,
+                       unsigned int* attempts)
 {
   bool success = false;
   bool retry = true;
@@ -381,6 +1371,35 @@ bool Store::perform_op(Operation* op,
                                                         trail);
   AddrInfo target;
 
+  if (_token_aware)
+  {
+    // Try a node that holds the row first, if we know one that's working.
+    std::string routing_key = op->get_routing_key();
+    std::shared_ptr<const TokenRing> ring;
+
+    if (!routing_key.empty())
+    {
+      ring = get_ring();
+    }
+
+    if (ring)
+    {
+      std::vector<AddrInfo> replicas;
+      ring->get_replicas(routing_key, replicas);
+
+      for (const AddrInfo& replica : replicas)
+      {
+        if (_resolver->is_whitelisted(replica))
+        {
+          TRC_DEBUG("Routing request to replica %s",
+                    replica.to_string().c_str());
+          target_it = new TokenAwareAddrIterator(replica, target_it);
+          break;
+        }
+      }
+    }
+  }
+
   // Iterate over targets until either we succeed in connecting, run out of
   // targets or hit the maximum (2).
   // If there is only one target, try it twice.
@@ -397,6 +1416,9 @@ bool Store::perform_op(Operation* op,
     // Get a client to execute the operation.
     ConnectionHandle<Client*> conn_handle = _conn_pool->get_connection(target);
 
+    Utils::StopWatch stopwatch;
+    stopwatch.start();
+
     // Call perform() to actually do the business logic of the request.  Catch
     // exceptions and turn them into return codes and error text.
     try
@@ -411,7 +1433,18 @@ bool Store::perform_op(Operation* op,
         client->set_keyspace(_keyspace);
       }
 
-      success = op->perform(client, trail);
+      op->set_target(this, target);
+
+      if (_aggregator != NULL)
+      {
+        // Route the operation's writes through the aggregator.
+        BatchingClient batching_client(client, target, _aggregator);
+        success = op->perform(&batching_client, trail);
+      }
+      else
+      {
+        success = op->perform(client, trail);
+      }
     }
     catch(TTransportException& te)
     {
@@ -493,6 +1526,24 @@ bool Store::perform_op(Operation* op,
     {
       _resolver->success(target);
     }
+
+    // Connection errors and timeouts (the errors we retry) count against the
+    // node.
+    unsigned long latency_us = 0;
+
+    if ((_stats != NULL) && (stopwatch.read(latency_us)))
+    {
+      _stats->record_replica_result(target.address_and_port_to_string(),
+                                    latency_us,
+                                    retry);
+    }
+  }
+
+  delete target_it; target_it = NULL;
+
+  if (attempts != NULL)
+  {
+    *attempts = attempt_count;
   }
 
   return success;
@@ -503,9 +1554,23 @@ bool Store::do_sync(Operation* op, SAS::TrailId trail)
 {
   ResultCode cass_result = UNKNOWN_ERROR;
   std::string cass_error_text = "";
+  unsigned int attempts = 0;
+
+  Utils::StopWatch stopwatch;
+  stopwatch.start();
 
   // perform_op() does the actual work
-  bool success  = perform_op(op, trail, cass_result, cass_error_text);
+  bool success  = perform_op(op, trail, cass_result, cass_error_text, &attempts);
+
+  unsigned long latency_us = 0;
+
+  if ((_stats != NULL) && (stopwatch.read(latency_us)))
+  {
+    _stats->record_operation(op->get_stats_table(),
+                             op->get_stats_operation(),
+                             latency_us,
+                             attempts);
+  }
 
   if (cass_result == OK)
   {
@@ -571,13 +1636,17 @@ void Store::do_async(Operation*& op, Transaction*& trx)
 //
 
 Store::Pool::Pool(Store* store,
-                  unsigned int num_threads,
+                  unsigned int min_threads,
+                  unsigned int max_threads,
                   ExceptionHandler* exception_handler,
-                  unsigned int max_queue) :
-  ThreadPool<std::pair<Operation*, Transaction*> >(num_threads,
-                                                   exception_handler,
-                                                   exception_callback,
-                                                   max_queue),
+                  unsigned int max_queue,
+                  unsigned int target_queue_wait_ms) :
+  ElasticThreadPool<std::pair<Operation*, Transaction*> >(min_threads,
+                                                          max_threads,
+                                                          exception_handler,
+                                                          exception_callback,
+                                                          max_queue,
+                                                          target_queue_wait_ms),
   _store(store)
 {}
 
@@ -625,6 +1694,154 @@ void Store::Pool::process_work(std::pair<Operation*, Transaction*>& params)
 }
 
 
+//
+// MutationAggregator methods.
+//
+
+MutationAggregator::MutationAggregator(unsigned int window_us,
+                                       unsigned int max_operations) :
+  _window_us(window_us),
+  _max_operations(max_operations),
+  _lock(PTHREAD_MUTEX_INITIALIZER),
+  _cond(&_lock),
+  _open_batches()
+{
+}
+
+
+MutationAggregator::~MutationAggregator()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+
+void MutationAggregator::batch_mutate(Client* client,
+                                      const AddrInfo& target,
+                                      const MutationMap& mutation_map,
+                                      cass::ConsistencyLevel::type consistency_level)
+{
+  std::shared_ptr<Batch> batch;
+  bool leader = false;
+  BatchKey batch_key(target, consistency_level);
+
+  pthread_mutex_lock(&_lock);
+
+  std::map<BatchKey, std::shared_ptr<Batch> >::iterator it =
+                                                 _open_batches.find(batch_key);
+
+  if (it != _open_batches.end())
+  {
+    batch = it->second;
+  }
+  else
+  {
+    batch = std::make_shared<Batch>();
+    _open_batches[batch_key] = batch;
+    leader = true;
+  }
+
+  merge(batch->mutations, mutation_map);
+  ++batch->operations;
+
+  if ((_max_operations > 0) && (batch->operations >= _max_operations))
+  {
+    // The batch is full - close it and tell the leader to send it.
+    _open_batches.erase(batch_key);
+    _cond.broadcast();
+  }
+
+  if (leader)
+  {
+    // Wait for other requests to join the batch (or for it to fill up).
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += _window_us / 1000000;
+    deadline.tv_nsec += (_window_us % 1000000) * 1000;
+
+    if (deadline.tv_nsec >= 1000000000)
+    {
+      deadline.tv_sec += 1;
+      deadline.tv_nsec -= 1000000000;
+    }
+
+    while (true)
+    {
+      it = _open_batches.find(batch_key);
+
+      if ((it == _open_batches.end()) || (it->second != batch))
+      {
+        // The batch has been closed.
+        break;
+      }
+
+      if (_cond.timedwait(&deadline) == ETIMEDOUT)
+      {
+        _open_batches.erase(it);
+        break;
+      }
+    }
+
+    // The batch is closed, so no-one else touches the mutations and we can
+    // send it without the lock.
+    pthread_mutex_unlock(&_lock);
+
+    TRC_DEBUG("Sending batch of %u writes to %s",
+              batch->operations,
+              target.to_string().c_str());
+
+    try
+    {
+      client->batch_mutate(batch->mutations, consistency_level);
+    }
+    catch(...)
+    {
+      batch->exception = std::current_exception();
+    }
+
+    pthread_mutex_lock(&_lock);
+    batch->sent = true;
+    _cond.broadcast();
+  }
+  else
+  {
+    while (!batch->sent)
+    {
+      _cond.wait();
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  if (batch->exception)
+  {
+    std::rethrow_exception(batch->exception);
+  }
+}
+
+
+void MutationAggregator::merge(MutationMap& into, const MutationMap& from)
+{
+  for (MutationMap::const_iterator key = from.begin();
+       key != from.end();
+       ++key)
+  {
+    std::map<std::string, std::vector<Mutation> >& into_cfs = into[key->first];
+
+    for (std::map<std::string, std::vector<Mutation> >::const_iterator cf = key->second.begin();
+         cf != key->second.end();
+         ++cf)
+    {
+      // Mutations are applied according to their timestamps, so the order
+      // they're merged in doesn't matter.
+      std::vector<Mutation>& into_mutations = into_cfs[cf->first];
+      into_mutations.insert(into_mutations.end(),
+                            cf->second.begin(),
+                            cf->second.end());
+    }
+  }
+}
+
+
 //
 // Operation methods.
 //
@@ -694,12 +1911,18 @@ put_columns(const std::string& column_family,
     mutations.push_back(mutation);
   }
 
-  // Update the mutation map.
-  for (std::vector<std::string>::const_iterator it = keys.begin();
-       it != keys.end();
-       ++it)
+  // Update the mutation map.  Each key needs its own copy of the mutations,
+  // except the last which can take the original.
+  for (size_t ii = 0; ii < keys.size(); ++ii)
   {
-    mutmap[*it][column_family] = mutations;
+    if (ii + 1 < keys.size())
+    {
+      mutmap[keys[ii]][column_family] = mutations;
+    }
+    else
+    {
+      mutmap[keys[ii]][column_family].swap(mutations);
+    }
   }
 
   // Execute the database operation.
@@ -751,7 +1974,7 @@ put_columns(const std::vector<RowColumns>& to_put,
       mutations.push_back(mutation);
     }
 
-    mutmap[it->key][it->cf] = mutations;
+    mutmap[it->key][it->cf].swap(mutations);
   }
 
   // Execute the database operation.
@@ -205,9 +205,9 @@ DnsCachedResolver::~DnsCachedResolver()
 
 void DnsCachedResolver::reload_static_records()
 {
-  pthread_mutex_lock(&_cache_lock);
+  // The static cache is swapped atomically, so there is no need to hold the
+  // cache lock (and stall queries) while it reloads.
   _static_cache.reload_static_records();
-  pthread_mutex_unlock(&_cache_lock);
 }
 
 DnsResult DnsCachedResolver::dns_query(const std::string& domain,
@@ -240,11 +240,9 @@ void DnsCachedResolver::dns_query(const std::vector<std::string>& domains,
   // Maps canonical domain -> result of DNS query
   std::map<std::string, DnsResult> result_map;
 
-  pthread_mutex_lock(&_cache_lock);
-
-  // First, check the _static_records map to see if there are any static records
+  // First, check the static cache to see if there are any static records
   // to use in preference to an actual DNS lookup (these are specified in the
-  // _dns_config_file)
+  // _dns_config_file).  The static cache doesn't need the cache lock.
   for (const std::string& domain : domains)
   {
     TRC_DEBUG("Searching for DNS record matching %s in the static cache", domain.c_str());
@@ -271,6 +269,8 @@ void DnsCachedResolver::dns_query(const std::vector<std::string>& domains,
     }
   }
 
+  pthread_mutex_lock(&_cache_lock);
+
   // Now perform any DNS lookups we still need to do.
   inner_dns_query(domains_to_query, dnstype, result_map, trail);
 
@@ -573,47 +573,54 @@ void DnsCachedResolver::dns_response(const std::string& domain,
       SAS::report_event(event);
     }
 
-    // Create a message parser and parse the message.
+    // Create a message parser and parse the message.  We parse into record
+    // references over the response buffer, and only create owned records
+    // for the ones we add to the cache.
     DnsParser parser(abuf, alen);
 
-    if (parser.parse())
+    if (parser.parse_refs())
     {
       // Parsing was successful, so clear out any old records, then process
       // the answers and additional data.
       clear_cache_entry(ce);
       TRC_DEBUG("DNS response for %s - response contains %d answers",
                  domain.c_str(),
-                 parser.answers().size());
+                 parser.answer_refs().size());
 
-      while (!parser.answers().empty())
+      for (const DnsParser::RecordRef& ref : parser.answer_refs())
       {
-        DnsRRecord* rr = parser.answers().front();
-        parser.answers().pop_front();
-        if ((rr->rrtype() == ns_t_a) ||
-            (rr->rrtype() == ns_t_aaaa))
+        if ((ref.rrtype() == ns_t_a) ||
+            (ref.rrtype() == ns_t_aaaa))
         {
           // A/AAAA record, so check that RRNAME matches the question
           // (or a CNAME).
-          if ((strcasecmp(rr->rrname().c_str(), domain.c_str()) == 0) ||
-              (strcasecmp(rr->rrname().c_str(), canonical_domain.c_str()) == 0))
+          if ((ref.rrname().matches(domain)) ||
+              (ref.rrname().matches(canonical_domain)))
           {
             // RRNAME matches, so add this record to the cache entry.
-            add_record_to_cache(ce, rr, trail);
+            DnsRRecord* rr = parser.materialise(ref);
+            if (rr != NULL)
+            {
+              add_record_to_cache(ce, rr, trail);
+            }
           }
           else
           {
             TRC_DEBUG("Ignoring A/AAAA record for %s (expecting domain %s)",
-                      rr->rrname().c_str(), domain.c_str());
-            delete rr;
+                      ref.rrname().to_string().c_str(), domain.c_str());
           }
         }
-        else if ((rr->rrtype() == ns_t_srv) ||
-                 (rr->rrtype() == ns_t_naptr))
+        else if ((ref.rrtype() == ns_t_srv) ||
+                 (ref.rrtype() == ns_t_naptr))
         {
           // SRV or NAPTR record, so add it to the cache entry.
-          add_record_to_cache(ce, rr, trail);
+          DnsRRecord* rr = parser.materialise(ref);
+          if (rr != NULL)
+          {
+            add_record_to_cache(ce, rr, trail);
+          }
         }
-        else if (rr->rrtype() == ns_t_cname)
+        else if (ref.rrtype() == ns_t_cname)
         {
           // Store off the CNAME value, so that if we see subsequent A
           // records for the pointed-to name, we'll recognise them.
@@ -624,37 +631,38 @@ void DnsCachedResolver::dns_response(const std::string& domain,
           // example.com A 10.0.0.1
           //
           // RFC 1034 mandates this format, so this should be fine.
-
-          canonical_domain = ((DnsCNAMERecord*)rr)->target();
-          TRC_DEBUG("CNAME record pointing at %s - treating this as equivalent to %s",
-                    canonical_domain.c_str(),
-                    domain.c_str());
+          DnsRRecord* rr = parser.materialise(ref);
+          if (rr != NULL)
+          {
+            canonical_domain = ((DnsCNAMERecord*)rr)->target();
+            TRC_DEBUG("CNAME record pointing at %s - treating this as equivalent to %s",
+                      canonical_domain.c_str(),
+                      domain.c_str());
+            delete rr;
+          }
         }
         else
         {
           TRC_WARNING("Ignoring %s record in DNS answer - only CNAME, A, AAAA, NAPTR and SRV are supported",
-                      DnsRRecord::rrtype_to_string(rr->rrtype()).c_str());
-          delete rr;
+                      DnsRRecord::rrtype_to_string(ref.rrtype()).c_str());
         }
       }
 
       // Process any additional records returned in the response, creating
-      // or updating cache entries.  First we sort the records by cache key.
+      // or updating cache entries.  First we sort the records by cache key,
+      // skipping any records we don't cache without materialising them.
       std::map<DnsCacheKey, std::list<DnsRRecord*> > sorted;
-      while (!parser.additional().empty())
+      for (const DnsParser::RecordRef& ref : parser.additional_refs())
       {
-        DnsRRecord* rr = parser.additional().front();
-        parser.additional().pop_front();
-        if (caching_enabled(rr->rrtype()))
+        if (caching_enabled(ref.rrtype()))
         {
           // Caching is enabled for this record type, so add it to sorted
           // structure.
-          sorted[std::make_pair(rr->rrtype(), rr->rrname())].push_back(rr);
-        }
-        else
-        {
-          // Caching not enabled for this record, so delete it.
-          delete rr;
+          DnsRRecord* rr = parser.materialise(ref);
+          if (rr != NULL)
+          {
+            sorted[std::make_pair(rr->rrtype(), rr->rrname())].push_back(rr);
+          }
         }
       }
 
@@ -713,28 +721,19 @@ void DnsCachedResolver::dns_response(const std::string& domain,
       clear_cache_entry(ce);
 
       DnsParser parser(abuf, alen);
-      if (parser.parse())
+      if (parser.parse_refs())
       {
-        while (!parser.authorities().empty())
+        for (const DnsParser::RecordRef& ref : parser.authority_refs())
         {
-          DnsRRecord* rr = parser.authorities().front();
-          parser.authorities().pop_front();
-
-          if (rr->rrtype() == ns_t_soa)
+          if (ref.rrtype() == ns_t_soa)
           {
-            // Clamp the expiry time to be no more than the default TTL from now
+            // Clamp the expiry time to be no more than the default TTL from
+            // now.  We only need the TTL, so there's no need to materialise
+            // the record.
             int max_expires = DEFAULT_NEGATIVE_CACHE_TTL + time(NULL);
-            ce->expires = std::min(rr->expires(), max_expires);
-
-            // We must delete any records we remove from the parser
-            delete rr;
+            ce->expires = std::min(ref.ttl() + (int)time(NULL), max_expires);
             break;
           }
-          else
-          {
-            // We must delete any records we remove from the parser
-            delete rr;
-          }
         }
       }
     }
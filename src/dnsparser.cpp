@@ -14,6 +14,7 @@
 #include <exception>
 
 #include <memory.h>
+#include <strings.h>
 #include <ctype.h>
 
 #include <ares.h>
@@ -26,10 +27,15 @@ DnsParser::DnsParser(unsigned char* buf,
   _data(buf),
   _data_end(buf + length - 1),
   _length(length),
+  _qd_count(0),
+  _an_count(0),
+  _ns_count(0),
+  _ar_count(0),
   _questions(),
   _answers(),
   _authorities(),
-  _additional()
+  _additional(),
+  _rr_refs()
 {
 }
 
@@ -108,7 +114,7 @@ bool DnsParser::parse()
       _additional.push_back(rr);
     }
   }
-  catch (std::exception e)
+  catch (const std::exception& e)
   {
     TRC_ERROR("Failed to parse DNS message - %s", e.what());
     rc = false;
@@ -121,6 +127,44 @@ bool DnsParser::parse()
   return rc;
 }
 
+bool DnsParser::parse_refs()
+{
+  bool rc = true;
+  unsigned char* rptr = _data;
+
+  try
+  {
+    rptr += parse_header(rptr);
+    TRC_DEBUG("%d questions, %d answers, %d authorities, %d additional records",
+              _qd_count, _an_count, _ns_count, _ar_count);
+
+    // We don't need the questions, so just step over them.
+    for (int ii = 0; ii < _qd_count; ++ii)
+    {
+      rptr += skip_question(rptr);
+    }
+
+    // Parse the answer, NS and additional records into the record array in
+    // a single pass - the sections are contiguous in the message.
+    _rr_refs.resize(_an_count + _ns_count + _ar_count);
+    for (size_t ii = 0; ii < _rr_refs.size(); ++ii)
+    {
+      rptr += parse_rr_ref(rptr, _rr_refs[ii]);
+    }
+  }
+  catch (const std::exception& e)
+  {
+    TRC_ERROR("Failed to parse DNS message - %s", e.what());
+    _rr_refs.clear();
+    _an_count = 0;
+    _ns_count = 0;
+    _ar_count = 0;
+    rc = false;
+  }
+
+  return rc;
+}
+
 int DnsParser::parse_header(unsigned char* hptr)
 {
   if (hptr + HDR_SIZE > _data_end)
@@ -135,20 +179,29 @@ int DnsParser::parse_header(unsigned char* hptr)
   return HDR_SIZE;
 }
 
-int DnsParser::parse_domain_name(unsigned char *nptr, std::string& name)
+template <class F>
+int DnsParser::walk_domain_name(const unsigned char* nptr, F fn) const
 {
   int compressed_length = 0;
-  unsigned char* lptr = nptr;
+  const unsigned char* lptr = nptr;
+
+  // Compression pointers must point strictly before the last pointer
+  // target followed (or, for the first pointer, before the pointer itself),
+  // so the targets strictly decrease and the walk must terminate.
+  const unsigned char* limit = NULL;
+
+  if (lptr > _data_end)
+  {
+    throw std::exception();
+  }
 
   if (*lptr == 0)
   {
     // Already at the root domain, so just return a single dot.
-    name = ".";
+    fn(".", 1);
     return 1;
   }
 
-  name = "";
-
   do
   {
     if (lptr > _data_end)
@@ -159,24 +212,28 @@ int DnsParser::parse_domain_name(unsigned char *nptr, std::string& name)
     int offset;
     if ((length = label_length(lptr)) != -1)
     {
-      // Length field, so append the label.
+      // Length field, so pass the label to the visitor.
       if (lptr + length + 1 > _data_end)
       {
         throw std::exception();
       }
-      name.append((const char *)(lptr + 1), length);
+      fn((const char *)(lptr + 1), length);
       lptr += length + 1;
       if (*lptr != 0)
       {
-        name.append(".");
+        fn(".", 1);
       }
     }
-    else if ((offset = label_offset(lptr)) != -1)
+    else if ((lptr + 1 <= _data_end) &&
+             ((offset = label_offset(lptr)) != -1))
     {
       // Offset field.
-      if (offset > (lptr - _data))
+      if (offset >= (((limit != NULL) ? limit : lptr) - _data))
       {
-        // Forward references are not allowed.
+        // Forward references, references to the pointer itself and
+        // pointers that don't move strictly backwards (which could loop)
+        // are not allowed.
+        TRC_DEBUG("Invalid compression pointer %x at offset %x", offset, lptr - _data);
         throw std::exception();
       }
       if (compressed_length == 0)
@@ -186,6 +243,7 @@ int DnsParser::parse_domain_name(unsigned char *nptr, std::string& name)
         compressed_length = lptr - nptr + 2;
       }
       lptr = _data + offset;
+      limit = lptr;
     }
     else
     {
@@ -201,12 +259,21 @@ int DnsParser::parse_domain_name(unsigned char *nptr, std::string& name)
     compressed_length = lptr - nptr + 1;
   }
 
+  return compressed_length;
+}
+
+int DnsParser::parse_domain_name(const unsigned char* nptr, std::string& name) const
+{
+  name.clear();
+  int compressed_length =
+    walk_domain_name(nptr, [&name](const char* s, int n) { name.append(s, n); });
+
   TRC_DEBUG("Parsed domain name = %s, encoded length = %d", name.c_str(), compressed_length);
 
   return compressed_length;
 }
 
-int DnsParser::parse_character_string(unsigned char* sptr, std::string& cstring)
+int DnsParser::parse_character_string(const unsigned char* sptr, std::string& cstring) const
 {
   if (sptr + *sptr > _data_end)
   {
@@ -228,33 +295,67 @@ int DnsParser::parse_question(unsigned char* qptr, DnsQuestion*& question)
   return nlength + Q_FIXED_SIZE;
 }
 
+int DnsParser::skip_question(unsigned char* qptr)
+{
+  int nlength = walk_domain_name(qptr, [](const char*, int) {});
+  if (qptr + nlength + Q_FIXED_SIZE - 1 > _data_end)
+  {
+    throw std::exception();
+  }
+
+  return nlength + Q_FIXED_SIZE;
+}
+
 int DnsParser::parse_rr(unsigned char* rptr, DnsRRecord*& rr)
 {
-  // Parse the common RR fields.
-  std::string rrname;
-  int nlength = parse_domain_name(rptr, rrname);
-  if (rptr + RR_HDR_FIXED_SIZE > _data_end)
+  RecordRef ref;
+  int length = parse_rr_ref(rptr, ref);
+  rr = create_rr(ref);
+
+  return length;
+}
+
+int DnsParser::parse_rr_ref(unsigned char* rptr, RecordRef& ref)
+{
+  // Parse the common RR fields.  The owner name is validated but not
+  // decoded.
+  int nlength = walk_domain_name(rptr, [](const char*, int) {});
+  if (rptr + nlength + RR_HDR_FIXED_SIZE - 1 > _data_end)
   {
     throw std::exception();
   }
-  int rrtype = read_int16(rptr + nlength + RRTYPE_OFFSET);
-  int rrclass = read_int16(rptr + nlength + RRCLASS_OFFSET);
-  int ttl = read_int32(rptr + nlength + TTL_OFFSET);
-  int rdlength = read_int16(rptr + nlength + RDLENGTH_OFFSET);
-  unsigned char* rdata = rptr + nlength + RR_HDR_FIXED_SIZE;
+  ref._rrname = NameRef(this, rptr);
+  ref._rrtype = read_int16(rptr + nlength + RRTYPE_OFFSET);
+  ref._rrclass = read_int16(rptr + nlength + RRCLASS_OFFSET);
+  ref._ttl = read_int32(rptr + nlength + TTL_OFFSET);
+  ref._rdlength = read_int16(rptr + nlength + RDLENGTH_OFFSET);
+  ref._rdata = rptr + nlength + RR_HDR_FIXED_SIZE;
 
   // Check the length of the variable part of the record doesn't overflow
   // the buffer.
-  if (rdata + rdlength - 1 > _data_end)
+  if (ref._rdata + ref._rdlength - 1 > _data_end)
   {
     throw std::exception();
   }
 
   TRC_DEBUG("Resource Record NAME=%s TYPE=%s CLASS=%s TTL=%d RDLENGTH=%d",
-            rrname.c_str(),
-            DnsRRecord::rrtype_to_string(rrtype).c_str(),
-            DnsRRecord::rrclass_to_string(rrclass).c_str(),
-            ttl, rdlength);
+            ref._rrname.to_string().c_str(),
+            DnsRRecord::rrtype_to_string(ref._rrtype).c_str(),
+            DnsRRecord::rrclass_to_string(ref._rrclass).c_str(),
+            ref._ttl, ref._rdlength);
+
+  return nlength + RR_HDR_FIXED_SIZE + ref._rdlength;
+}
+
+DnsRRecord* DnsParser::create_rr(const RecordRef& ref) const
+{
+  DnsRRecord* rr;
+  std::string rrname = ref._rrname.to_string();
+  int rrtype = ref._rrtype;
+  int rrclass = ref._rrclass;
+  int ttl = ref._ttl;
+  int rdlength = ref._rdlength;
+  const unsigned char* rdata = ref._rdata;
 
   // Process the variant parts of the record.
   if ((rrclass == ns_c_in) && (rrtype == ns_t_a))
@@ -333,25 +434,87 @@ int DnsParser::parse_rr(unsigned char* rptr, DnsRRecord*& rr)
     rr = new DnsRRecord(rrname, rrtype, rrclass, ttl);
   }
 
-  return nlength + RR_HDR_FIXED_SIZE + rdlength;
+  return rr;
+}
+
+DnsRRecord* DnsParser::materialise(const RecordRef& ref) const
+{
+  DnsRRecord* rr = NULL;
+
+  try
+  {
+    rr = create_rr(ref);
+  }
+  catch (const std::exception& e)
+  {
+    TRC_DEBUG("Failed to parse RDATA of %s record",
+              DnsRRecord::rrtype_to_string(ref._rrtype).c_str());
+  }
+
+  return rr;
+}
+
+DnsParser::RecordRefRange DnsParser::answer_refs() const
+{
+  const RecordRef* begin = _rr_refs.data();
+  return RecordRefRange(begin, begin + _an_count);
+}
+
+DnsParser::RecordRefRange DnsParser::authority_refs() const
+{
+  const RecordRef* begin = _rr_refs.data() + _an_count;
+  return RecordRefRange(begin, begin + _ns_count);
+}
+
+DnsParser::RecordRefRange DnsParser::additional_refs() const
+{
+  const RecordRef* begin = _rr_refs.data() + _an_count + _ns_count;
+  return RecordRefRange(begin, begin + _ar_count);
+}
+
+std::string DnsParser::NameRef::to_string() const
+{
+  std::string name;
+  _parser->walk_domain_name(_nptr,
+                            [&name](const char* s, int n) { name.append(s, n); });
+  return name;
+}
+
+bool DnsParser::NameRef::matches(const std::string& name) const
+{
+  // Compare each piece of the decoded name against the corresponding part
+  // of the supplied name, stopping comparing at the first mismatch.
+  size_t pos = 0;
+  bool match = true;
+  _parser->walk_domain_name(_nptr,
+                            [&name, &pos, &match](const char* s, int n)
+                            {
+                              if (match)
+                              {
+                                match = ((pos + n <= name.size()) &&
+                                         (strncasecmp(s, name.data() + pos, n) == 0));
+                                pos += n;
+                              }
+                            });
+  return (match && (pos == name.size()));
 }
 
-int DnsParser::read_int16(unsigned char* p)
+int DnsParser::read_int16(const unsigned char* p) const
 {
   return (((int)(*p)) << 8) + ((int)(*(p+1)));
 }
 
-int DnsParser::read_int32(unsigned char* p)
+int DnsParser::read_int32(const unsigned char* p) const
 {
   return (((int)(*p)) << 24) + (((int)(*(p+1))) << 16) + (((int)(*(p+2))) << 8) + ((int)(*(p+3)));
 }
 
-int DnsParser::label_length(unsigned char* lptr)
+int DnsParser::label_length(const unsigned char* lptr) const
 {
   return ((*lptr & 0xc0) == 0) ? *lptr & 0x3f : -1;
 }
 
-int DnsParser::label_offset(unsigned char* lptr)
+int DnsParser::label_offset(const unsigned char* lptr) const
 {
   return ((*lptr & 0xc0) == 0xc0) ? ((*lptr & 0x3f) << 8) + *(lptr+1) : -1;
 }
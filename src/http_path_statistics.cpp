@@ -0,0 +1,260 @@
+/**
+ * @file http_path_statistics.cpp Per-path statistics about HTTP requests.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "http_path_statistics.h"
+#include "snmp_http_path_stats_table.h"
+
+unsigned long HttpPathStatistics::Snapshot::mean_latency_us() const
+{
+  return (latency_samples > 0) ? (latency_total_us / latency_samples) : 0;
+}
+
+unsigned long HttpPathStatistics::Snapshot::percentile_us(unsigned int percent) const
+{
+  if (latency_samples == 0)
+  {
+    return 0;
+  }
+
+  // Find the first bucket at which the cumulative count reaches the
+  // percentile.
+  uint64_t target = (latency_samples * percent + 99) / 100;
+  uint64_t count = 0;
+
+  for (int ii = 0; ii < NUM_BUCKETS - 1; ++ii)
+  {
+    count += latency_buckets[ii];
+
+    if (count >= target)
+    {
+      return BUCKET_BASE_US << ii;
+    }
+  }
+
+  // The percentile is in the last (unbounded) bucket.
+  return BUCKET_BASE_US << (NUM_BUCKETS - 1);
+}
+
+HttpPathStatistics::HttpPathStatistics(SNMP::HttpPathStatsTable* table) :
+  _next_shard(0),
+  _lock(PTHREAD_MUTEX_INITIALIZER),
+  _paths()
+{
+  pthread_key_create(&_shard_key, NULL);
+
+  if (table != NULL)
+  {
+    // The table reads its rows from us when it is queried.
+    table->set_statistics(this);
+  }
+}
+
+HttpPathStatistics::~HttpPathStatistics()
+{
+  for (Path* path : _paths)
+  {
+    for (Shard* shard : path->shards)
+    {
+      delete shard;
+    }
+
+    delete path;
+  }
+
+  pthread_key_delete(_shard_key);
+  pthread_mutex_destroy(&_lock);
+}
+
+HttpPathStatistics::Path* HttpPathStatistics::add_path(const std::string& name)
+{
+  // Value-initializing the paths and shards zeroes all the counters.
+  Path* path = new Path();
+  path->name = name;
+
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    path->shards.push_back(new Shard());
+  }
+
+  pthread_mutex_lock(&_lock);
+  path->index = _paths.size();
+  _paths.push_back(path);
+  pthread_mutex_unlock(&_lock);
+
+  return path;
+}
+
+HttpPathStatistics::Shard* HttpPathStatistics::get_shard(Path* path)
+{
+  uintptr_t index = (uintptr_t)pthread_getspecific(_shard_key);
+
+  if (index == 0)
+  {
+    // This is the thread's first request, so assign it a shard.
+    index = (_next_shard.fetch_add(1, std::memory_order_relaxed) % NUM_SHARDS) + 1;
+    pthread_setspecific(_shard_key, (void*)index);
+  }
+
+  return path->shards[index - 1];
+}
+
+void HttpPathStatistics::request_started(Path* path, htp_method method)
+{
+  int index = method_index(method);
+  Counters& counters = get_shard(path)->methods[index];
+  counters.requests.fetch_add(1, std::memory_order_relaxed);
+  counters.in_flight.fetch_add(1, std::memory_order_relaxed);
+
+  // The SNMP table adds a row for the method when it is next queried.
+  if (!path->seen[index].load(std::memory_order_relaxed))
+  {
+    path->seen[index].store(true, std::memory_order_relaxed);
+  }
+}
+
+void HttpPathStatistics::request_complete(Path* path,
+                                          htp_method method,
+                                          int rc,
+                                          bool latency_valid,
+                                          unsigned long latency_us)
+{
+  Counters& counters = get_shard(path)->methods[method_index(method)];
+  counters.in_flight.fetch_sub(1, std::memory_order_relaxed);
+
+  int rc_class = rc / 100;
+
+  if ((rc_class <= 0) || (rc_class >= NUM_RC_CLASSES))
+  {
+    rc_class = 0;
+  }
+
+  counters.responses[rc_class].fetch_add(1, std::memory_order_relaxed);
+
+  if (latency_valid)
+  {
+    int bucket = 0;
+
+    while ((bucket < NUM_BUCKETS - 1) && (latency_us >= (BUCKET_BASE_US << bucket)))
+    {
+      ++bucket;
+    }
+
+    counters.latency_samples.fetch_add(1, std::memory_order_relaxed);
+    counters.latency_total_us.fetch_add(latency_us, std::memory_order_relaxed);
+    counters.latency_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void HttpPathStatistics::get_snapshot(const Path* path,
+                                      htp_method method,
+                                      Snapshot& snapshot)
+{
+  int index = method_index(method);
+
+  snapshot.path = path->name;
+  snapshot.method = method_name(method);
+  snapshot.requests = 0;
+  snapshot.in_flight = 0;
+  snapshot.latency_samples = 0;
+  snapshot.latency_total_us = 0;
+  memset(snapshot.latency_buckets, 0, sizeof(snapshot.latency_buckets));
+  memset(snapshot.responses, 0, sizeof(snapshot.responses));
+
+  for (const Shard* shard : path->shards)
+  {
+    const Counters& counters = shard->methods[index];
+    snapshot.requests += counters.requests.load(std::memory_order_relaxed);
+    snapshot.in_flight += counters.in_flight.load(std::memory_order_relaxed);
+    snapshot.latency_samples += counters.latency_samples.load(std::memory_order_relaxed);
+    snapshot.latency_total_us += counters.latency_total_us.load(std::memory_order_relaxed);
+
+    for (int ii = 0; ii < NUM_BUCKETS; ++ii)
+    {
+      snapshot.latency_buckets[ii] +=
+                         counters.latency_buckets[ii].load(std::memory_order_relaxed);
+    }
+
+    for (int ii = 0; ii < NUM_RC_CLASSES; ++ii)
+    {
+      snapshot.responses[ii] += counters.responses[ii].load(std::memory_order_relaxed);
+    }
+  }
+
+  // The in flight count is decremented by whichever thread completes the
+  // request, so a shard's count can be briefly negative.
+  if (snapshot.in_flight < 0)
+  {
+    snapshot.in_flight = 0;
+  }
+}
+
+void HttpPathStatistics::get_snapshots(std::vector<Snapshot>& snapshots)
+{
+  snapshots.clear();
+
+  pthread_mutex_lock(&_lock);
+
+  for (const Path* path : _paths)
+  {
+    for (int ii = 0; ii < NUM_METHODS; ++ii)
+    {
+      Snapshot snapshot;
+      get_snapshot(path, (htp_method)ii, snapshot);
+
+      if (snapshot.requests > 0)
+      {
+        snapshots.push_back(snapshot);
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void HttpPathStatistics::get_active(std::vector<std::pair<const Path*, htp_method> >& active)
+{
+  active.clear();
+
+  pthread_mutex_lock(&_lock);
+
+  for (const Path* path : _paths)
+  {
+    for (int ii = 0; ii < NUM_METHODS; ++ii)
+    {
+      if (path->seen[ii].load(std::memory_order_relaxed))
+      {
+        active.push_back(std::make_pair(path, (htp_method)ii));
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+const char* HttpPathStatistics::method_name(htp_method method)
+{
+  static const char* const NAMES[NUM_METHODS] =
+  {
+    "GET", "HEAD", "POST", "PUT", "DELETE", "MKCOL", "COPY", "MOVE",
+    "OPTIONS", "PROPFIND", "PROPPATCH", "LOCK", "UNLOCK", "TRACE", "CONNECT",
+    "PATCH", "UNKNOWN"
+  };
+
+  return NAMES[method_index(method)];
+}
+
+int HttpPathStatistics::method_index(htp_method method)
+{
+  return ((method >= 0) && (method < NUM_METHODS)) ? method : htp_method_UNKNOWN;
+}
@@ -11,6 +11,7 @@
 
 #include "httpstack.h"
 #include <cstring>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <climits>
 #include <algorithm>
@@ -28,16 +29,20 @@ HttpStack::HttpStack(int num_threads,
                      ExceptionHandler* exception_handler,
                      AccessLogger* access_logger,
                      LoadMonitor* load_monitor,
-                     StatsInterface* stats) :
+                     StatsInterface* stats,
+                     int num_event_bases,
+                     SNMP::HttpPathStatsTable* path_stats_table) :
   _num_threads(num_threads),
+  _num_event_bases(std::max(num_event_bases, 1)),
   _exception_handler(exception_handler),
   _access_logger(access_logger),
   _load_monitor(load_monitor),
   _stats(stats),
-  _evbase(nullptr),
-  _evhtp(nullptr)
+  _path_statistics(path_stats_table),
+  _event_bases()
 {
-  TRC_STATUS("Constructing HTTP stack with %d threads", _num_threads);
+  TRC_STATUS("Constructing HTTP stack with %d threads on each of %d event bases",
+             _num_threads, _num_event_bases);
 }
 
 HttpStack::~HttpStack()
@@ -48,6 +53,11 @@ HttpStack::~HttpStack()
   {
     delete *reg;
   }
+
+  for (EventBase* event_base : _event_bases)
+  {
+    delete event_base;
+  }
 }
 
 void HttpStack::Request::send_reply(int rc, SAS::TrailId trail)
@@ -56,6 +66,31 @@ void HttpStack::Request::send_reply(int rc, SAS::TrailId trail)
   _stack->send_reply(*this, rc, trail);
 }
 
+void HttpStack::Request::start_chunked_reply(int rc, SAS::TrailId trail)
+{
+  _chunked_rc = rc;
+  _stack->send_reply_chunk_start(*this, rc, trail);
+}
+
+void HttpStack::Request::send_chunk(evbuffer* chunk)
+{
+  _stack->send_reply_chunk(*this, chunk);
+}
+
+void HttpStack::Request::send_chunk(const std::string& chunk)
+{
+  evbuffer* eb = evbuffer_new();
+  evbuffer_add(eb, chunk.data(), chunk.length());
+  _stack->send_reply_chunk(*this, eb);
+  evbuffer_free(eb);
+}
+
+void HttpStack::Request::end_chunked_reply(SAS::TrailId trail)
+{
+  _stopwatch.stop();
+  _stack->send_reply_chunk_end(*this, _chunked_rc, trail);
+}
+
 bool HttpStack::Request::get_latency(unsigned long& latency_us)
 {
   return ((_track_latency) && (_stopwatch.read(latency_us)));
@@ -67,8 +102,9 @@ void HttpStack::send_reply_internal(Request& req, int rc, SAS::TrailId trail)
 {
   TRC_VERBOSE("Sending response %d to request for URL %s, args %s", rc, req.req()->uri->path->full, req.req()->uri->query_raw);
   unsigned long latency_us = 0;
-  req.get_latency(latency_us);
+  bool latency_valid = req.get_latency(latency_us);
   log(std::string(req.req()->uri->path->full), req.method_as_str(), rc, latency_us);
+  record_path_stats(req, rc, latency_valid, latency_us);
   req.sas_log_tx_http_rsp(trail, rc, 0);
 
   evhtp_send_reply(req.req(), rc);
@@ -84,6 +120,65 @@ void HttpStack::send_reply(Request& req,
   // HttpStack::handler_callback_fn.
   evhtp_request_resume(req.req());
 
+  reply_complete(req, trail);
+}
+
+// The start of a chunked reply is logged to SAS, but the reply is only
+// access logged once it is complete.
+void HttpStack::send_reply_chunk_start(Request& req,
+                                       int rc,
+                                       SAS::TrailId trail)
+{
+  TRC_VERBOSE("Starting chunked response %d to request for URL %s, args %s",
+              rc, req.req()->uri->path->full, req.req()->uri->query_raw);
+  req.sas_log_tx_http_rsp(trail, rc, 0);
+  evhtp_send_reply_chunk_start(req.req(), rc);
+}
+
+void HttpStack::send_reply_chunk(Request& req, evbuffer* chunk)
+{
+  // evhtp moves the data from the chunk onto the connection's output buffer.
+  if (evbuffer_get_length(chunk) > 0)
+  {
+    evhtp_send_reply_chunk(req.req(), chunk);
+  }
+}
+
+void HttpStack::send_reply_chunk_end(Request& req, int rc, SAS::TrailId trail)
+{
+  TRC_VERBOSE("Completing chunked response %d to request for URL %s, args %s",
+              rc, req.req()->uri->path->full, req.req()->uri->query_raw);
+  unsigned long latency_us = 0;
+  bool latency_valid = req.get_latency(latency_us);
+  log(std::string(req.req()->uri->path->full), req.method_as_str(), rc, latency_us);
+  record_path_stats(req, rc, latency_valid, latency_us);
+
+  evhtp_send_reply_chunk_end(req.req());
+  evhtp_request_resume(req.req());
+
+  reply_complete(req, trail);
+}
+
+void HttpStack::record_path_stats(Request& req,
+                                  int rc,
+                                  bool latency_valid,
+                                  unsigned long latency_us)
+{
+  if (req.path_stats() != NULL)
+  {
+    _path_statistics.request_complete(req.path_stats(),
+                                      req.method(),
+                                      rc,
+                                      latency_valid,
+                                      latency_us);
+
+    // Only record each request once.
+    req.set_path_stats(NULL);
+  }
+}
+
+void HttpStack::reply_complete(Request& req, SAS::TrailId trail)
+{
   // Update the latency stats and throttling algorithm if it's appropriate for
   // the request
   unsigned long latency_us = 0;
@@ -113,48 +208,101 @@ void HttpStack::initialize()
     _ev_using_pthreads = true;
   }
 
-  if (!_evbase)
+  while ((int)_event_bases.size() < _num_event_bases)
   {
-    _evbase = event_base_new();
+    _event_bases.push_back(new EventBase());
   }
 
-  if (!_evhtp)
+  for (EventBase* event_base : _event_bases)
   {
-    _evhtp = evhtp_new(_evbase, NULL);
+    if (!event_base->evbase)
+    {
+      event_base->evbase = event_base_new();
+    }
 
-    // Set a buffer read timeout of 20s to mitigate the Slowloris
-    // vulnerability. This is short enough that single attackers should be
-    // unable to block the server. We don't want to set it too short to ensure
-    // multiple sites can still talk to each other with latency involved.
-    struct timeval recv_timeo = { .tv_sec = 20, .tv_usec = 0 };
-    evhtp_set_timeouts(_evhtp, &recv_timeo, NULL);
+    if (!event_base->evhtp)
+    {
+      event_base->evhtp = evhtp_new(event_base->evbase, NULL);
+
+      // Set a buffer read timeout of 20s to mitigate the Slowloris
+      // vulnerability. This is short enough that single attackers should be
+      // unable to block the server. We don't want to set it too short to ensure
+      // multiple sites can still talk to each other with latency involved.
+      struct timeval recv_timeo = { .tv_sec = 20, .tv_usec = 0 };
+      evhtp_set_timeouts(event_base->evhtp, &recv_timeo, NULL);
+    }
   }
 }
 
 void HttpStack::register_handler(const char* path,
                                  HttpStack::HandlerInterface* handler)
 {
-  HandlerRegistration* reg = new HandlerRegistration(this, handler);
-  _handler_registrations.insert(reg);
+  HttpPathStatistics::Path* stats_path = _path_statistics.add_path(path);
 
-  evhtp_callback_t* cb = evhtp_set_regex_cb(_evhtp,
-                                            path,
-                                            handler_callback_fn,
-                                            (void*)reg);
-  if (cb == NULL)
+  for (unsigned int ii = 0; ii < _event_bases.size(); ++ii)
   {
-    throw Exception("evhtp_set_cb", 0); // LCOV_EXCL_LINE
+    EventBase* event_base = _event_bases[ii];
+    HandlerRegistration* reg = new HandlerRegistration(this,
+                                                       handler,
+                                                       event_base,
+                                                       stats_path);
+    _handler_registrations.insert(reg);
+
+    evhtp_callback_t* cb = evhtp_set_regex_cb(event_base->evhtp,
+                                              path,
+                                              handler_callback_fn,
+                                              (void*)reg);
+    if (cb == NULL)
+    {
+      throw Exception("evhtp_set_cb", 0); // LCOV_EXCL_LINE
+    }
+
+    if (handler->streams_body())
+    {
+      // Pass the body to the handler as it is read.  evhtp_hook is a generic
+      // function pointer type, so cast through void(*)(void) (which is
+      // compatible with every function type).
+      int rc = evhtp_callback_set_hook(cb,
+                                       evhtp_hook_on_read,
+                                       (evhtp_hook)(void(*)(void))body_chunk_fn,
+                                       (void*)reg);
+      if (rc != 0)
+      {
+        throw Exception("evhtp_callback_set_hook", rc); // LCOV_EXCL_LINE
+      }
+
+      // Tell the handler if the request ends before it is passed to
+      // process_request.  handler_callback removes this hook from requests
+      // that it passes on.
+      rc = evhtp_callback_set_hook(cb,
+                                   evhtp_hook_on_request_fini,
+                                   (evhtp_hook)(void(*)(void))request_fini_fn,
+                                   (void*)reg);
+      if (rc != 0)
+      {
+        throw Exception("evhtp_callback_set_hook", rc); // LCOV_EXCL_LINE
+      }
+    }
   }
 }
 
 void HttpStack::register_default_handler(HttpStack::HandlerInterface* handler)
 {
-  HandlerRegistration* reg = new HandlerRegistration(this, handler);
-  _handler_registrations.insert(reg);
+  HttpPathStatistics::Path* stats_path = _path_statistics.add_path("(default)");
 
-  evhtp_set_gencb(_evhtp,
-                  handler_callback_fn,
-                  (void*)reg);
+  for (unsigned int ii = 0; ii < _event_bases.size(); ++ii)
+  {
+    EventBase* event_base = _event_bases[ii];
+    HandlerRegistration* reg = new HandlerRegistration(this,
+                                                       handler,
+                                                       event_base,
+                                                       stats_path);
+    _handler_registrations.insert(reg);
+
+    evhtp_set_gencb(event_base->evhtp,
+                    handler_callback_fn,
+                    (void*)reg);
+  }
 }
 
 void HttpStack::bind_tcp_socket(const std::string& bind_address,
@@ -173,6 +321,38 @@ void HttpStack::bind_tcp_socket(const std::string& bind_address,
   std::string full_bind_address = bind_address;
   const int error_num = getaddrinfo(bind_address.c_str(), NULL, &hints, &servinfo);
 
+  if (_event_bases.size() > 1)
+  {
+    // Each event base needs its own socket.
+    if (error_num != 0)
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to resolve HTTP bind address %s: %s",
+                bind_address.c_str(),
+                gai_strerror(error_num));
+      throw Exception("getaddrinfo", error_num);
+      // LCOV_EXCL_STOP
+    }
+
+    try
+    {
+      for (EventBase* event_base : _event_bases)
+      {
+        bind_reuseport_socket(event_base, servinfo, port);
+      }
+    }
+    catch (...)
+    {
+      // LCOV_EXCL_START
+      freeaddrinfo(servinfo);
+      throw;
+      // LCOV_EXCL_STOP
+    }
+
+    freeaddrinfo(servinfo);
+    return;
+  }
+
   if ((error_num == 0) &&
       (servinfo->ai_family == AF_INET))
   {
@@ -197,7 +377,10 @@ void HttpStack::bind_tcp_socket(const std::string& bind_address,
 
   freeaddrinfo(servinfo);
 
-  int rc = evhtp_bind_socket(_evhtp, full_bind_address.c_str(), port, 1024);
+  int rc = evhtp_bind_socket(_event_bases[0]->evhtp,
+                             full_bind_address.c_str(),
+                             port,
+                             1024);
   if (rc != 0)
   {
     // LCOV_EXCL_START
@@ -210,6 +393,56 @@ void HttpStack::bind_tcp_socket(const std::string& bind_address,
 
 }
 
+void HttpStack::bind_reuseport_socket(EventBase* event_base,
+                                      const addrinfo* ai,
+                                      unsigned short port)
+{
+  sockaddr_storage addr;
+  memcpy(&addr, ai->ai_addr, ai->ai_addrlen);
+
+  if (ai->ai_family == AF_INET6)
+  {
+    ((sockaddr_in6*)&addr)->sin6_port = htons(port);
+  }
+  else
+  {
+    ((sockaddr_in*)&addr)->sin_port = htons(port);
+  }
+
+  int fd = socket(ai->ai_family, SOCK_STREAM, 0);
+  int on = 1;
+
+  if ((fd < 0) ||
+      (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0) ||
+      (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0) ||
+      (evutil_make_socket_nonblocking(fd) != 0) ||
+      (bind(fd, (sockaddr*)&addr, ai->ai_addrlen) != 0))
+  {
+    // LCOV_EXCL_START
+    int err = errno;
+    TRC_ERROR("Failed to bind HTTP socket on port %d: %s", port, strerror(err));
+
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+
+    throw Exception("bind (tcp)", err);
+    // LCOV_EXCL_STOP
+  }
+
+  // evhtp listens on the socket, and closes it when it is unbound.
+  int rc = evhtp_accept_socket(event_base->evhtp, fd, 1024);
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("evhtp_accept_socket failed on port %d", port);
+    close(fd);
+    throw Exception("evhtp_accept_socket (tcp)", rc);
+    // LCOV_EXCL_STOP
+  }
+}
+
 void HttpStack::bind_unix_socket(const std::string& bind_path)
 {
   TRC_STATUS("Binding HTTP unix socket: path=%s", bind_path.c_str());
@@ -220,7 +453,12 @@ void HttpStack::bind_unix_socket(const std::string& bind_path)
 
   std::string full_bind_address = "unix:" + bind_path;
 
-  int rc = evhtp_bind_socket(_evhtp, full_bind_address.c_str(), 0, 1024);
+  // Only the first event base serves unix sockets - the kernel doesn't share
+  // out unix socket connections between listeners.
+  int rc = evhtp_bind_socket(_event_bases[0]->evhtp,
+                             full_bind_address.c_str(),
+                             0,
+                             1024);
   if (rc != 0)
   {
     // LCOV_EXCL_START
@@ -238,50 +476,106 @@ void HttpStack::bind_unix_socket(const std::string& bind_path)
 // has been called
 void HttpStack::start(evhtp_thread_init_cb init_cb)
 {
-  int rc = evhtp_use_threads(_evhtp, init_cb, _num_threads, this);
-  if (rc != 0)
+  for (EventBase* event_base : _event_bases)
   {
-    throw Exception("evhtp_use_threads", rc); // LCOV_EXCL_LINE
-  }
+    int rc = evhtp_use_threads(event_base->evhtp, init_cb, _num_threads, this);
+    if (rc != 0)
+    {
+      throw Exception("evhtp_use_threads", rc); // LCOV_EXCL_LINE
+    }
 
-  rc = pthread_create(&_event_base_thread, NULL, event_base_thread_fn, this);
-  if (rc != 0)
-  {
-    // LCOV_EXCL_START
-    TRC_ERROR("pthread_create failed in HTTPStack creation");
-    throw Exception("pthread_create", rc);
-    // LCOV_EXCL_STOP
+    rc = pthread_create(&event_base->thread,
+                        NULL,
+                        event_base_thread_fn,
+                        event_base);
+    if (rc != 0)
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("pthread_create failed in HTTPStack creation");
+      throw Exception("pthread_create", rc);
+      // LCOV_EXCL_STOP
+    }
   }
 }
 
 void HttpStack::stop()
 {
   TRC_STATUS("Stopping HTTP stack");
-  event_base_loopbreak(_evbase);
-  evhtp_unbind_socket(_evhtp);
+
+  for (EventBase* event_base : _event_bases)
+  {
+    event_base_loopbreak(event_base->evbase);
+    evhtp_unbind_socket(event_base->evhtp);
+  }
 }
 
 void HttpStack::wait_stopped()
 {
   TRC_STATUS("Waiting for HTTP stack to stop");
-  pthread_join(_event_base_thread, NULL);
-  evhtp_free(_evhtp);
-  _evhtp = NULL;
-  event_base_free(_evbase);
-  _evbase = NULL;
+
+  for (unsigned int ii = 0; ii < _event_bases.size(); ++ii)
+  {
+    EventBase* event_base = _event_bases[ii];
+    pthread_join(event_base->thread, NULL);
+    TRC_STATUS("HTTP event base %d received %lu requests",
+               ii, event_base->requests.load());
+    evhtp_free(event_base->evhtp);
+    event_base->evhtp = NULL;
+    event_base_free(event_base->evbase);
+    event_base->evbase = NULL;
+  }
+}
+
+void HttpStack::get_request_counts(std::vector<uint64_t>& counts)
+{
+  counts.clear();
+
+  for (EventBase* event_base : _event_bases)
+  {
+    counts.push_back(event_base->requests.load(std::memory_order_relaxed));
+  }
 }
 
 void HttpStack::handler_callback_fn(evhtp_request_t* req, void* handler_reg_param)
 {
   HandlerRegistration* handler_reg =
     static_cast<HandlerRegistration*>(handler_reg_param);
-  handler_reg->stack->handler_callback(req, handler_reg->handler);
+  handler_reg->event_base->requests.fetch_add(1, std::memory_order_relaxed);
+  handler_reg->stack->handler_callback(req, handler_reg);
+}
+
+evhtp_res HttpStack::body_chunk_fn(evhtp_request_t* req,
+                                   evbuffer* chunk,
+                                   void* handler_reg_param)
+{
+  HandlerRegistration* handler_reg =
+    static_cast<HandlerRegistration*>(handler_reg_param);
+  Request request(handler_reg->stack, req);
+  handler_reg->handler->process_body_chunk(request, chunk);
+
+  // evhtp buffers any data that the handler has left in the chunk.
+  return EVHTP_RES_OK;
+}
+
+evhtp_res HttpStack::request_fini_fn(evhtp_request_t* req,
+                                     void* handler_reg_param)
+{
+  HandlerRegistration* handler_reg =
+    static_cast<HandlerRegistration*>(handler_reg_param);
+  TRC_DEBUG("Request for URL %s ended while its body was being streamed",
+            req->uri->path->full);
+  Request request(handler_reg->stack, req);
+  handler_reg->handler->body_aborted(request);
+  return EVHTP_RES_OK;
 }
 
 void HttpStack::handler_callback(evhtp_request_t* req,
-                                 HttpStack::HandlerInterface* handler)
+                                 HandlerRegistration* handler_reg)
 {
+  HttpStack::HandlerInterface* handler = handler_reg->handler;
   Request request(this, req);
+  request.set_path_stats(handler_reg->path_stats);
+  _path_statistics.request_started(handler_reg->path_stats, request.method());
 
   // Call into the handler to request a SAS logger that can be used to log
   // this request.  Then actually log the request.
@@ -307,6 +601,13 @@ void HttpStack::handler_callback(evhtp_request_t* req,
                 req->uri->path->full,
                 req->uri->query_raw);
 
+    if (handler->streams_body())
+    {
+      // The handler now owns any state built up from the body, so mustn't
+      // be told when the request is freed.
+      evhtp_request_set_hook(req, evhtp_hook_on_request_fini, NULL, NULL);
+    }
+
     CW_TRY
     {
       handler->process_request(request, trail);
@@ -346,17 +647,12 @@ void HttpStack::handler_callback(evhtp_request_t* req,
   }
 }
 
-void* HttpStack::event_base_thread_fn(void* http_stack_ptr)
+void* HttpStack::event_base_thread_fn(void* event_base_ptr)
 {
-  ((HttpStack*)http_stack_ptr)->event_base_thread_fn();
+  event_base_loop(((EventBase*)event_base_ptr)->evbase, 0);
   return NULL;
 }
 
-void HttpStack::event_base_thread_fn()
-{
-  event_base_loop(_evbase, 0);
-}
-
 void HttpStack::record_penalty()
 {
   if (_load_monitor != NULL)
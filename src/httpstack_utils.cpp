@@ -11,6 +11,8 @@
  */
 
 #include "httpstack_utils.h"
+#include "rapidjson/writer.h"
+#include "rapidjson/stringbuffer.h"
 
 namespace HttpStackUtils
 {
@@ -25,6 +27,116 @@ namespace HttpStackUtils
     req.send_reply(200, trail);
   }
 
+  //
+  // StatsHandler methods.
+  //
+  void StatsHandler::process_request(HttpStack::Request& req,
+                                     SAS::TrailId trail)
+  {
+    if (req.method() != htp_method_GET)
+    {
+      req.send_reply(EVHTP_RES_METHNALLOWED, trail);
+      return;
+    }
+
+    std::vector<HttpPathStatistics::Snapshot> snapshots;
+    _stack->path_statistics()->get_snapshots(snapshots);
+
+    std::vector<uint64_t> request_counts;
+    _stack->get_request_counts(request_counts);
+
+    rapidjson::StringBuffer sb;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+    writer.StartObject();
+    {
+      writer.String("event_bases");
+      writer.StartArray();
+      {
+        for (uint64_t count : request_counts)
+        {
+          writer.Uint64(count);
+        }
+      }
+      writer.EndArray();
+
+      writer.String("paths");
+      writer.StartArray();
+      {
+        for (const HttpPathStatistics::Snapshot& snapshot : snapshots)
+        {
+          writer.StartObject();
+          {
+            writer.String("path");
+            writer.String(snapshot.path.c_str());
+            writer.String("method");
+            writer.String(snapshot.method.c_str());
+            writer.String("requests");
+            writer.Uint64(snapshot.requests);
+            writer.String("in_flight");
+            writer.Int64(snapshot.in_flight);
+
+            writer.String("latency_us");
+            writer.StartObject();
+            {
+              writer.String("mean");
+              writer.Uint64(snapshot.mean_latency_us());
+              writer.String("p50");
+              writer.Uint64(snapshot.percentile_us(50));
+              writer.String("p90");
+              writer.Uint64(snapshot.percentile_us(90));
+              writer.String("p99");
+              writer.Uint64(snapshot.percentile_us(99));
+
+              // The histogram, as the number of samples below each bound.
+              // The last bucket has no upper bound.
+              writer.String("histogram");
+              writer.StartArray();
+              for (int ii = 0; ii < HttpPathStatistics::NUM_BUCKETS; ++ii)
+              {
+                writer.StartObject();
+                writer.String("lt");
+                if (ii < HttpPathStatistics::NUM_BUCKETS - 1)
+                {
+                  writer.Uint64(HttpPathStatistics::BUCKET_BASE_US << ii);
+                }
+                else
+                {
+                  writer.Null();
+                }
+                writer.String("count");
+                writer.Uint64(snapshot.latency_buckets[ii]);
+                writer.EndObject();
+              }
+              writer.EndArray();
+            }
+            writer.EndObject();
+
+            writer.String("responses");
+            writer.StartObject();
+            {
+              for (int ii = 1; ii < HttpPathStatistics::NUM_RC_CLASSES; ++ii)
+              {
+                std::string rc_class = std::to_string(ii) + "xx";
+                writer.String(rc_class.c_str());
+                writer.Uint64(snapshot.responses[ii]);
+              }
+            }
+            writer.EndObject();
+          }
+          writer.EndObject();
+        }
+      }
+      writer.EndArray();
+    }
+    writer.EndObject();
+
+    req.add_content(sb.GetString());
+    req.add_header("Content-Type", "application/json");
+    req.set_track_latency(false);
+    req.send_reply(200, trail);
+  }
+
   //
   // HandlerThreadPool methods.
   //
@@ -35,6 +147,8 @@ namespace HttpStackUtils
           exception_handler,
           &exception_callback,
           max_queue),
+    _params_lock(PTHREAD_MUTEX_INITIALIZER),
+    _free_params(NULL),
     _wrappers()
   {
     _pool.start();
@@ -45,7 +159,7 @@ namespace HttpStackUtils
   {
     // Create a new wrapper around the specific handler and record it in
     // the wrappers vector.
-    Wrapper* wrapper = new Wrapper(&_pool, handler);
+    Wrapper* wrapper = new Wrapper(this, &_pool, handler);
     _wrappers.push_back(wrapper);
     return wrapper;
   }
@@ -65,6 +179,49 @@ namespace HttpStackUtils
     // Terminate the thread pool.
     _pool.stop();
     _pool.join();
+
+    // Free the pooled request objects.
+    while (_free_params != NULL)
+    {
+      RequestParams* params = _free_params;
+      _free_params = params->next;
+      delete params; params = NULL;
+    }
+
+    pthread_mutex_destroy(&_params_lock);
+  }
+
+  HandlerThreadPool::RequestParams* HandlerThreadPool::get_params()
+  {
+    pthread_mutex_lock(&_params_lock);
+    RequestParams* params = _free_params;
+
+    if (params != NULL)
+    {
+      _free_params = params->next;
+    }
+
+    pthread_mutex_unlock(&_params_lock);
+
+    if (params == NULL)
+    {
+      // The pool only grows to the number of requests that are in flight at
+      // once, after which no more objects are allocated.
+      params = new RequestParams(this);
+    }
+
+    params->next = NULL;
+    return params;
+  }
+
+  void HandlerThreadPool::release_params(RequestParams* params)
+  {
+    params->handler = NULL;
+
+    pthread_mutex_lock(&_params_lock);
+    params->next = _free_params;
+    _free_params = params;
+    pthread_mutex_unlock(&_params_lock);
   }
 
   HandlerThreadPool::Pool::Pool(unsigned int num_threads,
@@ -81,23 +238,27 @@ namespace HttpStackUtils
     process_work(HttpStackUtils::HandlerThreadPool::RequestParams*& params)
   {
     params->handler->process_request(params->request, params->trail);
-    delete params; params = NULL;
+    params->owner->release_params(params); params = NULL;
   }
 
-  HandlerThreadPool::Wrapper::Wrapper(Pool* pool,
+  HandlerThreadPool::Wrapper::Wrapper(HandlerThreadPool* owner,
+                                      Pool* pool,
                                       HandlerInterface* handler) :
-    _pool(pool), _handler(handler)
+    _owner(owner), _pool(pool), _handler(handler)
   {}
 
-  // Implementation of HandlerInterface::process_request().  This builds a
-  // RequestParams object (containing the parameters the function was called
-  // with, and a pointer to the underlying handler) and sends it to the
-  // thread pool.
+  // Implementation of HandlerInterface::process_request().  This fills in a
+  // pooled RequestParams object (containing the parameters the function was
+  // called with, and a pointer to the underlying handler) and sends it to the
+  // thread pool.  The request is moved rather than copied - the HttpStack
+  // doesn't use it again once the handler has been called.
   void HandlerThreadPool::Wrapper::process_request(HttpStack::Request& req,
                                                    SAS::TrailId trail)
   {
-    HandlerThreadPool::RequestParams* params =
-      new HandlerThreadPool::RequestParams(_handler, req, trail);
+    HandlerThreadPool::RequestParams* params = _owner->get_params();
+    params->handler = _handler;
+    params->request = std::move(req);
+    params->trail = trail;
     _pool->add_work(params);
   }
 
@@ -109,6 +270,22 @@ namespace HttpStackUtils
     return _handler->sas_logger(req);
   }
 
+  bool HandlerThreadPool::Wrapper::streams_body()
+  {
+    return _handler->streams_body();
+  }
+
+  void HandlerThreadPool::Wrapper::process_body_chunk(HttpStack::Request& req,
+                                                      evbuffer* chunk)
+  {
+    _handler->process_body_chunk(req, chunk);
+  }
+
+  void HandlerThreadPool::Wrapper::body_aborted(HttpStack::Request& req)
+  {
+    _handler->body_aborted(req);
+  }
+
   //
   // Chronos utilities.
   //
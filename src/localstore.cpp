@@ -11,8 +11,7 @@
 
 // Common STL includes.
 #include <cassert>
-#include <map>
-#include <list>
+#include <functional>
 #include <string>
 
 #include <time.h>
@@ -22,14 +21,61 @@
 #include "localstore.h"
 
 
+LocalStore::Shard::Shard() :
+  lock(PTHREAD_MUTEX_INITIALIZER),
+  db(),
+  old_db(),
+  expiries()
+{
+}
+
+
+LocalStore::Shard::~Shard()
+{
+  pthread_mutex_destroy(&lock);
+}
+
+
+void LocalStore::Shard::sweep(uint32_t now, size_t max)
+{
+  while ((max > 0) &&
+         (!expiries.empty()) &&
+         (expiries.top().first < now))
+  {
+    const ExpiryEntry& entry = expiries.top();
+    Records::iterator i = db.find(entry.second);
+
+    if ((i != db.end()) && (i->second.expiry == entry.first))
+    {
+      TRC_DEBUG("Sweeping expired record %s", entry.second.c_str());
+      db.erase(i);
+      --max;
+    }
+
+    expiries.pop();
+  }
+
+  // The heap holds an entry per write, not per record, so rebuild it if it
+  // has got much bigger than the number of records it covers.
+  if (expiries.size() > (2 * db.size()) + 64)
+  {
+    ExpiryHeap rebuilt;
+
+    for (const std::pair<const std::string, Record>& record : db)
+    {
+      rebuilt.push(ExpiryEntry(record.second.expiry, record.first));
+    }
+
+    expiries.swap(rebuilt);
+  }
+}
+
+
 LocalStore::LocalStore() :
   _data_contention_flag(false),
-  _db_lock(PTHREAD_MUTEX_INITIALIZER),
-  _db(),
   _force_error_on_set_flag(false),
   _force_error_on_get_flag(false),
-  _force_error_on_delete_flag(false),
-  _old_db()
+  _force_error_on_delete_flag(false)
 {
   TRC_DEBUG("Created local store");
 }
@@ -38,17 +84,35 @@ LocalStore::LocalStore() :
 LocalStore::~LocalStore()
 {
   flush_all();
-  pthread_mutex_destroy(&_db_lock);
 }
 
 
 void LocalStore::flush_all()
 {
-  pthread_mutex_lock(&_db_lock);
   TRC_DEBUG("Flushing local store");
-  _db.clear();
-  _old_db.clear();
-  pthread_mutex_unlock(&_db_lock);
+
+  for (size_t ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    Shard& shard = _shards[ii];
+    pthread_mutex_lock(&shard.lock);
+    shard.db.clear();
+    shard.old_db.clear();
+    ExpiryHeap().swap(shard.expiries);
+    pthread_mutex_unlock(&shard.lock);
+  }
+}
+
+LocalStore::Shard& LocalStore::get_shard(const std::string& table,
+                                         const std::string& key,
+                                         std::string& fqkey)
+{
+  fqkey.reserve(table.length() + 2 + key.length());
+  fqkey.append(table).append("\\\\").append(key);
+
+  // Don't use the lowest bits of the hash to pick the shard, as they're also
+  // used to pick the bucket within the shard's map.
+  size_t hash = std::hash<std::string>()(fqkey);
+  return _shards[(hash >> 16) & (NUM_SHARDS - 1)];
 }
 
 //This function sets a flag to true that tells the program to simulate data
@@ -96,32 +160,28 @@ Store::Status LocalStore::get_data(const std::string& table,
 
   // This is for the purpose of testing data GETs failing.  If the flag is set
   // to true, then we'll just return an error.
-  if (_force_error_on_get_flag)
+  if (_force_error_on_get_flag.exchange(false))
   {
     TRC_DEBUG("Force an error on the GET");
-    _force_error_on_get_flag = false;
     return Store::Status::ERROR;
   }
 
   // Calculate the fully qualified key.
-  std::string fqkey = table + "\\\\" + key;
+  std::string fqkey;
+  Shard& shard = get_shard(table, key, fqkey);
 
-  pthread_mutex_lock(&_db_lock);
+  pthread_mutex_lock(&shard.lock);
 
   // This is for the purposes of testing data contention. If the flag is set to
-  // true _db_in_use will become a reference to _old_db the out-of-date
-  // database we constructed in set_data().
-  std::map<std::string, Record>& _db_in_use = _data_contention_flag ? _old_db : _db;
-  if (_data_contention_flag)
-  {
-    _data_contention_flag = false;
-  }
+  // true _db_in_use will become a reference to the shard's old_db, the
+  // out-of-date database we constructed in set_data().
+  Records& _db_in_use = _data_contention_flag.exchange(false) ? shard.old_db : shard.db;
 
   uint32_t now = time(NULL);
 
   TRC_DEBUG("Search store for key %s", fqkey.c_str());
 
-  std::map<std::string, Record>::iterator i = _db_in_use.find(fqkey);
+  Records::iterator i = _db_in_use.find(fqkey);
   if (i != _db_in_use.end())
   {
     // Found an existing record, so check the expiry.
@@ -144,7 +204,7 @@ Store::Status LocalStore::get_data(const std::string& table,
     }
   }
 
-  pthread_mutex_unlock(&_db_lock);
+  pthread_mutex_unlock(&shard.lock);
 
   TRC_DEBUG("get_data status = %d", status);
 
@@ -200,26 +260,28 @@ Store::Status LocalStore::set_data_inner(const std::string& table,
 
   // This is for the purpose of testing data SETs failing.  If the flag is set
   // to true, then we'll just return an error.
-  if (_force_error_on_set_flag)
+  if (_force_error_on_set_flag.exchange(false))
   {
     TRC_DEBUG("Force an error on the SET");
-    _force_error_on_set_flag = false;
-
     return Store::Status::ERROR;
   }
 
   // Calculate the fully qualified key.
-  std::string fqkey = table + "\\\\" + key;
+  std::string fqkey;
+  Shard& shard = get_shard(table, key, fqkey);
 
-  pthread_mutex_lock(&_db_lock);
+  pthread_mutex_lock(&shard.lock);
 
   uint32_t now = time(NULL);
 
+  // Clear out some expired records while we hold the lock.
+  shard.sweep(now, SWEEP_BATCH);
+
   TRC_DEBUG("Search store for key %s", fqkey.c_str());
 
-  std::map<std::string, Record>::iterator i = _db.find(fqkey);
+  Records::iterator i = shard.db.find(fqkey);
 
-  if (i != _db.end())
+  if (i != shard.db.end())
   {
     // Found an existing record, so check the expiry and CAS value.
     Record& r = i->second;
@@ -234,13 +296,14 @@ Store::Status LocalStore::set_data_inner(const std::string& table,
       // CAS matches, or record has expired and CAS is zero), or we aren't
       // checking CAS values so update the record.
 
-      // This writes data this is one update out-of-date to _old_db. This is for
+      // This writes data this is one update out-of-date to old_db. This is for
       // the purposes of simulating data contention in Unit Testing.
-      _old_db[fqkey] = r;
+      shard.old_db[fqkey] = r;
 
       r.data = data;
       r.cas = check_cas ? ++cas : (r.cas + 1);
       r.expiry = (expiry == 0) ? 0 : (uint32_t)expiry + now;
+      shard.expiries.push(ExpiryEntry(r.expiry, fqkey));
       status = Store::Status::OK;
       TRC_DEBUG("CAS is consistent, updated record, CAS = %lu, expiry = %u (now = %u)",
                 r.cas, r.expiry, now);
@@ -249,16 +312,17 @@ Store::Status LocalStore::set_data_inner(const std::string& table,
   else if (cas == 0)
   {
     // No existing record and supplied CAS is zero, so add a new record.
-    Record& r = _db[fqkey];
+    Record& r = shard.db[fqkey];
     r.data = data;
     r.cas = 1;
     r.expiry = (expiry == 0) ? 0 : (uint32_t)expiry + now;
+    shard.expiries.push(ExpiryEntry(r.expiry, fqkey));
     status = Store::Status::OK;
     TRC_DEBUG("No existing record so inserted new record, CAS = %lu, expiry = %u (now = %u)",
               r.cas, r.expiry, now);
   }
 
-  pthread_mutex_unlock(&_db_lock);
+  pthread_mutex_unlock(&shard.lock);
   return status;
 }
 
@@ -271,40 +335,46 @@ Store::Status LocalStore::delete_data(const std::string& table,
 
   // This is for the purpose of testing data DELETEs failing.  If the flag is set
   // to true, then we'll just return an error.
-  if (_force_error_on_delete_flag)
+  if (_force_error_on_delete_flag.exchange(false))
   {
     TRC_DEBUG("Force an error on the DELETE");
-    _force_error_on_delete_flag = false;
-
     return Store::Status::ERROR;
   }
 
   Store::Status status = Store::Status::OK;
 
   // Calculate the fully qualified key.
-  std::string fqkey = table + "\\\\" + key;
+  std::string fqkey;
+  Shard& shard = get_shard(table, key, fqkey);
 
-  pthread_mutex_lock(&_db_lock);
+  pthread_mutex_lock(&shard.lock);
 
-  _db.erase(fqkey);
+  shard.db.erase(fqkey);
 
-  pthread_mutex_unlock(&_db_lock);
+  pthread_mutex_unlock(&shard.lock);
 
   return status;
 }
 
 void LocalStore::swap_dbs(LocalStore* rhs)
 {
-  // Grab both DB locks. Technically this could cause a deadlock (if another
-  // thread calls swap_dbs on the rhs) but we only use this in test code
-  // anyway.
-  pthread_mutex_lock(&_db_lock);
-  pthread_mutex_lock(&rhs->_db_lock);
+  // Grab both DB locks for each shard in turn. Technically this could cause a
+  // deadlock (if another thread calls swap_dbs on the rhs) but we only use
+  // this in test code anyway.
+  for (size_t ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    Shard& shard = _shards[ii];
+    Shard& rhs_shard = rhs->_shards[ii];
 
-  std::swap(_db, rhs->_db);
-  std::swap(_old_db, rhs->_old_db);
+    pthread_mutex_lock(&shard.lock);
+    pthread_mutex_lock(&rhs_shard.lock);
 
-  pthread_mutex_unlock(&rhs->_db_lock);
-  pthread_mutex_unlock(&_db_lock);
+    std::swap(shard.db, rhs_shard.db);
+    std::swap(shard.old_db, rhs_shard.old_db);
+    std::swap(shard.expiries, rhs_shard.expiries);
+
+    pthread_mutex_unlock(&rhs_shard.lock);
+    pthread_mutex_unlock(&shard.lock);
+  }
 }
 
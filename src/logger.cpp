@@ -20,8 +20,11 @@
 #include <pthread.h>
 #include <execinfo.h>
 #include <string.h>
+#include <limits.h>
+#include <sys/uio.h>
 
 // Common STL includes.
+#include <algorithm>
 #include <cassert>
 #include <vector>
 #include <map>
@@ -102,6 +105,93 @@ void Logger::write(const char* data)
   pthread_mutex_lock(&_lock);
   pthread_cleanup_push(Logger::release_lock, this);
 
+  if (prepare_log_file(ts))
+  {
+    // We have a valid log file open, so write the log.
+    write_log_file(data, ts);
+  }
+  else
+  {
+    // No valid log file, so count this as a discard.
+    ++_discards;
+  }
+
+  pthread_cleanup_pop(0);
+  pthread_mutex_unlock(&_lock);
+}
+
+
+/// Writes a batch of logs to the logfile with a single system call.
+void Logger::write_batch(const struct iovec* iov, int iovcnt)
+{
+  timestamp_t ts;
+  get_timestamp(ts);
+
+  pthread_mutex_lock(&_lock);
+  pthread_cleanup_push(Logger::release_lock, this);
+
+  if (prepare_log_file(ts))
+  {
+    // Anything buffered by stdio must be written first to keep the logs in
+    // order.
+    fflush(_fd);
+    int fd = fileno(_fd);
+
+    // Copy the iovecs, as a partial write means adjusting them.
+    std::vector<struct iovec> remaining(iov, iov + iovcnt);
+    struct iovec* next = remaining.data();
+    int count = iovcnt;
+
+    while (count > 0)
+    {
+      ssize_t written = ::writev(fd, next, std::min(count, IOV_MAX));
+
+      if (written < 0)
+      {
+        // LCOV_EXCL_START
+        if (errno == EINTR)
+        {
+          continue;
+        }
+
+        // Close the file so that it is reopened for the next write.
+        _discards += count;
+        fclose(_fd);
+        _fd = NULL;
+        break;
+        // LCOV_EXCL_STOP
+      }
+
+      // Skip over the iovecs that have been completely written, and trim
+      // the first one that hasn't.
+      while ((count > 0) && ((size_t)written >= next->iov_len))
+      {
+        written -= next->iov_len;
+        ++next;
+        --count;
+      }
+
+      if (count > 0)
+      {
+        next->iov_base = (char*)next->iov_base + written;
+        next->iov_len -= written;
+      }
+    }
+  }
+  else
+  {
+    // No valid log file, so count these as discards.
+    _discards += iovcnt;
+  }
+
+  pthread_cleanup_pop(0);
+  pthread_mutex_unlock(&_lock);
+}
+
+
+/// Opens or cycles the log file if needed.
+bool Logger::prepare_log_file(const timestamp_t& ts)
+{
   bool cycle_log_file_required = false;
 
   if (_fd == NULL)
@@ -152,19 +242,7 @@ void Logger::write(const char* data)
     }
   }
 
-  if (_fd != NULL)
-  {
-    // We have a valid log file open, so write the log.
-    write_log_file(data, ts);
-  }
-  else
-  {
-    // No valid log file, so count this as a discard.
-    ++_discards;
-  }
-
-  pthread_cleanup_pop(0);
-  pthread_mutex_unlock(&_lock);
+  return (_fd != NULL);
 }
 
 
@@ -23,10 +23,12 @@
 #include <fstream>
 #include <iomanip>
 #include <algorithm>
+#include <string.h>
 #include <time.h>
 
 #include "log.h"
 #include "utils.h"
+#include "cond_var.h"
 #include "updater.h"
 #include "memcachedstoreview.h"
 #include "memcachedstore.h"
@@ -35,6 +37,23 @@
 /// The data used in memcached to represent a tombstone.
 static const std::string TOMBSTONE = "";
 
+/// Whether the current thread is one of a store's asynchronous workers.
+/// Hedged GETs wait on the worker pool, so they are not used from a worker.
+static thread_local bool on_worker_thread = false;
+
+/// Build the description of a memcached operation on a key, as passed to
+/// CW_IO_STARTS, in a single allocation.
+static std::string io_description(const char* operation,
+                                  const char* key_ptr,
+                                  size_t key_len)
+{
+  size_t operation_len = strlen(operation);
+  std::string description;
+  description.reserve(operation_len + key_len);
+  description.append(operation, operation_len).append(key_ptr, key_len);
+  return description;
+}
+
 BaseMemcachedStore::BaseMemcachedStore(bool binary,
                                        bool remote_store,
                                        BaseCommunicationMonitor* comm_monitor,
@@ -42,7 +61,10 @@ BaseMemcachedStore::BaseMemcachedStore(bool binary,
   _binary(binary),
   _options(),
   _comm_monitor(comm_monitor),
-  _tombstone_lifetime(200)
+  _tombstone_lifetime(200),
+  _compressor(new ValueCompressor()),
+  _compress_writes(false),
+  _stats(NULL)
 {
   // Set up the fixed options for memcached.  See also the options configured
   // on the MemcachedConnectionPool (including the connect timeout).
@@ -72,6 +94,83 @@ BaseMemcachedStore::BaseMemcachedStore(bool binary,
 
 BaseMemcachedStore::~BaseMemcachedStore()
 {
+  delete _compressor; _compressor = NULL;
+}
+
+void BaseMemcachedStore::configure_compression(const std::string& dictionary,
+                                               bool compress_writes,
+                                               size_t min_length)
+{
+  TRC_STATUS("Configuring memcached value compression");
+  TRC_STATUS("  Compress writes: %s", compress_writes ? "yes" : "no");
+  TRC_STATUS("  Dictionary:      %d bytes", dictionary.length());
+  TRC_STATUS("  Min length:      %d bytes", min_length);
+  delete _compressor;
+  _compressor = new ValueCompressor(dictionary, min_length);
+  _compress_writes = compress_writes;
+}
+
+const std::string& BaseMemcachedStore::encode_value(const std::string& data,
+                                                    std::string& buffer,
+                                                    uint32_t& flags)
+{
+  // Tombstones are empty so are never compressed, which means they can still
+  // be recognised by just comparing the stored data with TOMBSTONE.
+  if ((_compress_writes) && (_compressor->compress(data, buffer)))
+  {
+    flags = ValueCompressor::FLAG;
+    return buffer;
+  }
+
+  flags = 0;
+  return data;
+}
+
+void BaseMemcachedStore::record_operation(const std::string& table,
+                                          const char* operation,
+                                          Utils::StopWatch& stopwatch,
+                                          unsigned int attempts)
+{
+  unsigned long latency_us = 0;
+
+  if ((_stats != NULL) && (stopwatch.stop()) && (stopwatch.read(latency_us)))
+  {
+    _stats->record_operation(table, operation, latency_us, attempts);
+  }
+}
+
+void BaseMemcachedStore::record_replica_result(const AddrInfo& target,
+                                               Utils::StopWatch& stopwatch,
+                                               memcached_return_t rc)
+{
+  unsigned long latency_us = 0;
+
+  if ((_stats != NULL) && (stopwatch.stop()) && (stopwatch.read(latency_us)))
+  {
+    // Only count errors that mean something is wrong with the replica, not
+    // (for example) "not found" or CAS contention.
+    bool error = ((!memcached_success(rc)) &&
+                  (rc != MEMCACHED_NOTFOUND) &&
+                  (rc != MEMCACHED_NOTSTORED) &&
+                  (rc != MEMCACHED_DATA_EXISTS));
+    _stats->record_replica_result(target.address_and_port_to_string(),
+                                  latency_us,
+                                  error);
+  }
+}
+
+bool BaseMemcachedStore::decode_value(uint32_t flags, std::string& data)
+{
+  bool success = true;
+
+  if (flags & ValueCompressor::FLAG)
+  {
+    std::string value;
+    success = _compressor->decompress(data, value);
+    data.swap(value);
+  }
+
+  return success;
 }
 
 static void log_targets(std::vector<AddrInfo> targets)
@@ -88,14 +187,20 @@ memcached_return_t BaseMemcachedStore::get_from_replica(memcached_st* replica,
                                                         const char* key_ptr,
                                                         const size_t key_len,
                                                         std::string& data,
-                                                        uint64_t& cas)
+                                                        uint64_t& cas,
+                                                        uint32_t* flags)
 {
   memcached_return_t rc = MEMCACHED_ERROR;
   cas = 0;
 
+  if (flags != NULL)
+  {
+    *flags = 0;
+  }
+
   // We must use memcached_mget because memcached_get does not retrieve CAS
   // values.
-  CW_IO_STARTS("Memcached GET for " + std::string(key_ptr, key_len))
+  CW_IO_STARTS(io_description("Memcached GET for ", key_ptr, key_len))
   {
     rc = memcached_mget(replica, &key_ptr, &key_len, 1);
   }
@@ -108,7 +213,7 @@ memcached_return_t BaseMemcachedStore::get_from_replica(memcached_st* replica,
     memcached_result_st result;
     memcached_result_create(replica, &result);
 
-    CW_IO_STARTS("Memcached GET fetch result for " + std::string(key_ptr, key_len))
+    CW_IO_STARTS(io_description("Memcached GET fetch result for ", key_ptr, key_len))
     {
       memcached_fetch_result(replica, &result, &rc);
     }
@@ -125,6 +230,11 @@ memcached_return_t BaseMemcachedStore::get_from_replica(memcached_st* replica,
       data.assign(memcached_result_value(&result),
                   memcached_result_length(&result));
       cas = memcached_result_cas(&result);
+
+      if (flags != NULL)
+      {
+        *flags = memcached_result_flags(&result);
+      }
     }
 
     memcached_result_free(&result);
@@ -157,7 +267,7 @@ memcached_return_t BaseMemcachedStore::add_overwriting_tombstone(memcached_st* r
     if (cas == 0)
     {
       TRC_DEBUG("Attempting memcached ADD command");
-      CW_IO_STARTS("Memcached ADD for " + std::string(key_ptr, key_len))
+      CW_IO_STARTS(io_description("Memcached ADD for ", key_ptr, key_len))
       {
         rc = memcached_add_vb(replica,
                               key_ptr,
@@ -173,7 +283,7 @@ memcached_return_t BaseMemcachedStore::add_overwriting_tombstone(memcached_st* r
     else
     {
       TRC_DEBUG("Attempting memcached CAS command (cas = %d)", cas);
-      CW_IO_STARTS("Memcached CAS for " + std::string(key_ptr, key_len))
+      CW_IO_STARTS(io_description("Memcached CAS for ", key_ptr, key_len))
       {
         rc = memcached_cas_vb(replica,
                               key_ptr,
@@ -277,21 +387,162 @@ TopologyNeutralMemcachedStore(const std::string& target_domain,
   _target_domain(target_domain),
   _resolver(resolver),
   _attempts(2),
-  _conn_pool(60, _options, remote_store)
+  _conn_pool(60, _options, remote_store),
+  _exception_handler(NULL),
+  _num_threads(0),
+  _max_queue(0),
+  _thread_pool(NULL),
+  _pool_running(false),
+  _hedge_delay_ms(-1)
+{
+}
+
+TopologyNeutralMemcachedStore::~TopologyNeutralMemcachedStore()
+{
+  if (_thread_pool != NULL)
+  {
+    _thread_pool->stop();
+    _thread_pool->join();
+    delete _thread_pool; _thread_pool = NULL;
+  }
+}
+
+void TopologyNeutralMemcachedStore::configure_workers(ExceptionHandler* exception_handler,
+                                                      unsigned int num_threads,
+                                                      unsigned int max_queue)
+{
+  TRC_STATUS("Configuring memcached store worker pool");
+  TRC_STATUS("  Threads:   %u", num_threads);
+  TRC_STATUS("  Max Queue: %u", max_queue);
+  _exception_handler = exception_handler;
+  _num_threads = num_threads;
+  _max_queue = max_queue;
+}
+
+bool TopologyNeutralMemcachedStore::start()
 {
+  bool success = true;
+
+  if ((_num_threads > 0) && (_thread_pool == NULL))
+  {
+    _thread_pool = new FunctorThreadPool(_num_threads,
+                                         _exception_handler,
+                                         exception_callback,
+                                         _max_queue);
+    success = _thread_pool->start();
+    _pool_running = success;
+  }
+
+  return success;
+}
+
+void TopologyNeutralMemcachedStore::stop()
+{
+  if (_thread_pool != NULL)
+  {
+    // Stop hedging GETs before purging the queue - see
+    // queue_hedged_get_leg().
+    _pool_running = false;
+    _thread_pool->stop();
+  }
+}
+
+void TopologyNeutralMemcachedStore::wait_stopped()
+{
+  if (_thread_pool != NULL)
+  {
+    _thread_pool->join();
+  }
+}
+
+void TopologyNeutralMemcachedStore::do_async(std::function<void()> work)
+{
+  if (_thread_pool != NULL)
+  {
+    _thread_pool->add_work([work]() {
+      on_worker_thread = true;
+      work();
+    });
+  }
+  else
+  {
+    TRC_DEBUG("No memcached worker pool - process request synchronously");
+    work();
+  }
+}
+
+void TopologyNeutralMemcachedStore::get_data_async(const std::string& table,
+                                                   const std::string& key,
+                                                   SAS::TrailId trail,
+                                                   GetCallback callback)
+{
+  // The lambdas below capture their parameters by value, as the caller's
+  // copies may have gone by the time a worker thread picks the request up.
+  do_async([this, table, key, trail, callback]() {
+    std::string data;
+    uint64_t cas = 0;
+    Store::Status status = get_data(table, key, data, cas, trail);
+    callback(status, data, cas);
+  });
+}
+
+void TopologyNeutralMemcachedStore::set_data_async(const std::string& table,
+                                                   const std::string& key,
+                                                   const std::string& data,
+                                                   uint64_t cas,
+                                                   int expiry,
+                                                   SAS::TrailId trail,
+                                                   StatusCallback callback)
+{
+  do_async([this, table, key, data, cas, expiry, trail, callback]() {
+    callback(set_data(table, key, data, cas, expiry, trail));
+  });
+}
+
+void TopologyNeutralMemcachedStore::set_data_without_cas_async(const std::string& table,
+                                                               const std::string& key,
+                                                               const std::string& data,
+                                                               int expiry,
+                                                               SAS::TrailId trail,
+                                                               StatusCallback callback)
+{
+  do_async([this, table, key, data, expiry, trail, callback]() {
+    callback(set_data_without_cas(table, key, data, expiry, trail, true));
+  });
+}
+
+void TopologyNeutralMemcachedStore::delete_data_async(const std::string& table,
+                                                      const std::string& key,
+                                                      SAS::TrailId trail,
+                                                      StatusCallback callback)
+{
+  do_async([this, table, key, trail, callback]() {
+    callback(delete_data(table, key, trail));
+  });
 }
 
 memcached_return_t TopologyNeutralMemcachedStore::iterate_through_targets(
     std::vector<AddrInfo>& targets,
     SAS::TrailId trail,
-    std::function<memcached_return_t(ConnectionHandle<memcached_st*>&)> fn)
+    std::function<memcached_return_t(ConnectionHandle<memcached_st*>&)> fn,
+    unsigned int* attempts)
 {
   memcached_return_t rc = MEMCACHED_SUCCESS;
 
+  if (attempts != NULL)
+  {
+    *attempts = 0;
+  }
+
   for (size_t ii = 0; ii < targets.size(); ++ii)
   {
     AddrInfo& target = targets[ii];
 
+    if (attempts != NULL)
+    {
+      ++(*attempts);
+    }
+
     TRC_DEBUG("Try server IP %s, port %d",
               target.address.to_string().c_str(),
               target.port);
@@ -303,7 +554,10 @@ memcached_return_t TopologyNeutralMemcachedStore::iterate_through_targets(
     ConnectionHandle<memcached_st*> conn = _conn_pool.get_connection(target);
 
     // This is where we actually talk to memcached.
+    Utils::StopWatch stopwatch;
+    stopwatch.start();
     rc = fn(conn);
+    record_replica_result(target, stopwatch, rc);
 
     TRC_DEBUG("libmemcached returned %d", rc);
 
@@ -330,6 +584,301 @@ memcached_return_t TopologyNeutralMemcachedStore::iterate_through_targets(
   return rc;
 }
 
+void TopologyNeutralMemcachedStore::set_hedged_reads(int hedge_delay_ms)
+{
+  TRC_STATUS("Memcached hedged read delay: %d ms", hedge_delay_ms);
+  _hedge_delay_ms = hedge_delay_ms;
+}
+
+struct TopologyNeutralMemcachedStore::HedgedGetState
+{
+  HedgedGetState() :
+    lock(PTHREAD_MUTEX_INITIALIZER),
+    cond(&lock),
+    complete(false),
+    winner(-1)
+  {
+    for (int ii = 0; ii < 2; ++ii)
+    {
+      finished[ii] = false;
+      ran[ii] = false;
+      rc[ii] = MEMCACHED_ERROR;
+      cas[ii] = 0;
+      flags[ii] = 0;
+    }
+  }
+
+  ~HedgedGetState()
+  {
+    pthread_mutex_destroy(&lock);
+  }
+
+  pthread_mutex_t lock;
+  CondVar cond;
+
+  // Set once one of the legs has a definitive answer.  Any leg that has not
+  // started by then is abandoned.
+  bool complete;
+  int winner;
+
+  // Whether each leg has finished (either by querying its target or by being
+  // abandoned or discarded), and whether it actually queried its target.
+  bool finished[2];
+  bool ran[2];
+
+  // The result of each leg.
+  memcached_return_t rc[2];
+  std::string data[2];
+  uint64_t cas[2];
+  uint32_t flags[2];
+};
+
+struct TopologyNeutralMemcachedStore::HedgedGetLeg
+{
+  HedgedGetLeg(std::shared_ptr<HedgedGetState> state, int index) :
+    state(state),
+    index(index)
+  {
+  }
+
+  ~HedgedGetLeg()
+  {
+    pthread_mutex_lock(&state->lock);
+
+    if (!state->finished[index])
+    {
+      TRC_DEBUG("Hedged GET leg %d discarded", index);
+      state->finished[index] = true;
+      state->cond.broadcast();
+    }
+
+    pthread_mutex_unlock(&state->lock);
+  }
+
+  std::shared_ptr<HedgedGetState> state;
+  int index;
+};
+
+bool TopologyNeutralMemcachedStore::queue_hedged_get_leg(std::shared_ptr<HedgedGetState> state,
+                                                         int index,
+                                                         const AddrInfo& target,
+                                                         const std::string& fqkey,
+                                                         SAS::TrailId trail)
+{
+  // The work item holds the leg, so if it is purged from the queue when the
+  // pool is stopped the leg is marked as finished.
+  std::shared_ptr<HedgedGetLeg> leg = std::make_shared<HedgedGetLeg>(state, index);
+
+  _thread_pool->add_work([this, leg, target, fqkey, trail]() {
+    hedged_get_from_target(leg->state, leg->index, target, fqkey, trail);
+  });
+
+  // stop() clears _pool_running before purging the queue.  If the pool is
+  // still running now, any purge comes after the work item was queued, so
+  // either the leg runs or it is discarded and marked as finished.
+  // Otherwise, the work item may sit on the stopped pool's queue forever.
+  return _pool_running.load();
+}
+
+memcached_return_t TopologyNeutralMemcachedStore::hedged_get(std::vector<AddrInfo>& targets,
+                                                             const std::string& fqkey,
+                                                             std::string& data,
+                                                             uint64_t& cas,
+                                                             uint32_t& flags,
+                                                             SAS::TrailId trail)
+{
+  memcached_return_t rc = MEMCACHED_ERROR;
+
+  // The workers hold their own references to the state as they may still be
+  // running (or queued) after this GET has returned.
+  std::shared_ptr<HedgedGetState> state = std::make_shared<HedgedGetState>();
+  bool pool_running = queue_hedged_get_leg(state, 0, targets[0], fqkey, trail);
+
+  pthread_mutex_lock(&state->lock);
+
+  if ((pool_running) && (_hedge_delay_ms > 0))
+  {
+    // Wait for the hedge delay before sending to the second target, but
+    // give up early if the first target answers, and send early if it
+    // fails.  This thread is waiting for the answer anyway, so it acts as
+    // the hedge timer - no worker thread is tied up waiting.
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += _hedge_delay_ms / 1000;
+    deadline.tv_nsec += (_hedge_delay_ms % 1000) * 1000000;
+
+    if (deadline.tv_nsec >= 1000000000)
+    {
+      deadline.tv_sec += 1;
+      deadline.tv_nsec -= 1000000000;
+    }
+
+    while ((!state->complete) &&
+           (!state->finished[0]) &&
+           (state->cond.timedwait(&deadline) != ETIMEDOUT))
+    {
+    }
+  }
+
+  if (!state->complete)
+  {
+    pthread_mutex_unlock(&state->lock);
+    pool_running = (pool_running) &&
+                   (queue_hedged_get_leg(state, 1, targets[1], fqkey, trail));
+    pthread_mutex_lock(&state->lock);
+  }
+  else
+  {
+    state->finished[1] = true;
+  }
+
+  if (pool_running)
+  {
+    while ((!state->complete) && !(state->finished[0] && state->finished[1]))
+    {
+      state->cond.wait();
+    }
+  }
+
+  // Mark the GET complete so that a leg that hasn't started doesn't bother.
+  state->complete = true;
+  int winner = state->winner;
+  std::vector<AddrInfo> remaining;
+
+  if (winner >= 0)
+  {
+    rc = state->rc[winner];
+    data = state->data[winner];
+    cas = state->cas[winner];
+    flags = state->flags[winner];
+  }
+  else
+  {
+    // Retry any of the first two targets that weren't queried (because the
+    // pool was stopped), followed by the rest of the targets.
+    for (int ii = 0; ii < 2; ++ii)
+    {
+      if ((!pool_running) || (!state->ran[ii]))
+      {
+        remaining.push_back(targets[ii]);
+      }
+      else
+      {
+        rc = state->rc[ii];
+      }
+    }
+
+    remaining.insert(remaining.end(), targets.begin() + 2, targets.end());
+  }
+
+  pthread_mutex_unlock(&state->lock);
+
+  if (winner >= 0)
+  {
+    TRC_DEBUG("Hedged GET for %s answered by %s",
+              fqkey.c_str(),
+              targets[winner].address_and_port_to_string().c_str());
+
+    if (trail != 0)
+    {
+      SAS::Event answered(trail, SASEvent::MEMCACHED_GET_ANSWERED_BY, 0);
+      answered.add_var_param(fqkey);
+      answered.add_var_param(targets[winner].address.to_string());
+      answered.add_static_param(targets[winner].port);
+      SAS::report_event(answered);
+    }
+  }
+  else if (!remaining.empty())
+  {
+    // Neither of the first two targets gave a definitive answer, so try the
+    // rest in order as for an unhedged GET.
+    TRC_DEBUG("Hedged GET for %s failed on both targets - try the rest",
+              fqkey.c_str());
+    rc = iterate_through_targets(remaining, trail,
+                                 [&](ConnectionHandle<memcached_st*>& conn_handle) {
+       return get_from_replica(conn_handle.get_connection(),
+                               fqkey.data(),
+                               fqkey.length(),
+                               data,
+                               cas,
+                               &flags);
+    });
+  }
+
+  return rc;
+}
+
+void TopologyNeutralMemcachedStore::hedged_get_from_target(std::shared_ptr<HedgedGetState> state,
+                                                           int index,
+                                                           AddrInfo target,
+                                                           std::string fqkey,
+                                                           SAS::TrailId trail)
+{
+  pthread_mutex_lock(&state->lock);
+
+  if (state->complete)
+  {
+    state->finished[index] = true;
+    pthread_mutex_unlock(&state->lock);
+    return;
+  }
+
+  pthread_mutex_unlock(&state->lock);
+
+  TRC_DEBUG("Try server IP %s, port %d",
+            target.address.to_string().c_str(),
+            target.port);
+  SAS::Event attempt(trail, SASEvent::MEMCACHED_TRY_HOST, 0);
+  attempt.add_var_param(target.address.to_string());
+  attempt.add_static_param(target.port);
+  SAS::report_event(attempt);
+
+  std::string data;
+  uint64_t cas = 0;
+  uint32_t flags = 0;
+  memcached_return_t rc;
+
+  {
+    ConnectionHandle<memcached_st*> conn = _conn_pool.get_connection(target);
+    Utils::StopWatch stopwatch;
+    stopwatch.start();
+    rc = get_from_replica(conn.get_connection(),
+                          fqkey.data(),
+                          fqkey.length(),
+                          data,
+                          cas,
+                          &flags);
+    record_replica_result(target, stopwatch, rc);
+  }
+
+  TRC_DEBUG("libmemcached returned %d", rc);
+
+  if (can_retry_memcached_rc(rc))
+  {
+    TRC_DEBUG("Blacklisting target");
+    _resolver->blacklist(target);
+  }
+
+  pthread_mutex_lock(&state->lock);
+
+  state->finished[index] = true;
+  state->ran[index] = true;
+  state->rc[index] = rc;
+  state->data[index].swap(data);
+  state->cas[index] = cas;
+  state->flags[index] = flags;
+
+  if ((!state->complete) && (!can_retry_memcached_rc(rc)))
+  {
+    // This is the first definitive answer.
+    state->complete = true;
+    state->winner = index;
+  }
+
+  state->cond.broadcast();
+  pthread_mutex_unlock(&state->lock);
+}
+
 Store::Status TopologyNeutralMemcachedStore::get_data(const std::string& table,
                                                       const std::string& key,
                                                       std::string& data,
@@ -341,6 +890,10 @@ Store::Status TopologyNeutralMemcachedStore::get_data(const std::string& table,
   Store::Status status;
   std::vector<AddrInfo> targets;
   memcached_return_t rc;
+  uint32_t flags = 0;
+  unsigned int attempts = 1;
+  Utils::StopWatch stopwatch;
+  stopwatch.start();
 
   TRC_DEBUG("Start GET from table %s for key %s", table.c_str(), key.c_str());
 
@@ -364,16 +917,51 @@ Store::Status TopologyNeutralMemcachedStore::get_data(const std::string& table,
   //
   // The code that does the GET operation is passed as a lambda that captures
   // all necessary variables by reference.
-  rc = iterate_through_targets(targets, trail,
-                               [&](ConnectionHandle<memcached_st*>& conn_handle) {
-     return get_from_replica(conn_handle.get_connection(),
-                             fqkey.data(),
-                             fqkey.length(),
-                             data,
-                             cas);
-  });
+  if ((_hedge_delay_ms >= 0) &&
+      (_pool_running.load()) &&
+      (!on_worker_thread) &&
+      (targets.size() >= 2))
+  {
+    // A hedged GET is recorded as a single attempt (although each replica it
+    // tries is recorded separately).
+    rc = hedged_get(targets, fqkey, data, cas, flags, trail);
+  }
+  else
+  {
+    rc = iterate_through_targets(targets, trail,
+                                 [&](ConnectionHandle<memcached_st*>& conn_handle) {
+       return get_from_replica(conn_handle.get_connection(),
+                               fqkey.data(),
+                               fqkey.length(),
+                               data,
+                               cas,
+                               &flags);
+    }, &attempts);
+  }
 
-  if (memcached_success(rc))
+  if ((memcached_success(rc)) && (!decode_value(flags, data)))
+  {
+    // We read the record but can't decompress it.  Another target would
+    // return the same data, so there's no point retrying.
+    if (trail != 0)
+    {
+      SAS::Event err(trail, SASEvent::MEMCACHED_GET_ERROR, 0);
+      err.add_var_param(fqkey);
+      err.add_var_param("Failed to decompress value");
+      SAS::report_event(err);
+    }
+
+    TRC_ERROR("Failed to decompress data read from %s", fqkey.c_str());
+    data.clear();
+    cas = 0;
+    status = Store::Status::ERROR;
+
+    if (_comm_monitor)
+    {
+      _comm_monitor->inform_success();
+    }
+  }
+  else if (memcached_success(rc))
   {
     if (data != TOMBSTONE)
     {
@@ -470,6 +1058,8 @@ Store::Status TopologyNeutralMemcachedStore::get_data(const std::string& table,
     }
   }
 
+  record_operation(table, "get", stopwatch, attempts);
+
   return status;
 }
 
@@ -481,10 +1071,34 @@ Store::Status TopologyNeutralMemcachedStore::set_data(const std::string& table,
                                                       SAS::TrailId trail,
                                                       bool log_body,
                                                       Store::Format data_format)
+{
+  return set_data_on_targets(table,
+                             key,
+                             data,
+                             cas,
+                             expiry,
+                             NULL,
+                             trail,
+                             log_body,
+                             data_format);
+}
+
+Store::Status TopologyNeutralMemcachedStore::set_data_on_targets(const std::string& table,
+                                                                 const std::string& key,
+                                                                 const std::string& data,
+                                                                 uint64_t cas,
+                                                                 int expiry,
+                                                                 std::vector<AddrInfo>* targets,
+                                                                 SAS::TrailId trail,
+                                                                 bool log_body,
+                                                                 Store::Format data_format)
 {
   TRC_DEBUG("Writing %d bytes to table %s key %s, CAS = %ld, expiry = %d",
             data.length(), table.c_str(), key.c_str(), cas, expiry);
 
+  Utils::StopWatch stopwatch;
+  stopwatch.start();
+
   std::string fqkey = get_fq_key(table, key);
 
   // Check whether this request is too big.  Note that neither Rogers nor
@@ -537,6 +1151,15 @@ Store::Status TopologyNeutralMemcachedStore::set_data(const std::string& table,
     SAS::report_event(start);
   }
 
+  // Encode (and possibly compress) the data once, rather than on each attempt.
+  std::string buffer;
+  uint32_t flags;
+  const std::string& value = encode_value(data, buffer, flags);
+
+  // Likewise the I/O description, which is otherwise rebuilt for each target.
+  const std::string cas_description =
+    io_description("Memcached CAS for ", fqkey.data(), fqkey.length());
+
   memcached_store_func f =
     [&] (ConnectionHandle<memcached_st*>& conn_handle,
          time_t memcached_expiration) -> memcached_return_t
@@ -552,25 +1175,25 @@ Store::Status TopologyNeutralMemcachedStore::set_data(const std::string& table,
                                      fqkey.data(),
                                      fqkey.length(),
                                      0,
-                                     data,
+                                     value,
                                      memcached_expiration,
-                                     0,
+                                     flags,
                                      trail);
     }
     else
     {
       // This is an update to an existing record, so use memcached_cas
       // to make sure it is atomic.
-      CW_IO_STARTS("Memcached CAS for " + fqkey)
+      CW_IO_STARTS(cas_description)
       {
         rc = memcached_cas_vb(conn_handle.get_connection(),
                               fqkey.data(),
                               fqkey.length(),
                               0,
-                              data.data(),
-                              data.length(),
+                              value.data(),
+                              value.length(),
                               memcached_expiration,
-                              0,
+                              flags,
                               cas);
       }
       CW_IO_COMPLETES()
@@ -578,11 +1201,23 @@ Store::Status TopologyNeutralMemcachedStore::set_data(const std::string& table,
     return rc;
   };
 
-  return set_data(fqkey,
-                  data,
-                  expiry,
-                  trail,
-                  f);
+  unsigned int attempts = 0;
+  Store::Status status = set_data(fqkey,
+                                  data,
+                                  expiry,
+                                  targets,
+                                  trail,
+                                  f,
+                                  &attempts);
+
+  record_operation(table, "set", stopwatch, attempts);
+
+  if ((_stats != NULL) && (status != Store::Status::ERROR))
+  {
+    _stats->record_cas_write(table, (status == Store::Status::DATA_CONTENTION));
+  }
+
+  return status;
 }
 
 Store::Status TopologyNeutralMemcachedStore::set_data_without_cas(const std::string& table,
@@ -596,6 +1231,9 @@ Store::Status TopologyNeutralMemcachedStore::set_data_without_cas(const std::str
   TRC_DEBUG("Writing %d bytes to table %s key %s, expiry = %d",
             data.length(), table.c_str(), key.c_str(), expiry);
 
+  Utils::StopWatch stopwatch;
+  stopwatch.start();
+
   std::string fqkey = get_fq_key(table, key);
 
   if (trail != 0)
@@ -624,43 +1262,58 @@ Store::Status TopologyNeutralMemcachedStore::set_data_without_cas(const std::str
     SAS::report_event(start);
   }
 
+  std::string buffer;
+  uint32_t flags;
+  const std::string& value = encode_value(data, buffer, flags);
+  const std::string set_description =
+    io_description("Memcached SET for ", fqkey.data(), fqkey.length());
+
   memcached_store_func f =
     [&] (ConnectionHandle<memcached_st*>& conn_handle,
          time_t memcached_expiration) -> memcached_return_t
   {
     memcached_return_t rc;
 
-    CW_IO_STARTS("Memcached SET for " + fqkey)
+    CW_IO_STARTS(set_description)
     {
       rc = memcached_set_vb(conn_handle.get_connection(),
                             fqkey.data(),
                             fqkey.length(),
                             0,
-                            data.data(),
-                            data.length(),
+                            value.data(),
+                            value.length(),
                             memcached_expiration,
-                            0);
+                            flags);
     }
     CW_IO_COMPLETES();
 
     return rc;
   };
 
-  return set_data(fqkey,
-                  data,
-                  expiry,
-                  trail,
-                  f);
+  unsigned int attempts = 0;
+  Store::Status status = set_data(fqkey,
+                                  data,
+                                  expiry,
+                                  NULL,
+                                  trail,
+                                  f,
+                                  &attempts);
+
+  record_operation(table, "set_without_cas", stopwatch, attempts);
+
+  return status;
 }
 
 Store::Status TopologyNeutralMemcachedStore::set_data(const std::string& fqkey,
                                                       const std::string& data,
                                                       int expiry,
+                                                      std::vector<AddrInfo>* targets,
                                                       SAS::TrailId trail,
-                                                      memcached_store_func f)
+                                                      memcached_store_func f,
+                                                      unsigned int* attempts)
 {
   Store::Status status = Store::Status::OK;
-  std::vector<AddrInfo> targets;
+  std::vector<AddrInfo> resolved_targets;
   memcached_return_t rc;
 
   // Memcached uses a flexible mechanism for specifying expiration.
@@ -674,10 +1327,15 @@ Store::Status TopologyNeutralMemcachedStore::set_data(const std::string& fqkey,
   time_t memcached_expiration =
     (time_t)((expiry > 0) ? expiry : MEMCACHED_EXPIRATION_MAXDELTA + 1);
 
-  if (!get_targets(targets, trail))
+  if (targets == NULL)
   {
-    TRC_VERBOSE("Failed to get targets for SET key %s", fqkey.c_str());
-    return ERROR;
+    if (!get_targets(resolved_targets, trail))
+    {
+      TRC_VERBOSE("Failed to get targets for SET key %s", fqkey.c_str());
+      return ERROR;
+    }
+
+    targets = &resolved_targets;
   }
 
   // Set to each replica (mechansim determined by the update function), stopping if we
@@ -688,7 +1346,7 @@ Store::Status TopologyNeutralMemcachedStore::set_data(const std::string& fqkey,
   memcached_func f1 = std::bind(f,
                                 std::placeholders::_1,
                                 memcached_expiration);
-  rc = iterate_through_targets(targets, trail, f1);
+  rc = iterate_through_targets(*targets, trail, f1, attempts);
 
   if (memcached_success(rc))
   {
@@ -736,7 +1394,7 @@ Store::Status TopologyNeutralMemcachedStore::set_data(const std::string& fqkey,
 
     TRC_INFO("Failed to write data for %s to store with error %s",
                 fqkey.c_str(), memcached_strerror(NULL, rc));
-    log_targets(targets);
+    log_targets(*targets);
     status = Store::Status::ERROR;
   }
 
@@ -747,13 +1405,25 @@ Store::Status TopologyNeutralMemcachedStore::set_data(const std::string& fqkey,
 Store::Status TopologyNeutralMemcachedStore::delete_data(const std::string& table,
                                                          const std::string& key,
                                                          SAS::TrailId trail)
+{
+  return delete_data_on_targets(table, key, NULL, trail);
+}
+
+Store::Status TopologyNeutralMemcachedStore::delete_data_on_targets(const std::string& table,
+                                                                    const std::string& key,
+                                                                    std::vector<AddrInfo>* targets,
+                                                                    SAS::TrailId trail)
 {
   Store::Status status = ERROR;
-  std::vector<AddrInfo> targets;
+  std::vector<AddrInfo> resolved_targets;
   memcached_return_t rc;
 
   TRC_DEBUG("Deleting key %s from table %s", key.c_str(), table.c_str());
 
+  Utils::StopWatch stopwatch;
+  stopwatch.start();
+  unsigned int attempts = 0;
+
   std::string fqkey = get_fq_key(table, key);
 
   if (_tombstone_lifetime == 0)
@@ -770,10 +1440,15 @@ Store::Status TopologyNeutralMemcachedStore::delete_data(const std::string& tabl
     SAS::report_event(event);
   }
 
-  if (!get_targets(targets, trail))
+  if (targets == NULL)
   {
-    TRC_INFO("Failed to get targets for DELETE key %s", fqkey.c_str());
-    return ERROR;
+    if (!get_targets(resolved_targets, trail))
+    {
+      TRC_INFO("Failed to get targets for DELETE key %s", fqkey.c_str());
+      return ERROR;
+    }
+
+    targets = &resolved_targets;
   }
 
   // Do a DELETE/SET to each target (depending on whether we should we writing
@@ -782,13 +1457,19 @@ Store::Status TopologyNeutralMemcachedStore::delete_data(const std::string& tabl
   //
   // The code that does the operation is passed as a lambda that captures all
   // necessary variables by reference.
-  rc = iterate_through_targets(targets, trail,
+  const std::string delete_description =
+    io_description((_tombstone_lifetime == 0) ? "Memcached DELETE for " :
+                                                "Memcached SET for ",
+                   fqkey.data(),
+                   fqkey.length());
+
+  rc = iterate_through_targets(*targets, trail,
                                [&](ConnectionHandle<memcached_st*>& conn_handle) {
     memcached_return_t rc;
 
     if (_tombstone_lifetime == 0)
     {
-      CW_IO_STARTS("Memcached DELETE for " + fqkey)
+      CW_IO_STARTS(delete_description)
       {
         rc = memcached_delete(conn_handle.get_connection(), fqkey.data(), fqkey.length(), 0);
       }
@@ -796,7 +1477,7 @@ Store::Status TopologyNeutralMemcachedStore::delete_data(const std::string& tabl
     }
     else
     {
-      CW_IO_STARTS("Memcached SET for " + fqkey)
+      CW_IO_STARTS(delete_description)
       {
         rc = memcached_set_vb(conn_handle.get_connection(),
                               fqkey.data(),
@@ -810,7 +1491,7 @@ Store::Status TopologyNeutralMemcachedStore::delete_data(const std::string& tabl
       CW_IO_COMPLETES()
     }
     return rc;
-  });
+  }, &attempts);
 
   if (memcached_success(rc))
   {
@@ -827,13 +1508,396 @@ Store::Status TopologyNeutralMemcachedStore::delete_data(const std::string& tabl
     }
 
     TRC_INFO("Delete for %s failed with error %s", fqkey.c_str(), memcached_strerror(NULL, rc));
-    log_targets(targets);
+    log_targets(*targets);
   }
 
+  record_operation(table, "delete", stopwatch, attempts);
+
   return status;
 }
 
 
+memcached_return_t TopologyNeutralMemcachedStore::get_batch_from_replica(
+                                            memcached_st* replica,
+                                            std::vector<Store::BatchItem>& items,
+                                            const std::vector<std::string>& fqkeys,
+                                            std::vector<size_t>& pending,
+                                            std::vector<memcached_return_t>& item_rcs)
+{
+  memcached_return_t rc = MEMCACHED_ERROR;
+
+  // Group the outstanding items by key so that each key is only requested
+  // once, even if it appears in the batch more than once.
+  std::map<std::string, std::vector<size_t>> keys;
+
+  for (size_t ii : pending)
+  {
+    keys[fqkeys[ii]].push_back(ii);
+  }
+
+  std::vector<const char*> key_ptrs;
+  std::vector<size_t> key_lens;
+  key_ptrs.reserve(keys.size());
+  key_lens.reserve(keys.size());
+
+  for (const std::pair<const std::string, std::vector<size_t>>& key : keys)
+  {
+    key_ptrs.push_back(key.first.data());
+    key_lens.push_back(key.first.length());
+  }
+
+  // Request all the keys in one go.  With the binary protocol libmemcached
+  // pipelines these as quiet GETs, so the whole batch costs a single round
+  // trip.
+  CW_IO_STARTS("Memcached GET for " + std::to_string(key_ptrs.size()) + " keys")
+  {
+    rc = memcached_mget(replica, key_ptrs.data(), key_lens.data(), key_ptrs.size());
+  }
+  CW_IO_COMPLETES()
+
+  if (memcached_success(rc))
+  {
+    memcached_result_st result;
+    memcached_result_create(replica, &result);
+
+    while (true)
+    {
+      memcached_result_st* fetched;
+
+      CW_IO_STARTS("Memcached GET fetch result")
+      {
+        fetched = memcached_fetch_result(replica, &result, &rc);
+      }
+      CW_IO_COMPLETES()
+
+      if (fetched == NULL)
+      {
+        break;
+      }
+
+      std::string fqkey(memcached_result_key_value(&result),
+                        memcached_result_key_length(&result));
+      std::map<std::string, std::vector<size_t>>::iterator key = keys.find(fqkey);
+
+      if (key == keys.end())
+      {
+        TRC_DEBUG("Ignoring unexpected result for key %s", fqkey.c_str());
+        continue;
+      }
+
+      TRC_DEBUG("Found record for key %s on replica", fqkey.c_str());
+
+      std::string data(memcached_result_value(&result),
+                       memcached_result_length(&result));
+      uint64_t cas = memcached_result_cas(&result);
+      Store::Status status = Store::Status::OK;
+
+      if (!decode_value(memcached_result_flags(&result), data))
+      {
+        // Another target would return the same data, so treat this as
+        // definitive rather than retrying.
+        TRC_ERROR("Failed to decompress data read from %s", fqkey.c_str());
+        data.clear();
+        cas = 0;
+        status = Store::Status::ERROR;
+      }
+
+      for (size_t ii : key->second)
+      {
+        items[ii].data = data;
+        items[ii].cas = cas;
+        items[ii].status = status;
+        item_rcs[ii] = MEMCACHED_SUCCESS;
+      }
+
+      keys.erase(key);
+    }
+
+    memcached_result_free(&result);
+
+    if ((rc == MEMCACHED_END) || (rc == MEMCACHED_NOTFOUND))
+    {
+      // The replica has returned everything it has, so any key it didn't
+      // return does not exist.
+      for (const std::pair<const std::string, std::vector<size_t>>& key : keys)
+      {
+        for (size_t ii : key.second)
+        {
+          items[ii].status = Store::Status::NOT_FOUND;
+          item_rcs[ii] = MEMCACHED_NOTFOUND;
+        }
+      }
+
+      keys.clear();
+      rc = MEMCACHED_SUCCESS;
+    }
+  }
+
+  // Whatever is left has not had a definitive answer from this replica, so
+  // record the error it hit against each of those items.
+  pending.clear();
+
+  for (const std::pair<const std::string, std::vector<size_t>>& key : keys)
+  {
+    for (size_t ii : key.second)
+    {
+      item_rcs[ii] = rc;
+    }
+
+    pending.insert(pending.end(), key.second.begin(), key.second.end());
+  }
+
+  return rc;
+}
+
+void TopologyNeutralMemcachedStore::get_data_batch(std::vector<Store::BatchItem>& items,
+                                                   SAS::TrailId trail)
+{
+  std::vector<AddrInfo> targets;
+  std::vector<std::string> fqkeys;
+  std::vector<size_t> pending;
+  std::vector<memcached_return_t> item_rcs(items.size(), MEMCACHED_ERROR);
+  memcached_return_t rc;
+  unsigned int attempts = 0;
+  Utils::StopWatch stopwatch;
+  stopwatch.start();
+
+  TRC_DEBUG("Start batched GET for %d keys", items.size());
+
+  if (items.empty())
+  {
+    return;
+  }
+
+  fqkeys.reserve(items.size());
+  pending.reserve(items.size());
+
+  for (size_t ii = 0; ii < items.size(); ++ii)
+  {
+    Store::BatchItem& item = items[ii];
+    item.data.clear();
+    item.cas = 0;
+    item.status = Store::Status::ERROR;
+
+    fqkeys.push_back(get_fq_key(item.table, item.key));
+    pending.push_back(ii);
+
+    if (trail != 0)
+    {
+      SAS::Event start(trail, SASEvent::MEMCACHED_GET_START, 0);
+      start.add_var_param(fqkeys.back());
+      SAS::report_event(start);
+    }
+  }
+
+  if (!get_targets(targets, trail))
+  {
+    TRC_VERBOSE("Failed to get targets for batched GET");
+    return;
+  }
+
+  // Do a multi-key GET to each target, stopping once every key has had a
+  // definitive answer.  If a target fails part way through, only the keys it
+  // did not answer are retried on the next one.
+  rc = iterate_through_targets(targets, trail,
+                               [&](ConnectionHandle<memcached_st*>& conn_handle) {
+    return get_batch_from_replica(conn_handle.get_connection(),
+                                  items,
+                                  fqkeys,
+                                  pending,
+                                  item_rcs);
+  }, &attempts);
+
+  for (size_t ii = 0; ii < items.size(); ++ii)
+  {
+    Store::BatchItem& item = items[ii];
+
+    if (item.status == Store::Status::OK)
+    {
+      if (item.data != TOMBSTONE)
+      {
+        if (trail != 0)
+        {
+          int event;
+
+          if (item.log_body)
+          {
+            event = SASEvent::MEMCACHED_GET_SUCCESS;
+          }
+          else
+          {
+            event = SASEvent::MEMCACHED_GET_WITHOUT_DATA_SUCCESS;
+          }
+
+          SAS::Event got_data(trail, event, 0);
+          got_data.add_var_param(fqkeys[ii]);
+          got_data.add_static_param(item.cas);
+
+          if (item.log_body)
+          {
+            got_data.add_var_param(item.data);
+            got_data.add_static_param(item.data_format);
+          }
+
+          SAS::report_event(got_data);
+        }
+
+        TRC_DEBUG("Read %d bytes from table %s key %s, CAS = %ld",
+                  item.data.length(), item.table.c_str(), item.key.c_str(), item.cas);
+      }
+      else
+      {
+        if (trail != 0)
+        {
+          SAS::Event got_tombstone(trail, SASEvent::MEMCACHED_GET_TOMBSTONE, 0);
+          got_tombstone.add_var_param(fqkeys[ii]);
+          got_tombstone.add_static_param(item.cas);
+          SAS::report_event(got_tombstone);
+        }
+
+        // As for a single GET, a tombstone is reported as NOT_FOUND with a
+        // zero CAS.
+        TRC_DEBUG("Read tombstone from table %s key %s, CAS = %ld",
+                  item.table.c_str(), item.key.c_str(), item.cas);
+        item.cas = 0;
+        item.status = Store::Status::NOT_FOUND;
+      }
+    }
+    else if (item.status == Store::Status::NOT_FOUND)
+    {
+      TRC_DEBUG("Key %s not found", fqkeys[ii].c_str());
+
+      if (trail != 0)
+      {
+        SAS::Event not_found(trail, SASEvent::MEMCACHED_GET_NOT_FOUND, 0);
+        not_found.add_var_param(fqkeys[ii]);
+        SAS::report_event(not_found);
+      }
+    }
+    else if (memcached_success(item_rcs[ii]))
+    {
+      // The replica returned the record but it couldn't be decompressed (which
+      // has already been logged).
+      if (trail != 0)
+      {
+        SAS::Event err(trail, SASEvent::MEMCACHED_GET_ERROR, 0);
+        err.add_var_param(fqkeys[ii]);
+        err.add_var_param("Failed to decompress value");
+        SAS::report_event(err);
+      }
+    }
+    else
+    {
+      if (trail != 0)
+      {
+        SAS::Event err(trail, SASEvent::MEMCACHED_GET_ERROR, 0);
+        err.add_var_param(fqkeys[ii]);
+        err.add_var_param(memcached_strerror(NULL, item_rcs[ii]));
+        SAS::report_event(err);
+      }
+
+      TRC_VERBOSE("Failed to read data from %s with error %s",
+                  fqkeys[ii].c_str(),
+                  memcached_strerror(NULL, item_rcs[ii]));
+    }
+  }
+
+  if (memcached_success(rc))
+  {
+    if (_comm_monitor)
+    {
+      _comm_monitor->inform_success();
+    }
+  }
+  else
+  {
+    log_targets(targets);
+
+    if (_comm_monitor)
+    {
+      _comm_monitor->inform_failure();
+    }
+  }
+
+  // Each key is recorded against its own table, with the latency of the
+  // whole batch.
+  for (const Store::BatchItem& item : items)
+  {
+    record_operation(item.table, "get_batch", stopwatch, attempts);
+  }
+}
+
+void TopologyNeutralMemcachedStore::set_data_batch(std::vector<Store::BatchItem>& items,
+                                                   SAS::TrailId trail)
+{
+  std::vector<AddrInfo> targets;
+
+  TRC_DEBUG("Start batched SET for %d keys", items.size());
+
+  if (items.empty())
+  {
+    return;
+  }
+
+  if (!get_targets(targets, trail))
+  {
+    TRC_VERBOSE("Failed to get targets for batched SET");
+
+    for (Store::BatchItem& item : items)
+    {
+      item.status = Store::Status::ERROR;
+    }
+
+    return;
+  }
+
+  // Each record needs its own CAS check, so the writes are issued one at a
+  // time, but they all share the resolved targets (and hence connections).
+  for (Store::BatchItem& item : items)
+  {
+    item.status = set_data_on_targets(item.table,
+                                      item.key,
+                                      item.data,
+                                      item.cas,
+                                      item.expiry,
+                                      &targets,
+                                      trail,
+                                      item.log_body,
+                                      item.data_format);
+  }
+}
+
+void TopologyNeutralMemcachedStore::delete_data_batch(std::vector<Store::BatchItem>& items,
+                                                      SAS::TrailId trail)
+{
+  std::vector<AddrInfo> targets;
+
+  TRC_DEBUG("Start batched DELETE for %d keys", items.size());
+
+  if (items.empty())
+  {
+    return;
+  }
+
+  if (!get_targets(targets, trail))
+  {
+    TRC_INFO("Failed to get targets for batched DELETE");
+
+    for (Store::BatchItem& item : items)
+    {
+      item.status = Store::Status::ERROR;
+    }
+
+    return;
+  }
+
+  for (Store::BatchItem& item : items)
+  {
+    item.status = delete_data_on_targets(item.table, item.key, &targets, trail);
+  }
+}
+
+
 bool TopologyNeutralMemcachedStore::can_retry_memcached_rc(memcached_return_t rc)
 {
   return (!memcached_success(rc) &&
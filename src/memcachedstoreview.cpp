@@ -27,10 +27,16 @@
 
 
 MemcachedStoreView::MemcachedStoreView(int vbuckets, int replicas) :
+  _rings(),
+  _built(false),
+  _config_servers(),
+  _config_new_servers(),
   _replicas(replicas),
   _vbuckets(vbuckets),
   _read_set(vbuckets),
-  _write_set(vbuckets)
+  _write_set(vbuckets),
+  _read_ids(vbuckets),
+  _write_ids(vbuckets)
 {
 }
 
@@ -50,27 +56,49 @@ std::vector<std::string> MemcachedStoreView::merge_servers(const std::vector<std
   return ret;
 }
 
-std::vector<std::string> MemcachedStoreView::
-  server_ids_to_names(const std::vector<int>& ids,
-                      const std::vector<std::string>& lookup_table)
+MemcachedStoreView::ReplicaIds MemcachedStoreView::
+  map_server_ids(const std::vector<int>& ids,
+                 const std::vector<uint16_t>& mapping)
 {
-  std::vector<std::string> names;
+  ReplicaIds mapped;
+  mapped.reserve(ids.size());
 
-  for (std::vector<int>::const_iterator it = ids.begin();
-       it != ids.end();
-       ++it)
+  for (int id : ids)
   {
-    names.push_back(lookup_table[*it]);
+    mapped.push_back(mapping[id]);
   }
 
-  return names;
+  return mapped;
+}
+
+const MemcachedStoreView::Ring& MemcachedStoreView::get_ring(int nodes)
+{
+  std::map<int, Ring>::iterator i = _rings.find(nodes);
+
+  if (i == _rings.end())
+  {
+    // Rings can only be grown, so start from the largest cached ring with
+    // fewer nodes (if there is one).
+    Ring ring(_vbuckets);
+    std::map<int, Ring>::iterator smaller = _rings.lower_bound(nodes);
+
+    if (smaller != _rings.begin())
+    {
+      --smaller;
+      ring = smaller->second;
+    }
+
+    ring.update(nodes);
+    i = _rings.insert(std::make_pair(nodes, ring)).first;
+  }
+
+  return i->second;
 }
 
 void MemcachedStoreView::generate_ring_from_stable_servers()
 {
     // Only need to generate a single ring.
-    Ring ring(_vbuckets);
-    ring.update(_servers.size());
+    const Ring& ring = get_ring(_servers.size());
 
     int replicas = _replicas;
     if (replicas > (int)_servers.size())
@@ -79,27 +107,50 @@ void MemcachedStoreView::generate_ring_from_stable_servers()
       replicas = _servers.size();
     }
 
-    // Generate the read and write replica sets from the rings.
+    // Generate the read and write replica sets from the rings.  The ring's
+    // node indexes are already indexes into _servers.
     for (int ii = 0; ii < _vbuckets; ++ii)
     {
       std::vector<int> server_indexes = ring.get_nodes(ii, replicas);
-      for (size_t jj = 0; jj < server_indexes.size(); jj++)
-      {
-        int idx = server_indexes[jj];
-        _read_set[ii].push_back(_servers[idx]);
-      }
-      _write_set[ii] = _read_set[ii];
+      _read_ids[ii].assign(server_indexes.begin(), server_indexes.end());
+      _write_ids[ii] = _read_ids[ii];
+    }
+
+    generate_replica_names();
 
-      // There is no resize in progress, so the current replicas is the same as
-      // the read set.
+    // There is no resize in progress, so the current replicas are the same as
+    // the read set.
+    for (int ii = 0; ii < _vbuckets; ++ii)
+    {
       _current_replicas[ii] = _read_set[ii];
     }
+}
 
+void MemcachedStoreView::generate_replica_names()
+{
+  for (int ii = 0; ii < _vbuckets; ++ii)
+  {
+    _read_set[ii] = server_ids_to_names(_read_ids[ii], _servers);
+    _write_set[ii] = server_ids_to_names(_write_ids[ii], _servers);
+  }
 }
 
 /// Updates the view for new current and target server lists.
 void MemcachedStoreView::update(const MemcachedConfig& config)
 {
+  if ((_built) &&
+      (config.servers == _config_servers) &&
+      (config.new_servers == _config_new_servers))
+  {
+    // Nothing has changed, so the existing view is still correct.
+    TRC_DEBUG("Memcached cluster configuration unchanged");
+    return;
+  }
+
+  _built = true;
+  _config_servers = config.servers;
+  _config_new_servers = config.new_servers;
+
   // Clear out any state from the old view.
   _changes.clear();
   _current_replicas.clear();
@@ -109,6 +160,8 @@ void MemcachedStoreView::update(const MemcachedConfig& config)
   {
     _read_set[ii].clear();
     _write_set[ii].clear();
+    _read_ids[ii].clear();
+    _write_ids[ii].clear();
   }
 
   // Generate the appropriate rings and the resulting vbuckets arrays.
@@ -144,47 +197,60 @@ void MemcachedStoreView::update(const MemcachedConfig& config)
     // data on, so combine the old and new server lists, removing any overlap.
     _servers = merge_servers(config.servers, config.new_servers);
 
-    // Calculate the two rings needed to generate the vbucket replica sets
-    Ring current_ring(_vbuckets);
-    current_ring.update(config.servers.size());
-    Ring new_ring(_vbuckets);
-    new_ring.update(config.new_servers.size());
+    // Work out where each server in the current and new lists appears in the
+    // merged list, so the rest of the calculation can work on indexes rather
+    // than names.
+    std::map<std::string, uint16_t> server_ids;
+    for (size_t ii = 0; ii < _servers.size(); ++ii)
+    {
+      server_ids[_servers[ii]] = ii;
+    }
 
-    for (int ii = 0; ii < _vbuckets; ++ii)
+    std::vector<uint16_t> current_mapping;
+    for (const std::string& server : config.servers)
     {
-      // Keep track of which nodes are in the replica sets to avoid duplicates.
-      std::map<std::string, bool> in_set;
+      current_mapping.push_back(server_ids[server]);
+    }
+
+    std::vector<uint16_t> new_mapping;
+    for (const std::string& server : config.new_servers)
+    {
+      new_mapping.push_back(server_ids[server]);
+    }
+
+    // Get the two rings needed to generate the vbucket replica sets
+    const Ring& current_ring = get_ring(config.servers.size());
+    const Ring& new_ring = get_ring(config.new_servers.size());
 
+    // Keep track of which nodes are in the replica sets to avoid duplicates.
+    std::vector<bool> in_set(_servers.size());
+
+    for (int ii = 0; ii < _vbuckets; ++ii)
+    {
       // Calculate the read and write replica sets for this bucket for both
       // current and target node sets.
-      std::vector<std::string> current_nodes =
-        server_ids_to_names(current_ring.get_nodes(ii, _replicas),
-                            config.servers);
-      std::vector<std::string> new_nodes =
-        server_ids_to_names(new_ring.get_nodes(ii, _replicas),
-                            config.new_servers);
+      ReplicaIds current_nodes =
+        map_server_ids(current_ring.get_nodes(ii, _replicas), current_mapping);
+      ReplicaIds new_nodes =
+        map_server_ids(new_ring.get_nodes(ii, _replicas), new_mapping);
 
       // Firstly, store off the replicas for this vbucket.
-      _current_replicas[ii] = current_nodes;
-      _new_replicas[ii] = new_nodes;
+      ReplicaList current_names = server_ids_to_names(current_nodes, _servers);
+      ReplicaList new_names = server_ids_to_names(new_nodes, _servers);
+      _current_replicas[ii] = current_names;
+      _new_replicas[ii] = new_names;
 
       // Determine if the set of nodes has changed by sorting the above two
       // vectors and comparing.
-      std::vector<std::string> current_nodes_sorted = current_nodes;
-      std::vector<std::string> new_nodes_sorted = new_nodes;
+      ReplicaIds current_nodes_sorted = current_nodes;
+      ReplicaIds new_nodes_sorted = new_nodes;
       std::sort(current_nodes_sorted.begin(), current_nodes_sorted.end());
       std::sort(new_nodes_sorted.begin(), new_nodes_sorted.end());
 
       if (current_nodes_sorted != new_nodes_sorted)
       {
         // Lists are different, add an entry to _changes to indicate this.
-        //
-        // Build the structure from the inside out (build both replica lists,
-        // create a pair from them then add to the _changes map under the
-        // vbucket index.
-        std::pair<std::vector<std::string>, std::vector<std::string>>
-          change_entry(current_nodes, new_nodes);
-        _changes[ii] = change_entry;
+        _changes[ii] = ReplicaChange(current_names, new_names);
       }
 
       // The read and write replicas both consist of all the current primary,
@@ -199,34 +265,36 @@ void MemcachedStoreView::update(const MemcachedConfig& config)
       // This means that we do up to twice as many writes when scaling up/down.
       // This isn't really an issue because scaling is fast now that we have
       // Astaire.
-      std::string server = current_nodes[0];
-      _read_set[ii].push_back(server);
-      _write_set[ii].push_back(server);
-      in_set[server] = true;
+      ReplicaIds& replicas = _read_ids[ii];
+      std::fill(in_set.begin(), in_set.end(), false);
+
+      replicas.push_back(current_nodes[0]);
+      in_set[current_nodes[0]] = true;
 
       for (int jj = 0; jj < _replicas; ++jj)
       {
-        std::string server = new_nodes[jj];
+        uint16_t server = new_nodes[jj];
         if (!in_set[server])
         {
-          _read_set[ii].push_back(server);
-          _write_set[ii].push_back(server);
+          replicas.push_back(server);
           in_set[server] = true;
         }
       }
 
       for (int jj = 1; jj < _replicas; ++jj)
       {
-        std::string server = current_nodes[jj];
+        uint16_t server = current_nodes[jj];
         if (!in_set[server])
         {
-          _read_set[ii].push_back(server);
-          _write_set[ii].push_back(server);
+          replicas.push_back(server);
           in_set[server] = true;
         }
       }
 
+      _write_ids[ii] = replicas;
     }
+
+    generate_replica_names();
   }
 
   if (!(config.servers.empty() && config.new_servers.empty()))
@@ -354,7 +422,7 @@ void MemcachedStoreView::Ring::update(int nodes)
 /// This is done by starting at the slot, and returning the first n unique
 /// nodes walking around the ring.  If there are not enough unique nodes,
 /// remaining replica slots are filled with the first node.
-std::vector<int> MemcachedStoreView::Ring::get_nodes(int slot, int replicas)
+std::vector<int> MemcachedStoreView::Ring::get_nodes(int slot, int replicas) const
 {
   std::vector<int> node_list;
   node_list.reserve(replicas);
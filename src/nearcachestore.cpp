@@ -0,0 +1,375 @@
+/**
+ * @file nearcachestore.cpp In-process near-cache in front of another Store.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "log.h"
+#include "utils.h"
+#include "sas.h"
+#include "sasevent.h"
+#include "nearcachestore.h"
+
+NearCacheStore::NearCacheStore(Store* store,
+                               size_t max_entries,
+                               uint64_t ttl_ms,
+                               SNMP::SuccessFailCountTable* stats_table) :
+  _store(store),
+  _max_entries(max_entries),
+  _ttl_ms(ttl_ms),
+  _stats_table(stats_table),
+  _lock(PTHREAD_MUTEX_INITIALIZER),
+  _entries(),
+  _lru(),
+  _generations()
+{
+  TRC_DEBUG("Created near-cache store, max entries = %lu, TTL = %lu ms",
+            max_entries, ttl_ms);
+}
+
+NearCacheStore::~NearCacheStore()
+{
+  flush_all();
+  pthread_mutex_destroy(&_lock);
+}
+
+void NearCacheStore::flush_all()
+{
+  pthread_mutex_lock(&_lock);
+  _entries.clear();
+  _lru.clear();
+
+  for (size_t ii = 0; ii < NUM_GENERATIONS; ++ii)
+  {
+    ++_generations[ii];
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+Store::Status NearCacheStore::get_data(const std::string& table,
+                                       const std::string& key,
+                                       std::string& data,
+                                       uint64_t& cas,
+                                       SAS::TrailId trail,
+                                       bool log_body,
+                                       Store::Format data_format)
+{
+  std::string fqkey = get_fq_key(table, key);
+
+  if (lookup(fqkey, data, cas))
+  {
+    TRC_DEBUG("Near-cache hit for %s, CAS = %lu", fqkey.c_str(), cas);
+    record_read(true);
+    log_hit(fqkey, data, cas, trail, log_body, data_format);
+    return Store::Status::OK;
+  }
+
+  TRC_DEBUG("Near-cache miss for %s", fqkey.c_str());
+  record_read(false);
+
+  uint64_t gen = generation(fqkey);
+  Store::Status status = _store->get_data(table,
+                                          key,
+                                          data,
+                                          cas,
+                                          trail,
+                                          log_body,
+                                          data_format);
+
+  if (status == Store::Status::OK)
+  {
+    insert(fqkey, data, cas, gen);
+  }
+
+  return status;
+}
+
+Store::Status NearCacheStore::set_data(const std::string& table,
+                                       const std::string& key,
+                                       const std::string& data,
+                                       uint64_t cas,
+                                       int expiry,
+                                       SAS::TrailId trail,
+                                       bool log_body,
+                                       Store::Format data_format)
+{
+  // The store doesn't tell us the new CAS after a write, so we can't cache the
+  // new data.  Invalidate whatever the result - on success the cached copy is
+  // out of date, and on contention our cached CAS is stale.
+  Store::Status status = _store->set_data(table,
+                                          key,
+                                          data,
+                                          cas,
+                                          expiry,
+                                          trail,
+                                          log_body,
+                                          data_format);
+  invalidate(get_fq_key(table, key));
+  return status;
+}
+
+Store::Status NearCacheStore::set_data_without_cas(const std::string& table,
+                                                   const std::string& key,
+                                                   const std::string& data,
+                                                   int expiry,
+                                                   SAS::TrailId trail,
+                                                   bool log_body,
+                                                   Store::Format data_format)
+{
+  Store::Status status = _store->set_data_without_cas(table,
+                                                      key,
+                                                      data,
+                                                      expiry,
+                                                      trail,
+                                                      log_body,
+                                                      data_format);
+  invalidate(get_fq_key(table, key));
+  return status;
+}
+
+Store::Status NearCacheStore::delete_data(const std::string& table,
+                                          const std::string& key,
+                                          SAS::TrailId trail)
+{
+  Store::Status status = _store->delete_data(table, key, trail);
+  invalidate(get_fq_key(table, key));
+  return status;
+}
+
+void NearCacheStore::get_data_batch(std::vector<Store::BatchItem>& items,
+                                    SAS::TrailId trail)
+{
+  // Serve what we can from the cache and pass the rest to the underlying
+  // store as a single batch.
+  std::vector<Store::BatchItem> misses;
+  std::vector<size_t> miss_indexes;
+  std::vector<uint64_t> miss_generations;
+
+  for (size_t ii = 0; ii < items.size(); ++ii)
+  {
+    Store::BatchItem& item = items[ii];
+    std::string fqkey = get_fq_key(item.table, item.key);
+
+    if (lookup(fqkey, item.data, item.cas))
+    {
+      record_read(true);
+      log_hit(fqkey,
+              item.data,
+              item.cas,
+              trail,
+              item.log_body,
+              item.data_format);
+      item.status = Store::Status::OK;
+    }
+    else
+    {
+      record_read(false);
+      misses.push_back(item);
+      miss_indexes.push_back(ii);
+      miss_generations.push_back(generation(fqkey));
+    }
+  }
+
+  TRC_DEBUG("Near-cache batched read: %lu hits, %lu misses",
+            items.size() - misses.size(), misses.size());
+
+  if (misses.empty())
+  {
+    return;
+  }
+
+  _store->get_data_batch(misses, trail);
+
+  for (size_t ii = 0; ii < misses.size(); ++ii)
+  {
+    Store::BatchItem& miss = misses[ii];
+
+    if (miss.status == Store::Status::OK)
+    {
+      insert(get_fq_key(miss.table, miss.key),
+             miss.data,
+             miss.cas,
+             miss_generations[ii]);
+    }
+
+    items[miss_indexes[ii]] = miss;
+  }
+}
+
+void NearCacheStore::set_data_batch(std::vector<Store::BatchItem>& items,
+                                    SAS::TrailId trail)
+{
+  _store->set_data_batch(items, trail);
+
+  for (const Store::BatchItem& item : items)
+  {
+    invalidate(get_fq_key(item.table, item.key));
+  }
+}
+
+void NearCacheStore::delete_data_batch(std::vector<Store::BatchItem>& items,
+                                       SAS::TrailId trail)
+{
+  _store->delete_data_batch(items, trail);
+
+  for (const Store::BatchItem& item : items)
+  {
+    invalidate(get_fq_key(item.table, item.key));
+  }
+}
+
+bool NearCacheStore::lookup(const std::string& fqkey,
+                            std::string& data,
+                            uint64_t& cas)
+{
+  bool hit = false;
+  uint64_t now = Utils::get_time();
+
+  pthread_mutex_lock(&_lock);
+
+  std::unordered_map<std::string, Entry>::iterator i = _entries.find(fqkey);
+
+  if (i != _entries.end())
+  {
+    Entry& entry = i->second;
+
+    if (entry.expires_ms > now)
+    {
+      data = entry.data;
+      cas = entry.cas;
+      _lru.splice(_lru.begin(), _lru, entry.lru);
+      hit = true;
+    }
+    else
+    {
+      _lru.erase(entry.lru);
+      _entries.erase(i);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  return hit;
+}
+
+void NearCacheStore::insert(const std::string& fqkey,
+                            const std::string& data,
+                            uint64_t cas,
+                            uint64_t generation)
+{
+  if (_max_entries == 0)
+  {
+    return;
+  }
+
+  uint64_t expires_ms = Utils::get_time() + _ttl_ms;
+
+  pthread_mutex_lock(&_lock);
+
+  if (generation == generation_locked(fqkey))
+  {
+    std::unordered_map<std::string, Entry>::iterator i = _entries.find(fqkey);
+
+    if (i != _entries.end())
+    {
+      _lru.splice(_lru.begin(), _lru, i->second.lru);
+    }
+    else
+    {
+      if (_entries.size() >= _max_entries)
+      {
+        // Evict the least recently used record.
+        _entries.erase(_lru.back());
+        _lru.pop_back();
+      }
+
+      _lru.push_front(fqkey);
+      i = _entries.emplace(fqkey, Entry()).first;
+      i->second.lru = _lru.begin();
+    }
+
+    i->second.data = data;
+    i->second.cas = cas;
+    i->second.expires_ms = expires_ms;
+  }
+  else
+  {
+    TRC_DEBUG("Near-cache invalidated during read of %s - don't cache",
+              fqkey.c_str());
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void NearCacheStore::invalidate(const std::string& fqkey)
+{
+  pthread_mutex_lock(&_lock);
+
+  std::unordered_map<std::string, Entry>::iterator i = _entries.find(fqkey);
+
+  if (i != _entries.end())
+  {
+    _lru.erase(i->second.lru);
+    _entries.erase(i);
+  }
+
+  ++generation_locked(fqkey);
+
+  pthread_mutex_unlock(&_lock);
+}
+
+uint64_t NearCacheStore::generation(const std::string& fqkey)
+{
+  pthread_mutex_lock(&_lock);
+  uint64_t generation = generation_locked(fqkey);
+  pthread_mutex_unlock(&_lock);
+  return generation;
+}
+
+void NearCacheStore::record_read(bool hit)
+{
+  if (_stats_table != NULL)
+  {
+    _stats_table->increment_attempts();
+
+    if (hit)
+    {
+      _stats_table->increment_successes();
+    }
+    else
+    {
+      _stats_table->increment_failures();
+    }
+  }
+}
+
+void NearCacheStore::log_hit(const std::string& fqkey,
+                             const std::string& data,
+                             uint64_t cas,
+                             SAS::TrailId trail,
+                             bool log_body,
+                             Store::Format data_format)
+{
+  if (trail != 0)
+  {
+    int event = log_body ? SASEvent::NEAR_CACHE_GET_HIT :
+                           SASEvent::NEAR_CACHE_GET_HIT_WITHOUT_DATA;
+    SAS::Event hit(trail, event, 0);
+    hit.add_var_param(fqkey);
+    hit.add_static_param(cas);
+
+    if (log_body)
+    {
+      hit.add_var_param(data);
+      hit.add_static_param(data_format);
+    }
+
+    SAS::report_event(hit);
+  }
+}
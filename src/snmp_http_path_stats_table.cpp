@@ -0,0 +1,158 @@
+/**
+ * @file snmp_http_path_stats_table.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <atomic>
+
+#include "snmp_internal/snmp_includes.h"
+#include "snmp_internal/snmp_table.h"
+#include "snmp_http_path_stats_table.h"
+#include "log.h"
+
+namespace SNMP
+{
+
+// Row that reads the statistics for one path and method when it is queried.
+class HttpPathStatsRow : public Row
+{
+public:
+  HttpPathStatsRow(int index,
+                   HttpPathStatistics* statistics,
+                   const HttpPathStatistics::Path* path,
+                   htp_method method) :
+    Row(),
+    _index(index),
+    _statistics(statistics),
+    _path(path),
+    _method(method)
+  {
+    // Rows are indexed off a single integer.
+    netsnmp_tdata_row_add_index(_row,
+                                ASN_INTEGER,
+                                &_index,
+                                sizeof(int));
+  };
+
+  ColumnData get_columns()
+  {
+    HttpPathStatistics::Snapshot snapshot;
+    _statistics->get_snapshot(_path, _method, snapshot);
+
+    // Construct and return a ColumnData with the appropriate values.
+    ColumnData ret;
+    ret[1] = Value::integer(_index);
+    ret[2] = Value(ASN_OCTET_STR,
+                   (unsigned char*)snapshot.path.c_str(),
+                   snapshot.path.size());
+    ret[3] = Value(ASN_OCTET_STR,
+                   (unsigned char*)snapshot.method.c_str(),
+                   snapshot.method.size());
+    ret[4] = Value::counter64(snapshot.requests);
+    ret[5] = Value::uint(snapshot.in_flight);
+    ret[6] = Value::uint(snapshot.mean_latency_us());
+    ret[7] = Value::uint(snapshot.percentile_us(50));
+    ret[8] = Value::uint(snapshot.percentile_us(90));
+    ret[9] = Value::uint(snapshot.percentile_us(99));
+
+    for (int ii = 1; ii < HttpPathStatistics::NUM_RC_CLASSES; ++ii)
+    {
+      ret[9 + ii] = Value::counter64(snapshot.responses[ii]);
+    }
+
+    return ret;
+  }
+
+private:
+  int _index;
+  HttpPathStatistics* _statistics;
+  const HttpPathStatistics::Path* _path;
+  htp_method _method;
+};
+
+class HttpPathStatsTableImpl: public ManagedTable<HttpPathStatsRow, int>, public HttpPathStatsTable
+{
+public:
+  HttpPathStatsTableImpl(std::string name,
+                         std::string tbl_oid):
+    ManagedTable<HttpPathStatsRow, int>(name,
+                                        tbl_oid,
+                                        2,
+                                        14,
+                                        { ASN_INTEGER }), // Type of the index column
+    _statistics(NULL)
+  {
+    TRC_INFO("Created table with name %s, OID %s", name.c_str(), tbl_oid.c_str());
+
+    // Add any new rows before the table helpers look up the requested rows.
+    netsnmp_mib_handler* handler =
+                         netsnmp_create_handler("http_path_stats_rows",
+                                                static_update_rows_handler_fn);
+    handler->myvoid = this;
+    netsnmp_inject_handler(this->_handler_reg, handler);
+  }
+
+  void set_statistics(HttpPathStatistics* statistics)
+  {
+    _statistics.store(statistics);
+  }
+
+private:
+  // Rows are only created through update_rows.
+  HttpPathStatsRow* new_row(int index) { return NULL; } // LCOV_EXCL_LINE
+
+  static int static_update_rows_handler_fn(netsnmp_mib_handler* handler,
+                                           netsnmp_handler_registration* reginfo,
+                                           netsnmp_agent_request_info* reqinfo,
+                                           netsnmp_request_info* requests)
+  {
+    (static_cast<HttpPathStatsTableImpl*>(handler->myvoid))->update_rows();
+    return netsnmp_call_next_handler(handler, reginfo, reqinfo, requests);
+  }
+
+  // Add a row for each path and method that has received requests and
+  // doesn't have one yet.  Only called from the Net-SNMP handler.
+  void update_rows()
+  {
+    HttpPathStatistics* statistics = _statistics.load();
+
+    if (statistics == NULL)
+    {
+      return; // LCOV_EXCL_LINE
+    }
+
+    std::vector<std::pair<const HttpPathStatistics::Path*, htp_method> > active;
+    statistics->get_active(active);
+
+    for (const std::pair<const HttpPathStatistics::Path*, htp_method>& entry : active)
+    {
+      int index = entry.first->index * HttpPathStatistics::NUM_METHODS + entry.second;
+
+      if (_map.find(index) == _map.end())
+      {
+        HttpPathStatsRow* row = new HttpPathStatsRow(index,
+                                                     statistics,
+                                                     entry.first,
+                                                     entry.second);
+        _map.insert(std::make_pair(index, row));
+        this->add_in_handler(row);
+      }
+    }
+  }
+
+  // Set from the HTTP stack's thread, but read on the Net-SNMP thread.
+  std::atomic<HttpPathStatistics*> _statistics;
+};
+
+HttpPathStatsTable* HttpPathStatsTable::create(std::string name, std::string oid)
+{
+  return new HttpPathStatsTableImpl(name, oid);
+}
+
+}
@@ -30,6 +30,15 @@ Value Value::integer(int val)
   return Value(ASN_INTEGER, (unsigned char*)&val, sizeof(int32_t));
 };
 
+// Utility constructor for ASN_COUNTER64s
+Value Value::counter64(uint64_t val)
+{
+  struct counter64 c64;
+  c64.high = (unsigned long)(val >> 32);
+  c64.low = (unsigned long)(val & 0xffffffff);
+  return Value(ASN_COUNTER64, (unsigned char*)&c64, sizeof(c64));
+};
+
 
 Row::Row()
 {
@@ -31,23 +31,31 @@
 #include "cpp_common_pd_definitions.h"
 
 StaticDnsCache::StaticDnsCache(std::string filename) :
-  _dns_config_file(filename)
+  _dns_config_file(filename),
+  _index(new Index())
 {
+  pthread_mutex_init(&_reload_lock, NULL);
+
   // The StaticDnsCache needs to be populated at start of day.
   reload_static_records();
 }
 
 StaticDnsCache::~StaticDnsCache()
 {
-  // Clean up any static_records.
-  for (const std::pair<std::string, std::vector<DnsRRecord*>>& entry : _static_records)
+  pthread_mutex_destroy(&_reload_lock);
+}
+
+StaticDnsCache::Index::~Index()
+{
+  // Clean up the records.  The index is only destroyed once nobody is
+  // using it, so this is safe.
+  for (const std::pair<const std::string, Entry>& entry : entries)
   {
-    for (DnsRRecord *record : entry.second)
+    for (DnsRRecord* record : entry.second.records)
     {
       delete record;
     }
   }
-  _static_records.clear();
 }
 
 // Reads static dns records from the specified _dns_config_file.
@@ -82,12 +90,15 @@ void StaticDnsCache::reload_static_records()
     return;
   }
 
+  pthread_mutex_lock(&_reload_lock);
+
   std::ifstream fs(_dns_config_file.c_str());
 
   if (!fs)
   {
     TRC_ERROR("DNS config file %s missing", _dns_config_file.c_str());
     CL_DNS_FILE_MISSING.log();
+    pthread_mutex_unlock(&_reload_lock);
     return;
   }
 
@@ -107,12 +118,15 @@ void StaticDnsCache::reload_static_records()
               dns_config.c_str(),
               rapidjson::GetParseError_En(doc.GetParseError()));
     CL_DNS_FILE_MALFORMED.log();
+    pthread_mutex_unlock(&_reload_lock);
     return;
   }
 
   try
   {
-    std::map<std::string, std::vector<DnsRRecord*>> static_records;
+    // Build a new index.  If we fail part way through, this is cleaned up
+    // when it goes out of scope.
+    std::shared_ptr<Index> index(new Index());
 
     // We must have a "hostnames" array
     JSON_ASSERT_CONTAINS(doc, "hostnames");
@@ -129,7 +143,7 @@ void StaticDnsCache::reload_static_records()
         std::string hostname;
         JSON_GET_STRING_MEMBER(*hosts_it, "name", hostname);
 
-        if (static_records.find(hostname) != static_records.end())
+        if (index->entries.find(hostname) != index->entries.end())
         {
           // Ignore duplicate hostname JSON objects
           TRC_ERROR("Duplicate entry found for hostname %s", hostname.c_str());
@@ -223,7 +237,7 @@ void StaticDnsCache::reload_static_records()
           }
         }
 
-        static_records.insert(std::make_pair(hostname, records));
+        index->entries[hostname].records.swap(records);
       }
       catch (JsonFormatError err)
       {
@@ -234,41 +248,105 @@ void StaticDnsCache::reload_static_records()
       }
     }
 
-    // Now swap out the old _static_records for the new one.
-    std::swap(_static_records, static_records);
+    // Resolve the CNAME chains up front, so lookups never have to chase
+    // them.
+    resolve_cname_chains(index.get());
+
+    // Now swap in the new index.  The old one is destroyed when the last
+    // lookup using it completes.
     TRC_STATUS("Loaded %d static DNS records from %s",
-               _static_records.size(),
+               index->entries.size(),
                _dns_config_file.c_str());
-
-    // Finally, clean up the now unused records
-    for (const std::pair<std::string, std::vector<DnsRRecord*>>& entry : static_records)
-    {
-      for (DnsRRecord* record : entry.second)
-      {
-        delete record;
-      }
-    }
+    std::atomic_store(&_index, std::shared_ptr<const Index>(index));
   }
   catch (JsonFormatError err)
   {
     TRC_ERROR("Error parsing dns config file %s.", _dns_config_file.c_str());
     CL_DNS_FILE_MALFORMED.log();
   }
+
+  pthread_mutex_unlock(&_reload_lock);
+}
+
+// Returns the target of the CNAME record in the list of records, or NULL if
+// there isn't one.
+static const std::string* cname_target(const std::vector<DnsRRecord*>& records)
+{
+  for (DnsRRecord* record : records)
+  {
+    if (record->rrtype() == ns_t_cname)
+    {
+      return &((DnsCNAMERecord*)record)->target();
+    }
+  }
+
+  return NULL;
 }
 
-DnsResult StaticDnsCache::get_static_dns_records(std::string domain,
+void StaticDnsCache::resolve_cname_chains(Index* index)
+{
+  for (std::pair<const std::string, Index::Entry>& entry : index->entries)
+  {
+    const std::string* target = cname_target(entry.second.records);
+    if (target == NULL)
+    {
+      continue;
+    }
+
+    // Follow the chain until we reach a name with no CNAME record.
+    const std::string* canonical_name = target;
+    int hops = 1;
+    std::unordered_map<std::string, Index::Entry>::const_iterator it;
+    while (((it = index->entries.find(*canonical_name)) != index->entries.end()) &&
+           ((target = cname_target(it->second.records)) != NULL))
+    {
+      if (++hops > MAX_CNAME_CHAIN)
+      {
+        // The chain is too long, or is a loop, so just use the first hop.
+        TRC_ERROR("CNAME chain from %s is longer than %d records - only using "
+                  "the first record",
+                  entry.first.c_str(),
+                  MAX_CNAME_CHAIN);
+        canonical_name = cname_target(entry.second.records);
+        break;
+      }
+      canonical_name = target;
+    }
+
+    TRC_DEBUG("Static canonical name for %s is %s",
+              entry.first.c_str(),
+              canonical_name->c_str());
+    entry.second.canonical_name = *canonical_name;
+  }
+}
+
+std::shared_ptr<const StaticDnsCache::Index> StaticDnsCache::current_index() const
+{
+  return std::atomic_load(&_index);
+}
+
+int StaticDnsCache::size()
+{
+  return current_index()->entries.size();
+}
+
+DnsResult StaticDnsCache::get_static_dns_records(const std::string& domain,
                                                  int dns_type)
 {
   std::vector<DnsRRecord*> found_records;
 
+  // Hold a reference to the current index until we've copied the records
+  // out of it.
+  std::shared_ptr<const Index> index = current_index();
+
   // There may be multiple records that match our query, so we iterate over
   // them all.
-  std::map<std::string, std::vector<DnsRRecord*>>::const_iterator map_iter =
-                                                                      _static_records.find(domain);
-  if (map_iter != _static_records.end())
+  std::unordered_map<std::string, Index::Entry>::const_iterator map_iter =
+                                                                 index->entries.find(domain);
+  if (map_iter != index->entries.end())
   {
     TRC_DEBUG("Found records for domain %s", domain.c_str());
-    for (DnsRRecord* record : map_iter->second)
+    for (DnsRRecord* record : map_iter->second.records)
     {
       if (record->rrtype() != dns_type)
       {
@@ -308,17 +386,21 @@ DnsResult StaticDnsCache::get_static_dns_records(std::string domain,
   return DnsResult(domain, dns_type, found_records, 0);
 }
 
-// If a valid CNAME record is found in the static cache, we return that value.
-// Otherwise, return the domain that was passed in.
-std::string StaticDnsCache::get_canonical_name(std::string domain)
+// If a valid CNAME record is found in the static cache, we return the end of
+// the CNAME chain (which was resolved when the index was built).  Otherwise,
+// return the domain that was passed in.
+std::string StaticDnsCache::get_canonical_name(const std::string& domain)
 {
-  DnsResult static_result = get_static_dns_records(domain, ns_t_cname);
-  if (!static_result.records().empty())
+  std::shared_ptr<const Index> index = current_index();
+  std::unordered_map<std::string, Index::Entry>::const_iterator map_iter =
+                                                                 index->entries.find(domain);
+  if ((map_iter != index->entries.end()) &&
+      (!map_iter->second.canonical_name.empty()))
   {
     // We've found a CNAME record in the static cache - let's use that.
-    DnsCNAMERecord *cname_record = (DnsCNAMERecord*)static_result.records().front();
-    TRC_VERBOSE("Found matching CNAME record in static cache", cname_record->target().c_str());
-    return cname_record->target();
+    TRC_VERBOSE("Found matching CNAME record in static cache: %s",
+                map_iter->second.canonical_name.c_str());
+    return map_iter->second.canonical_name;
   }
   else
   {
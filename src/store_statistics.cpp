@@ -0,0 +1,85 @@
+/**
+ * @file store_statistics.cpp Statistics about the operations made on a store.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string.h>
+
+#include "store_statistics.h"
+
+StoreStatistics::StoreStatistics(SNMP::TimeAndStringBasedEventTable* latency_table,
+                                 SNMP::TimeAndStringBasedEventTable* retries_table,
+                                 SNMP::TimeAndStringBasedEventTable* contention_table,
+                                 SNMP::TimeAndStringBasedEventTable* replica_latency_table,
+                                 SNMP::InfiniteScalarTable* replica_errors_table) :
+  _latency_table(latency_table),
+  _retries_table(retries_table),
+  _contention_table(contention_table),
+  _replica_latency_table(replica_latency_table),
+  _replica_errors_table(replica_errors_table)
+{
+}
+
+void StoreStatistics::record_operation(const std::string& table,
+                                       const char* operation,
+                                       unsigned long latency_us,
+                                       unsigned int attempts)
+{
+  if ((_latency_table == NULL) && (_retries_table == NULL))
+  {
+    return;
+  }
+
+  std::string index = get_index(table, operation);
+
+  if (_latency_table != NULL)
+  {
+    _latency_table->accumulate(index, latency_us);
+  }
+
+  if (_retries_table != NULL)
+  {
+    _retries_table->accumulate(index, (attempts > 0) ? attempts - 1 : 0);
+  }
+}
+
+void StoreStatistics::record_cas_write(const std::string& table,
+                                       bool contention)
+{
+  if (_contention_table != NULL)
+  {
+    _contention_table->accumulate(get_index(table, "cas"),
+                                  contention ? 100 : 0);
+  }
+}
+
+void StoreStatistics::record_replica_result(const std::string& replica,
+                                            unsigned long latency_us,
+                                            bool error)
+{
+  if (_replica_latency_table != NULL)
+  {
+    _replica_latency_table->accumulate(replica, latency_us);
+  }
+
+  if ((error) && (_replica_errors_table != NULL))
+  {
+    _replica_errors_table->increment(replica, 1);
+  }
+}
+
+std::string StoreStatistics::get_index(const std::string& table,
+                                       const char* operation)
+{
+  size_t operation_len = strlen(operation);
+  std::string index;
+  index.reserve(table.length() + 1 + operation_len);
+  index.append(table).append(1, ':').append(operation, operation_len);
+  return index;
+}
@@ -27,6 +27,7 @@
 #include <signal.h>
 #include <sys/stat.h>
 #include <syslog.h>
+#include <pthread.h>
 #include <boost/algorithm/string.hpp>
 #include <boost/regex.hpp>
 
@@ -931,3 +932,54 @@ void Utils::IOMonitor::set_thread_allows_covert_io(bool allowed)
 
 thread_local int Utils::IOMonitor::_overt_io_depth = 0;
 thread_local bool Utils::IOMonitor::_covert_io_allowed = true;
+
+uint64_t Utils::FastRandom::next()
+{
+  if ((_state[0] == 0) && (_state[1] == 0))
+  {
+    // First use on this thread.
+    seed();
+  }
+
+  uint64_t s1 = _state[0];
+  const uint64_t s0 = _state[1];
+  _state[0] = s0;
+  s1 ^= s1 << 23;
+  _state[1] = s1 ^ s0 ^ (s1 >> 17) ^ (s0 >> 26);
+  return _state[1] + s0;
+}
+
+uint32_t Utils::FastRandom::uniform(uint32_t n)
+{
+  // Scale the top 32 bits of a random number into the range, which avoids
+  // a division and is unbiased enough for load balancing.
+  return (uint32_t)(((next() >> 32) * (uint64_t)n) >> 32);
+}
+
+void Utils::FastRandom::seed()
+{
+  // Seed from the time and the thread, using splitmix64 to spread the bits so
+  // that threads started at the same time get unrelated sequences.
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t x = ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec) ^
+               (uint64_t)pthread_self();
+
+  for (int ii = 0; ii < 2; ++ii)
+  {
+    x += 0x9e3779b97f4a7c15ULL;
+    uint64_t z = x;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    _state[ii] = z ^ (z >> 31);
+  }
+
+  if ((_state[0] == 0) && (_state[1] == 0))
+  {
+    // LCOV_EXCL_START - vanishingly unlikely
+    _state[0] = 1;
+    // LCOV_EXCL_STOP
+  }
+}
+
+thread_local uint64_t Utils::FastRandom::_state[2] = {0, 0};
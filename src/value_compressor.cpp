@@ -0,0 +1,170 @@
+/**
+ * @file value_compressor.cpp Compression of values written to a store.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <arpa/inet.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "log.h"
+#include "store.h"
+#include "value_compressor.h"
+
+ValueCompressor::ValueCompressor(const std::string& dictionary,
+                                 size_t min_length,
+                                 int level) :
+  _dictionary(dictionary),
+  _min_length(min_length),
+  _level(level)
+{
+}
+
+bool ValueCompressor::compress(const std::string& value,
+                               std::string& compressed) const
+{
+  if ((value.length() < _min_length) ||
+      (value.length() <= HEADER_LENGTH) ||
+      (value.length() > Store::MAX_DATA_LENGTH))
+  {
+    return false;
+  }
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+
+  if (deflateInit2(&stream,
+                   _level,
+                   Z_DEFLATED,
+                   WINDOW_BITS,
+                   MEM_LEVEL,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+  {
+    TRC_ERROR("Failed to initialise zlib compression");
+    return false;
+  }
+
+  if ((!_dictionary.empty()) &&
+      (deflateSetDictionary(&stream,
+                            (const Bytef*)_dictionary.data(),
+                            _dictionary.length()) != Z_OK))
+  {
+    TRC_ERROR("Failed to set zlib compression dictionary");
+    deflateEnd(&stream);
+    return false;
+  }
+
+  // Only keep the result if it is smaller than the original, so cap the
+  // output at that size.
+  compressed.resize(value.length());
+
+  uint8_t* header = (uint8_t*)&compressed[0];
+  uint32_t length = htonl((uint32_t)value.length());
+  header[0] = VERSION;
+  memcpy(header + 1, &length, sizeof(length));
+
+  stream.next_in = (Bytef*)value.data();
+  stream.avail_in = value.length();
+  stream.next_out = (Bytef*)&compressed[HEADER_LENGTH];
+  stream.avail_out = compressed.length() - HEADER_LENGTH;
+
+  int rc = deflate(&stream, Z_FINISH);
+  size_t compressed_length = HEADER_LENGTH + stream.total_out;
+  deflateEnd(&stream);
+
+  if (rc != Z_STREAM_END)
+  {
+    // Either an error, or the output didn't fit (so compressing is not
+    // worthwhile).
+    TRC_DEBUG("Not compressing %d byte value (zlib rc = %d)",
+              value.length(), rc);
+    compressed.clear();
+    return false;
+  }
+
+  compressed.resize(compressed_length);
+  TRC_DEBUG("Compressed %d byte value to %d bytes",
+            value.length(), compressed_length);
+  return true;
+}
+
+bool ValueCompressor::decompress(const std::string& compressed,
+                                 std::string& value) const
+{
+  if (compressed.length() < HEADER_LENGTH)
+  {
+    TRC_WARNING("Compressed value too short (%d bytes)", compressed.length());
+    return false;
+  }
+
+  const uint8_t* header = (const uint8_t*)compressed.data();
+
+  if (header[0] != VERSION)
+  {
+    TRC_WARNING("Unsupported compressed value version %d", header[0]);
+    return false;
+  }
+
+  uint32_t length;
+  memcpy(&length, header + 1, sizeof(length));
+  length = ntohl(length);
+
+  // Don't let a corrupt header make us allocate an arbitrary amount of memory.
+  if (length > Store::MAX_DATA_LENGTH)
+  {
+    TRC_WARNING("Compressed value claims to be too long (%u bytes)", length);
+    return false;
+  }
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+
+  if (inflateInit2(&stream, WINDOW_BITS) != Z_OK)
+  {
+    TRC_ERROR("Failed to initialise zlib decompression");
+    return false;
+  }
+
+  value.resize(length);
+
+  stream.next_in = (Bytef*)&compressed[HEADER_LENGTH];
+  stream.avail_in = compressed.length() - HEADER_LENGTH;
+  stream.next_out = (Bytef*)&value[0];
+  stream.avail_out = length;
+
+  int rc = inflate(&stream, Z_FINISH);
+
+  if (rc == Z_NEED_DICT)
+  {
+    // zlib checks the dictionary matches the one used to compress.
+    if ((_dictionary.empty()) ||
+        (inflateSetDictionary(&stream,
+                              (const Bytef*)_dictionary.data(),
+                              _dictionary.length()) != Z_OK))
+    {
+      TRC_WARNING("Compressed value needs a different dictionary");
+      inflateEnd(&stream);
+      value.clear();
+      return false;
+    }
+
+    rc = inflate(&stream, Z_FINISH);
+  }
+
+  bool success = ((rc == Z_STREAM_END) && (stream.total_out == length));
+  inflateEnd(&stream);
+
+  if (!success)
+  {
+    TRC_WARNING("Failed to decompress value (zlib rc = %d)", rc);
+    value.clear();
+  }
+
+  return success;
+}
@@ -0,0 +1,520 @@
+/**
+ * @file writecoalescingstore.cpp Coalesces writes made to another Store.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <time.h>
+
+#include <memory>
+
+#include "log.h"
+#include "utils.h"
+#include "writecoalescingstore.h"
+
+WriteCoalescingStore::WriteCoalescingStore(Store* store,
+                                           uint64_t window_ms,
+                                           ExceptionHandler* exception_handler,
+                                           SNMP::CounterTable* coalesced_table,
+                                           unsigned int num_threads,
+                                           size_t max_queue) :
+  _store(store),
+  _window_ms(window_ms),
+  _exception_handler(exception_handler),
+  _coalesced_table(coalesced_table),
+  _num_threads(num_threads),
+  _max_queue(max_queue),
+  _pool(NULL),
+  _lock(PTHREAD_MUTEX_INITIALIZER),
+  _cond(&_lock),
+  _complete_cond(&_lock),
+  _running(false),
+  _terminate(false),
+  _pending(),
+  _queue(),
+  _in_flight()
+{
+  TRC_DEBUG("Created write-coalescing store, window = %lu ms", window_ms);
+}
+
+WriteCoalescingStore::~WriteCoalescingStore()
+{
+  stop();
+  pthread_mutex_destroy(&_lock);
+}
+
+bool WriteCoalescingStore::start()
+{
+  bool success = true;
+
+  pthread_mutex_lock(&_lock);
+
+  if (!_running)
+  {
+    _pool = new FunctorThreadPool(_num_threads,
+                                  _exception_handler,
+                                  exception_callback);
+    success = _pool->start();
+
+    if (success)
+    {
+      _terminate = false;
+      int rc = pthread_create(&_flush_thread,
+                              NULL,
+                              &WriteCoalescingStore::static_flush_thread_function,
+                              (void*)this);
+
+      if (rc == 0)
+      {
+        _running = true;
+      }
+      else
+      {
+        // LCOV_EXCL_START
+        TRC_ERROR("Failed to start write-coalescing thread: %d", rc);
+        success = false;
+        // LCOV_EXCL_STOP
+      }
+    }
+
+    if (!success)
+    {
+      // LCOV_EXCL_START
+      _pool->stop();
+      _pool->join();
+      delete _pool; _pool = NULL;
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  return success;
+}
+
+void WriteCoalescingStore::stop()
+{
+  pthread_mutex_lock(&_lock);
+
+  if (!_running)
+  {
+    pthread_mutex_unlock(&_lock);
+    return;
+  }
+
+  // Any new writes are now sent straight away.  The thread sends everything
+  // that is already queued before exiting.
+  TRC_STATUS("Stopping write-coalescing store, %lu writes queued",
+             _pending.size());
+  _running = false;
+  _terminate = true;
+  _cond.signal();
+
+  pthread_mutex_unlock(&_lock);
+
+  pthread_join(_flush_thread, NULL);
+
+  // Stopping the pool discards any work queued on it, so wait for all the
+  // writes (including any deferred behind another write to the same record)
+  // to complete first.  No more can be queued now we aren't running.
+  pthread_mutex_lock(&_lock);
+
+  while ((!_pending.empty()) || (!_in_flight.empty()))
+  {
+    _complete_cond.wait();
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  _pool->stop();
+  _pool->join();
+  delete _pool; _pool = NULL;
+}
+
+void WriteCoalescingStore::flush()
+{
+  std::vector<Write> writes;
+  std::vector<std::string> fqkeys;
+
+  pthread_mutex_lock(&_lock);
+
+  for (const std::pair<uint64_t, std::string>& entry : _queue)
+  {
+    fqkeys.push_back(entry.second);
+  }
+
+  take_writes(0, true, writes);
+  pthread_mutex_unlock(&_lock);
+
+  dispatch(writes);
+
+  // Wait for the writes to complete.  This only waits for the records that
+  // were queued, so it isn't held up by new writes to other records.
+  pthread_mutex_lock(&_lock);
+
+  for (const std::string& fqkey : fqkeys)
+  {
+    while (taken(fqkey))
+    {
+      _complete_cond.wait();
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void* WriteCoalescingStore::static_flush_thread_function(void* store)
+{
+  ((WriteCoalescingStore*)store)->flush_thread_function();
+  return NULL;
+}
+
+void WriteCoalescingStore::flush_thread_function()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (true)
+  {
+    bool terminate = _terminate;
+    uint64_t now = Utils::get_time();
+
+    if ((!_queue.empty()) &&
+        ((terminate) || (_queue.front().first <= now)))
+    {
+      // There are writes to send.  Pass them to the pool.
+      std::vector<Write> writes;
+      take_writes(now, terminate, writes);
+
+      pthread_mutex_unlock(&_lock);
+      dispatch(writes);
+      pthread_mutex_lock(&_lock);
+    }
+    else if (terminate)
+    {
+      break;
+    }
+    else if (_queue.empty())
+    {
+      _cond.wait();
+    }
+    else
+    {
+      // Wait until the next write is due.
+      uint64_t delay_ms = _queue.front().first - now;
+      struct timespec deadline;
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      deadline.tv_sec += delay_ms / 1000;
+      deadline.tv_nsec += (delay_ms % 1000) * 1000000;
+
+      if (deadline.tv_nsec >= 1000000000)
+      {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000;
+      }
+
+      _cond.timedwait(&deadline);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void WriteCoalescingStore::take_writes(uint64_t now,
+                                       bool all,
+                                       std::vector<Write>& writes)
+{
+  while ((!_queue.empty()) && ((all) || (_queue.front().first <= now)))
+  {
+    std::pair<uint64_t, std::string>& next = _queue.front();
+    std::unordered_map<std::string, Write>::iterator i =
+                                                     _pending.find(next.second);
+
+    // Skip the entry if the write has already been sent or discarded (in
+    // which case there's no pending write, or it's a later one).
+    if ((i != _pending.end()) && (i->second.due_ms == next.first))
+    {
+      if (_in_flight.count(next.second) != 0)
+      {
+        // An earlier write to this record is still being sent.  Leave this
+        // one pending (so later writes still coalesce with it) until that
+        // write completes.
+        i->second.deferred = true;
+      }
+      else
+      {
+        writes.push_back(std::move(i->second));
+        _pending.erase(i);
+        _in_flight.insert(next.second);
+      }
+    }
+
+    _queue.pop_front();
+  }
+}
+
+void WriteCoalescingStore::dispatch(std::vector<Write>& writes)
+{
+  for (Write& write : writes)
+  {
+    // The lambda owns the write, as the vector doesn't outlive this call.
+    std::shared_ptr<Write> owned = std::make_shared<Write>(std::move(write));
+    _pool->add_work([this, owned]() { send(*owned); });
+  }
+
+  writes.clear();
+}
+
+void WriteCoalescingStore::send(const Write& write)
+{
+  Store::Status status = _store->set_data_without_cas(write.table,
+                                                      write.key,
+                                                      write.data,
+                                                      write.expiry,
+                                                      write.trail,
+                                                      write.log_body,
+                                                      write.data_format);
+
+  if (status != Store::Status::OK)
+  {
+    TRC_WARNING("Failed to write coalesced data for table %s key %s (%d)",
+                write.table.c_str(), write.key.c_str(), status);
+  }
+
+  std::vector<Write> writes;
+
+  pthread_mutex_lock(&_lock);
+  complete(get_fq_key(write.table, write.key), writes);
+  pthread_mutex_unlock(&_lock);
+
+  dispatch(writes);
+}
+
+void WriteCoalescingStore::complete(const std::string& fqkey,
+                                    std::vector<Write>& writes)
+{
+  _in_flight.erase(fqkey);
+
+  std::unordered_map<std::string, Write>::iterator i = _pending.find(fqkey);
+
+  if ((i != _pending.end()) && (i->second.deferred))
+  {
+    writes.push_back(std::move(i->second));
+    _pending.erase(i);
+    _in_flight.insert(fqkey);
+  }
+
+  _complete_cond.broadcast();
+}
+
+bool WriteCoalescingStore::taken(const std::string& fqkey)
+{
+  if (_in_flight.count(fqkey) != 0)
+  {
+    return true;
+  }
+
+  std::unordered_map<std::string, Write>::const_iterator i = _pending.find(fqkey);
+  return ((i != _pending.end()) && (i->second.deferred));
+}
+
+void WriteCoalescingStore::settle(const std::string& fqkey, bool discard)
+{
+  std::vector<Write> writes;
+
+  pthread_mutex_lock(&_lock);
+
+  // Wait for any write to this record to complete.  Writes to other records
+  // don't hold us up.
+  while (_in_flight.count(fqkey) != 0)
+  {
+    _complete_cond.wait();
+  }
+
+  std::unordered_map<std::string, Write>::iterator i = _pending.find(fqkey);
+
+  if (i != _pending.end())
+  {
+    if (!discard)
+    {
+      writes.push_back(std::move(i->second));
+      _in_flight.insert(fqkey);
+    }
+
+    // Any entry for the write on the queue is now stale.
+    _pending.erase(i);
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  // Send the write on this thread, rather than waiting for the pool.
+  for (const Write& write : writes)
+  {
+    send(write);
+  }
+}
+
+Store::Status WriteCoalescingStore::get_data(const std::string& table,
+                                             const std::string& key,
+                                             std::string& data,
+                                             uint64_t& cas,
+                                             SAS::TrailId trail,
+                                             bool log_body,
+                                             Store::Format data_format)
+{
+  settle(get_fq_key(table, key), false);
+  return _store->get_data(table, key, data, cas, trail, log_body, data_format);
+}
+
+Store::Status WriteCoalescingStore::set_data(const std::string& table,
+                                             const std::string& key,
+                                             const std::string& data,
+                                             uint64_t cas,
+                                             int expiry,
+                                             SAS::TrailId trail,
+                                             bool log_body,
+                                             Store::Format data_format)
+{
+  // The queued write must land first, so the CAS check is made against it.
+  settle(get_fq_key(table, key), false);
+  return _store->set_data(table,
+                          key,
+                          data,
+                          cas,
+                          expiry,
+                          trail,
+                          log_body,
+                          data_format);
+}
+
+Store::Status WriteCoalescingStore::set_data_without_cas(const std::string& table,
+                                                         const std::string& key,
+                                                         const std::string& data,
+                                                         int expiry,
+                                                         SAS::TrailId trail,
+                                                         bool log_body,
+                                                         Store::Format data_format)
+{
+  std::string fqkey = get_fq_key(table, key);
+  bool queued = false;
+  bool coalesced = false;
+
+  pthread_mutex_lock(&_lock);
+
+  // Oversized writes are passed straight through so the caller sees them
+  // fail.
+  if ((_running) && (data.length() <= Store::MAX_DATA_LENGTH))
+  {
+    std::unordered_map<std::string, Write>::iterator i = _pending.find(fqkey);
+
+    if (i != _pending.end())
+    {
+      // Replace the queued write, but keep its place in the queue.
+      Write& write = i->second;
+      write.data = data;
+      write.expiry = expiry;
+      write.trail = trail;
+      write.log_body = log_body;
+      write.data_format = data_format;
+      coalesced = true;
+      queued = true;
+    }
+    else if (_queue.size() < _max_queue)
+    {
+      Write& write = _pending[fqkey];
+      write.table = table;
+      write.key = key;
+      write.data = data;
+      write.expiry = expiry;
+      write.trail = trail;
+      write.log_body = log_body;
+      write.data_format = data_format;
+      write.due_ms = Utils::get_time() + _window_ms;
+      write.deferred = false;
+      _queue.push_back(std::make_pair(write.due_ms, fqkey));
+      _cond.signal();
+      queued = true;
+    }
+    else
+    {
+      // The queue is full, so send the write synchronously.
+      TRC_DEBUG("Write queue full, writing to %s synchronously", fqkey.c_str());
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  if (!queued)
+  {
+    settle(fqkey, false);
+    return _store->set_data_without_cas(table,
+                                        key,
+                                        data,
+                                        expiry,
+                                        trail,
+                                        log_body,
+                                        data_format);
+  }
+
+  if (coalesced)
+  {
+    TRC_DEBUG("Coalesced write to %s with queued write", fqkey.c_str());
+
+    if (_coalesced_table != NULL)
+    {
+      _coalesced_table->increment();
+    }
+  }
+  else
+  {
+    TRC_DEBUG("Queued write to %s", fqkey.c_str());
+  }
+
+  return Store::Status::OK;
+}
+
+Store::Status WriteCoalescingStore::delete_data(const std::string& table,
+                                                const std::string& key,
+                                                SAS::TrailId trail)
+{
+  // The delete supersedes any queued write.
+  settle(get_fq_key(table, key), true);
+  return _store->delete_data(table, key, trail);
+}
+
+void WriteCoalescingStore::get_data_batch(std::vector<Store::BatchItem>& items,
+                                          SAS::TrailId trail)
+{
+  for (const Store::BatchItem& item : items)
+  {
+    settle(get_fq_key(item.table, item.key), false);
+  }
+
+  _store->get_data_batch(items, trail);
+}
+
+void WriteCoalescingStore::set_data_batch(std::vector<Store::BatchItem>& items,
+                                          SAS::TrailId trail)
+{
+  for (const Store::BatchItem& item : items)
+  {
+    settle(get_fq_key(item.table, item.key), false);
+  }
+
+  _store->set_data_batch(items, trail);
+}
+
+void WriteCoalescingStore::delete_data_batch(std::vector<Store::BatchItem>& items,
+                                             SAS::TrailId trail)
+{
+  for (const Store::BatchItem& item : items)
+  {
+    settle(get_fq_key(item.table, item.key), true);
+  }
+
+  _store->delete_data_batch(items, trail);
+}
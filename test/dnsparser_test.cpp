@@ -0,0 +1,116 @@
+/**
+ * @file dnsparser_test.cpp UT for the DNS parser.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string.h>
+
+#include "gtest/gtest.h"
+
+#include "dnsparser.h"
+
+// The header of a response with no questions and a single answer.
+static const unsigned char SINGLE_ANSWER_HDR[] =
+  {0x00, 0x01, 0x81, 0x80, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00};
+
+// The type (A), class (IN), TTL (60) and RDATA (10.0.0.1) of an A record.
+static const unsigned char A_RECORD_BODY[] =
+  {0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3c, 0x00, 0x04,
+   0x0a, 0x00, 0x00, 0x01};
+
+class DnsParserTest : public ::testing::Test
+{
+public:
+  DnsParserTest() : _length(0)
+  {
+    add(SINGLE_ANSWER_HDR, sizeof(SINGLE_ANSWER_HDR));
+  }
+
+  void add(const unsigned char* data, int length)
+  {
+    memcpy(_buf + _length, data, length);
+    _length += length;
+  }
+
+  unsigned char _buf[512];
+  int _length;
+};
+
+// Test that a well-formed name using chained compression pointers is
+// decoded.
+TEST_F(DnsParserTest, ChainedPointers)
+{
+  // Additional header fields for three answers.
+  _buf[7] = 3;
+
+  // "example.com" at offset 12, "www" + pointer to it at offset 39 and a
+  // pointer to that at offset 65.
+  const unsigned char name1[] =
+    {7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0};
+  add(name1, sizeof(name1));
+  add(A_RECORD_BODY, sizeof(A_RECORD_BODY));
+  const unsigned char name2[] = {3, 'w', 'w', 'w', 0xc0, 12};
+  add(name2, sizeof(name2));
+  add(A_RECORD_BODY, sizeof(A_RECORD_BODY));
+  const unsigned char name3[] = {0xc0, 39};
+  add(name3, sizeof(name3));
+  add(A_RECORD_BODY, sizeof(A_RECORD_BODY));
+
+  DnsParser parser(_buf, _length);
+  ASSERT_TRUE(parser.parse_refs());
+  ASSERT_EQ(3u, parser.answer_refs().size());
+  EXPECT_EQ("example.com", parser.answer_refs().begin()[0].rrname().to_string());
+  EXPECT_EQ("www.example.com", parser.answer_refs().begin()[1].rrname().to_string());
+  EXPECT_EQ("www.example.com", parser.answer_refs().begin()[2].rrname().to_string());
+  EXPECT_TRUE(parser.answer_refs().begin()[2].rrname().matches("www.example.com"));
+}
+
+// Test that a compression pointer to itself is rejected.
+TEST_F(DnsParserTest, SelfPointer)
+{
+  const unsigned char name[] = {0xc0, 12};
+  add(name, sizeof(name));
+  add(A_RECORD_BODY, sizeof(A_RECORD_BODY));
+
+  DnsParser parser(_buf, _length);
+  EXPECT_FALSE(parser.parse_refs());
+}
+
+// Test that a compression pointer back to the start of its own name (which
+// would loop forever) is rejected.
+TEST_F(DnsParserTest, BackwardPointerLoop)
+{
+  const unsigned char name[] = {1, 'a', 0xc0, 12};
+  add(name, sizeof(name));
+  add(A_RECORD_BODY, sizeof(A_RECORD_BODY));
+
+  DnsParser parser(_buf, _length);
+  EXPECT_FALSE(parser.parse_refs());
+
+  DnsParser parser2(_buf, _length);
+  EXPECT_FALSE(parser2.parse());
+}
+
+// Test that a pair of names that point at each other is rejected.
+TEST_F(DnsParserTest, MutualPointerLoop)
+{
+  _buf[7] = 2;
+
+  // A name at offset 12 that points to the second name (at offset 28),
+  // which points back to the first.
+  const unsigned char name1[] = {1, 'a', 0xc0, 28};
+  add(name1, sizeof(name1));
+  add(A_RECORD_BODY, sizeof(A_RECORD_BODY));
+  const unsigned char name2[] = {1, 'b', 0xc0, 12};
+  add(name2, sizeof(name2));
+  add(A_RECORD_BODY, sizeof(A_RECORD_BODY));
+
+  DnsParser parser(_buf, _length);
+  EXPECT_FALSE(parser.parse_refs());
+}
@@ -0,0 +1,141 @@
+/**
+ * @file weightedselector_test.cpp UT for the weighted selectors.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "weightedselector.h"
+
+// An item with a weight, as the selectors expect.
+struct Item
+{
+  int weight;
+  int get_weight() const { return weight; }
+};
+
+static std::vector<Item> make_items(const std::vector<int>& weights)
+{
+  std::vector<Item> items;
+
+  for (size_t ii = 0; ii < weights.size(); ++ii)
+  {
+    Item item = {weights[ii]};
+    items.push_back(item);
+  }
+
+  return items;
+}
+
+// AliasSelector whose random numbers step through every combination of
+// column and threshold in turn, so that a full cycle of selections gives the
+// exact distribution.
+class SteppingAliasSelector : public AliasSelector<Item>
+{
+public:
+  SteppingAliasSelector(const std::vector<Item>& items) :
+    AliasSelector<Item>(items),
+    _column(0),
+    _threshold(0),
+    _picking_column(true)
+  {
+  }
+
+  uint32_t get_rand(uint32_t n) const
+  {
+    uint32_t r;
+
+    if (_picking_column)
+    {
+      r = _column;
+    }
+    else
+    {
+      r = _threshold;
+
+      if (++_threshold == n)
+      {
+        _threshold = 0;
+        _column = (_column + 1) % size();
+      }
+    }
+
+    _picking_column = !_picking_column;
+    return r;
+  }
+
+private:
+  mutable uint32_t _column;
+  mutable uint32_t _threshold;
+  mutable bool _picking_column;
+};
+
+// Test that, over every combination of random numbers, each entry is
+// selected in exact proportion to its weight.
+TEST(AliasSelectorTest, ExactDistribution)
+{
+  std::vector<int> weights = {1, 7, 0, 3, 13, 6};
+  int total_weight = 30;
+  SteppingAliasSelector selector(make_items(weights));
+  std::vector<int> counts(weights.size(), 0);
+
+  for (int ii = 0; ii < (int)weights.size() * total_weight; ++ii)
+  {
+    counts[selector.select()]++;
+  }
+
+  for (size_t ii = 0; ii < weights.size(); ++ii)
+  {
+    EXPECT_EQ(weights[ii] * (int)weights.size(), counts[ii]);
+  }
+}
+
+// Test that entries are selected equally if all the weights are zero.
+TEST(AliasSelectorTest, AllZeroWeights)
+{
+  std::vector<int> weights = {0, 0, 0, 0};
+  SteppingAliasSelector selector(make_items(weights));
+  std::vector<int> counts(weights.size(), 0);
+
+  for (int ii = 0; ii < (int)(weights.size() * weights.size()); ++ii)
+  {
+    counts[selector.select()]++;
+  }
+
+  for (size_t ii = 0; ii < weights.size(); ++ii)
+  {
+    EXPECT_EQ((int)weights.size(), counts[ii]);
+  }
+}
+
+// Test that selections using the real random number generator follow the
+// weights.
+TEST(AliasSelectorTest, PickFrequencies)
+{
+  std::vector<int> weights = {10, 20, 30, 40, 0, 100};
+  int total_weight = 200;
+  AliasSelector<Item> selector(make_items(weights));
+  std::vector<int> counts(weights.size(), 0);
+  const int picks = 200000;
+
+  for (int ii = 0; ii < picks; ++ii)
+  {
+    counts[selector.select()]++;
+  }
+
+  for (size_t ii = 0; ii < weights.size(); ++ii)
+  {
+    // Allow 0.5% of the picks either way, which is over four standard
+    // deviations for every entry.
+    double expected = (double)picks * weights[ii] / total_weight;
+    EXPECT_NEAR(expected, counts[ii], picks * 0.005) << "Entry " << ii;
+  }
+}